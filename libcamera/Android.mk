@@ -7,8 +7,10 @@ LOCAL_SRC_FILES:= \
 	CameraHal_Module.cpp \
         V4L2Camera.cpp \
         CameraHardware.cpp \
-        convert.S \
-        rgbconvert.c
+        CameraStats.cpp \
+        ReplayCamera.cpp \
+        yuvscale.c.neon \
+        yuvmotion.c.neon
 
 LOCAL_C_INCLUDES += \
     $(LOCAL_PATH)/inc/ \
@@ -20,7 +22,11 @@ LOCAL_C_INCLUDES += \
     frameworks/base/include/media/stagefright \
     frameworks/base/include/media/stagefright/openmax \
     external/jpeg \
-    external/jhead
+    external/jhead \
+    $(LOCAL_PATH)/../libodroid-trace
+
+LOCAL_STATIC_LIBRARIES:= \
+    libodroid_trace
 
 LOCAL_SHARED_LIBRARIES:= \
     libui \
@@ -38,4 +44,22 @@ LOCAL_MODULE:= camera.$(TARGET_BOARD_PLATFORM)
 LOCAL_MODULE_TAGS:= optional
 
 include $(BUILD_SHARED_LIBRARY)
+
+# drives the HAL above through camera_device_ops with stub consumers,
+# fed by the replay backend or the sensor; see CameraHarness.cpp
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= \
+        CameraHarness.cpp
+
+LOCAL_SHARED_LIBRARIES:= \
+    libhardware \
+    libui \
+    libutils \
+    libcutils \
+    libcamera_client
+
+LOCAL_MODULE:= camera_harness
+LOCAL_MODULE_TAGS:= optional
+
+include $(BUILD_EXECUTABLE)
 endif
@@ -49,10 +49,14 @@
 #include <binder/MemoryHeapBase.h>
 #include <utils/threads.h>
 #include "V4L2Camera.h"
-#define LOG_FUNCTION_NAME           ALOGD("%d: %s() ENTER", __LINE__, __FUNCTION__);
+#include "odroid_trace.h"
+
+// entry points are traced to the binary ring, decoded by dumpsys
+#define LOG_FUNCTION_NAME           OTRACE_FUNC();
+
+#define MAX_CAMERAS_SUPPORTED       2
 
 using namespace android;
-static CameraHardware *V4L2CameraHardware;
 static int camera_device_open(const hw_module_t* module, const char* name,
                 hw_device_t** device);
 static int camera_device_close(hw_device_t* device);
@@ -82,8 +86,49 @@ typedef struct V4L2_camera_device {
     camera_device_t base;
     /* TI specific "private" data can go here (base.priv) */
     int cameraid;
+    int videonode;
+    CameraHardware *hardware;
 } V4l2_camera_device_t;
 
+/* open cameras by id, and the video node each one is bound to */
+static Mutex gCameraLock;
+static V4l2_camera_device_t *gCameraDevices[MAX_CAMERAS_SUPPORTED];
+
+static inline CameraHardware *to_hardware(struct camera_device *device)
+{
+    return ((V4l2_camera_device_t *)device)->hardware;
+}
+
+/*
+ * Camera N prefers /dev/video(MAX_VIDEONODE - N) and otherwise takes the
+ * highest node present that no other open camera is bound to, so a lone
+ * camera works on either node and two cameras never share one.
+ * Called with gCameraLock held.
+ */
+static int camera_pick_video_node(int cameraid)
+{
+    char devnode[16];
+    int preferred = MAX_VIDEONODE - cameraid;
+    int node;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (node = MAX_VIDEONODE; node >= MIN_VIDEONODE; node--) {
+            bool claimed = false;
+
+            if (pass == 0 && node != preferred)
+                continue;
+            for (int i = 0; i < MAX_CAMERAS_SUPPORTED; i++)
+                if (gCameraDevices[i] && gCameraDevices[i]->videonode == node)
+                    claimed = true;
+            snprintf(devnode, sizeof(devnode), "/dev/video%d", node);
+            if (!claimed && access(devnode, F_OK) == 0)
+                return node;
+        }
+    }
+
+    return -1;
+}
+
 
 /*******************************************************************
  * implementation of camera_device_ops functions
@@ -100,12 +145,11 @@ int camera_set_preview_window(struct camera_device * device,
     if(window==NULL)
     {
         ALOGW("window is NULL");
-        V4L2CameraHardware->setPreviewWindow(window);
+        to_hardware(device)->setPreviewWindow(window);
      return -1; 
     }
 
-        V4L2CameraHardware->setPreviewWindow(window);
-    ALOGD("Exiting the function");
+        to_hardware(device)->setPreviewWindow(window);
     return 0;
 }
 
@@ -118,7 +162,7 @@ void camera_set_callbacks(struct camera_device * device,
 {
     V4l2_camera_device_t* V4l2_dev = NULL;
     LOG_FUNCTION_NAME
-    V4L2CameraHardware->setCallbacks(notify_cb,data_cb,data_cb_timestamp,get_memory,user);
+    to_hardware(device)->setCallbacks(notify_cb,data_cb,data_cb_timestamp,get_memory,user);
 }
 
 void camera_enable_msg_type(struct camera_device * device, int32_t msg_type)
@@ -126,39 +170,39 @@ void camera_enable_msg_type(struct camera_device * device, int32_t msg_type)
     V4l2_camera_device_t* V4l2_dev = NULL;
 
     LOG_FUNCTION_NAME
-    V4L2CameraHardware->enableMsgType(msg_type);
+    to_hardware(device)->enableMsgType(msg_type);
 }
 
 void camera_disable_msg_type(struct camera_device * device, int32_t msg_type)
 {
     V4l2_camera_device_t* V4l2_dev = NULL;
     LOG_FUNCTION_NAME
-    V4L2CameraHardware->disableMsgType(msg_type);
+    to_hardware(device)->disableMsgType(msg_type);
 }
 
 int camera_msg_type_enabled(struct camera_device * device, int32_t msg_type)
 {
     V4l2_camera_device_t* V4l2_dev = NULL;
     LOG_FUNCTION_NAME
-    return V4L2CameraHardware->msgTypeEnabled(msg_type);
+    return to_hardware(device)->msgTypeEnabled(msg_type);
 }
 
 int camera_start_preview(struct camera_device * device)
 {
     LOG_FUNCTION_NAME
-    return V4L2CameraHardware->startPreview();
+    return to_hardware(device)->startPreview();
 }
 
 void camera_stop_preview(struct camera_device * device)
 {
 LOG_FUNCTION_NAME
-V4L2CameraHardware->stopPreview();
+to_hardware(device)->stopPreview();
 }
 
 int camera_preview_enabled(struct camera_device * device)
 {
     LOG_FUNCTION_NAME
-    if(V4L2CameraHardware->previewEnabled())
+    if(to_hardware(device)->previewEnabled())
     {
         ALOGW("----Preview Enabled----");
         return 1;
@@ -180,106 +224,93 @@ int camera_store_meta_data_in_buffers(struct camera_device * device, int enable)
 int camera_start_recording(struct camera_device * device)
 {
 LOG_FUNCTION_NAME
-    return V4L2CameraHardware->startRecording();
+    return to_hardware(device)->startRecording();
 }
 
 void camera_stop_recording(struct camera_device * device)
 {
 LOG_FUNCTION_NAME
-    V4L2CameraHardware->stopRecording();
+    to_hardware(device)->stopRecording();
 }
 
 int camera_recording_enabled(struct camera_device * device)
 {
     LOG_FUNCTION_NAME
-    return V4L2CameraHardware->recordingEnabled();
+    return to_hardware(device)->recordingEnabled();
 }
 
 void camera_release_recording_frame(struct camera_device * device,
                 const void *opaque)
 {
     LOG_FUNCTION_NAME
-    return V4L2CameraHardware->releaseRecordingFrame(opaque);
+    return to_hardware(device)->releaseRecordingFrame(opaque);
 }
 
 int camera_auto_focus(struct camera_device * device)
 {
     LOG_FUNCTION_NAME
-    return V4L2CameraHardware->autoFocus(); 
+    return to_hardware(device)->autoFocus(); 
 }
 
 int camera_cancel_auto_focus(struct camera_device * device)
 {
 LOG_FUNCTION_NAME
-    return V4L2CameraHardware->cancelAutoFocus();
+    return to_hardware(device)->cancelAutoFocus();
 }
 
 int camera_take_picture(struct camera_device * device)
 {
 LOG_FUNCTION_NAME
-    return V4L2CameraHardware->takePicture();
+    return to_hardware(device)->takePicture();
 }
 
 int camera_cancel_picture(struct camera_device * device)
 {
     int rv = 0;// -EINVAL;
     LOG_FUNCTION_NAME
-    return  V4L2CameraHardware->cancelPicture();
+    return  to_hardware(device)->cancelPicture();
 }
 
 int camera_set_parameters(struct camera_device * device, const char *params)
 {
     LOG_FUNCTION_NAME
-    CameraParameters *camParams = new CameraParameters();
-    String8 *params_str8 = new String8(params);
-    camParams->unflatten(*params_str8);
-    return  V4L2CameraHardware->setParameters(*camParams);
+    CameraParameters camParams;
+    camParams.unflatten(String8(params));
+    return  to_hardware(device)->setParameters(camParams);
 }
 
 char* camera_get_parameters(struct camera_device * device)
 {
-    char* param = NULL ;
-#if 1
-    String8 params_str8 = V4L2CameraHardware->getParameters().flatten();
-    // camera service frees this string...
-    param = (char*) malloc(sizeof(char) * (params_str8.length()+1));
-    strcpy(param, params_str8.string());
-    ALOGD("%s",param);
-#endif
     LOG_FUNCTION_NAME
-    return param;
+    // camera service hands this back through put_parameters
+    return to_hardware(device)->getParametersString();
 }
 
+/* hands back the string returned by camera_get_parameters */
 static void camera_put_parameters(struct camera_device *device, char *params)
 {
     LOG_FUNCTION_NAME
-    ALOGD("params are %s",params);
-    CameraParameters *camParams = new CameraParameters();
-    String8 *params_str8 = new String8(params);
-    camParams->unflatten(*params_str8);
-    V4L2CameraHardware->setParameters(*camParams);
+    free(params);
 }
 
 int camera_send_command(struct camera_device * device,
             int32_t cmd, int32_t arg1, int32_t arg2)
 {
-    int rv =0;// -EINVAL;
     LOG_FUNCTION_NAME
-    return rv;
+    return to_hardware(device)->sendCommand(cmd, arg1, arg2);
 }
 
 void camera_release(struct camera_device * device)
 {
 LOG_FUNCTION_NAME
-    V4L2CameraHardware->release();
+    to_hardware(device)->release();
 }
 
 
 int camera_dump(struct camera_device * device, int fd)
 {
-    int rv = 0;//-EINVAL;
     LOG_FUNCTION_NAME
-    return rv;
+    return to_hardware(device)->dump(fd, Vector<String16>());
 }
 
 extern "C" void heaptracker_free_leaked_memory(void);
@@ -287,9 +318,16 @@ extern "C" void heaptracker_free_leaked_memory(void);
 int camera_device_close(hw_device_t* device)
 {
     int ret = 0;
+    V4l2_camera_device_t* V4l2_dev = (V4l2_camera_device_t*)device;
     LOG_FUNCTION_NAME
-    delete V4L2CameraHardware;
-    V4L2CameraHardware=NULL;
+
+    {
+        Mutex::Autolock lock(gCameraLock);
+        gCameraDevices[V4l2_dev->cameraid] = NULL;
+    }
+    delete V4l2_dev->hardware;
+    free(V4l2_dev->base.ops);
+    free(V4l2_dev);
     return ret;
 }
 
@@ -307,20 +345,23 @@ int camera_device_open(const hw_module_t* module, const char* name,
                 hw_device_t** device)
 {
     int rv = 0;
-    int num_cameras = 1;
+    int num_cameras = MAX_CAMERAS_SUPPORTED;
     int cameraid;
+    int videonode;
+    char replay[PROPERTY_VALUE_MAX];
     V4l2_camera_device_t* camera_device = NULL;
     camera_device_ops_t* camera_ops = NULL;
 
     LOG_FUNCTION_NAME
 
+    Mutex::Autolock lock(gCameraLock);
 
     ALOGI("camera_device open");
 
     if (name != NULL) {
         cameraid = atoi(name);
 
-        if(cameraid > num_cameras)
+        if(cameraid < 0 || cameraid >= num_cameras)
         {
             ALOGE("camera service provided cameraid out of bounds, "
                     "cameraid = %d, num supported = %d",
@@ -329,6 +370,23 @@ int camera_device_open(const hw_module_t* module, const char* name,
             goto fail;
         }
 
+        if (gCameraDevices[cameraid] != NULL) {
+            ALOGE("camera %d is already open", cameraid);
+            rv = -EBUSY;
+            goto fail;
+        }
+
+        if (ReplayCamera::GetDevice(cameraid, replay, sizeof(replay))) {
+            videonode = -1;
+        } else {
+            videonode = camera_pick_video_node(cameraid);
+            if (videonode < 0) {
+                ALOGE("no free video node for camera %d", cameraid);
+                rv = -ENODEV;
+                goto fail;
+            }
+        }
+
 
         camera_device = (V4l2_camera_device_t*)malloc(sizeof(*camera_device));
         if(!camera_device)
@@ -384,7 +442,13 @@ int camera_device_open(const hw_module_t* module, const char* name,
         // -------- TI specific stuff --------
 
         camera_device->cameraid = cameraid;
-        V4L2CameraHardware = new CameraHardware(0);
+        camera_device->videonode = videonode;
+        camera_device->hardware = new CameraHardware(cameraid, videonode);
+        gCameraDevices[cameraid] = camera_device;
+        if (videonode < 0)
+            ALOGI("camera %d replays %s", cameraid, replay);
+        else
+            ALOGI("camera %d bound to /dev/video%d", cameraid, videonode);
     }
 
     return rv;
@@ -405,7 +469,7 @@ fail:
 int camera_get_number_of_cameras(void)
 {
 LOG_FUNCTION_NAME
-    int num_cameras =2;// MAX_CAMERAS_SUPPORTED;
+    int num_cameras = MAX_CAMERAS_SUPPORTED;
     return num_cameras;
 }
 
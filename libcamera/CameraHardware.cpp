@@ -19,17 +19,19 @@
 */
 
 #define LOG_TAG "CameraHardware"
+#define ATRACE_TAG ATRACE_TAG_CAMERA
 #include <utils/Log.h>
+#include <utils/Trace.h>
 
 #include "CameraHardware.h"
+#include "odroid_trace.h"
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <cutils/native_handle.h>
 #include <hal_public.h>
 #include <ui/GraphicBufferMapper.h>
 #include <gui/IGraphicBufferProducer.h>
-#define MAX_VIDEONODE      5
-#define MIN_VIDEONODE      4
 #define MIN_WIDTH           320
 #define MIN_HEIGHT          240
 #define CAM_SIZE            "320x240"
@@ -39,26 +41,126 @@
                              GRALLOC_USAGE_SW_READ_RARELY | \
                              GRALLOC_USAGE_SW_WRITE_NEVER
 
-extern "C" {
-    void yuyv422_to_yuv420sp(unsigned char*,unsigned char*,int,int);
-    void convertYUYVtoRGB565(unsigned char *buf, unsigned char *rgb, int width, int height);
-}
-
 namespace android {
 
 
 const char supportedFpsRanges [] = "(8000,8000),(8000,10000),(10000,10000),(8000,15000),(15000,15000),(8000,20000),(20000,20000),(24000,24000),(25000,25000),(8000,30000),(30000,30000)";
 
-CameraHardware::CameraHardware(int cameraId)
+/* Vendor keys selecting what each consumer does when it falls behind. */
+static const char KEY_DISPLAY_POLICY[]   = "odroid-display-policy";
+static const char KEY_CALLBACK_POLICY[]  = "odroid-callback-policy";
+static const char KEY_RECORD_POLICY[]    = "odroid-record-policy";
+static const char KEY_SUPPORTED_POLICIES[] = "odroid-frame-policy-values";
+static const char KEY_DISPLAY_DROPS[]    = "odroid-display-drops";
+static const char KEY_CALLBACK_DROPS[]   = "odroid-callback-drops";
+static const char KEY_RECORD_DROPS[]     = "odroid-record-drops";
+
+/*
+ * The device runs at one capture size and every consumer is scaled from
+ * it.  "auto" picks the smallest mode that covers the preview, callback
+ * and video sizes, "sensor" the largest one, or a mode can be named.
+ */
+static const char KEY_CAPTURE_SIZE[]     = "odroid-capture-size";
+static const char KEY_CAPTURE_SIZE_VALUES[] = "odroid-capture-size-values";
+static const char KEY_CALLBACK_SIZE[]    = "odroid-callback-size";
+static const char CAPTURE_SIZE_AUTO[]    = "auto";
+static const char CAPTURE_SIZE_SENSOR[]  = "sensor";
+static const char KEY_LUMA_STATS[]       = "odroid-luma-stats";
+static const char KEY_EXPOSURE_CONTROL[] = "odroid-exposure-control";
+// read only, present while statistics are collected
+static const char KEY_LUMA_MEAN[]        = "odroid-luma-mean";
+static const char KEY_LUMA_HISTOGRAM[]   = "odroid-luma-histogram";
+static const char KEY_LUMA_REGIONS[]     = "odroid-luma-regions";
+static const char KEY_EXPOSURE[]         = "odroid-exposure";
+
+// mean luma the exposure loop aims at, per 1/3 EV of compensation
+static const int kExposureTargets[] = { 59, 74, 94, 118, 149, 187, 236 };
+static const int kMaxExposureCompensation = 3;
+
+/* Digital zoom steps, in percent as reported through KEY_ZOOM_RATIOS. */
+static const int kZoomRatios[] = {
+    100, 125, 150, 175, 200, 225, 250, 275, 300, 325, 350, 375, 400,
+};
+static const int kZoomSteps = sizeof(kZoomRatios) / sizeof(kZoomRatios[0]);
+static const char supportedZoomRatios[] =
+    "100,125,150,175,200,225,250,275,300,325,350,375,400";
+
+static const char POLICY_LATEST[]  = "latest";
+static const char POLICY_BOUNDED[] = "bounded";
+static const char POLICY_BLOCK[]   = "block";
+
+static const char * const policyNames[] = {
+    POLICY_LATEST,
+    POLICY_BOUNDED,
+    POLICY_BLOCK,
+};
+
+CameraHardware::CameraHardware(int cameraId, int videoNode)
                   : mCameraId(cameraId),
                     mParameters(),
                     mHeap(0),
                     mPreviewHeap(0),
-                    mRecordHeap(0),
                     mRawHeap(0),
                     mPreviewFrameSize(0),
+                    mCaptureSizeCount(0),
+                    mCaptureWidth(0),
+                    mCaptureHeight(0),
                     mCurrentPreviewFrame(0),
+                    mFrameWidth(0),
+                    mFrameHeight(0),
+                    mFrameZoomRatio(100),
+                    mFrameDequeued(0),
+                    mMotionActive(false),
+                    mExposureActive(false),
+                    mExposureUnsupported(false),
+                    mExposureValue(0),
+                    mExposureMin(0),
+                    mExposureMax(0),
+                    mExposureFrames(0),
+                    mZoom(0),
+                    mCallbackWidth(0),
+                    mCallbackHeight(0),
+                    mMotionThreshold(0),
+                    mMotionMinBlocks(1),
+                    mLumaStats(false),
+                    mExposureControl(false),
+                    mExposureTarget(118),
+                    mLumaSeq(0),
+                    mLumaExposure(-1),
                     mRecordRunning(false),
+                    mParamsVersion(1),
+                    mFlatVersion(0),
+                    mFlatLumaSeq(0),
+                    mCallbackMem(NULL),
+                    mCallbackFrameSize(0),
+                    mCallbackBusy(-1),
+                    mRecordMem(NULL),
+                    mRecordFrameSize(0),
+                    mRecordWidth(0),
+                    mRecordHeight(0),
+                    mRecordPosting(false),
+                    mBurstRing(NULL),
+                    mBurstRingSize(0),
+                    mBurstFrameSize(0),
+                    mBurstWidth(0),
+                    mBurstHeight(0),
+                    mBurstTotal(0),
+                    mBurstCaptured(0),
+                    mBurstEncodeNext(0),
+                    mBurstDelivered(0),
+                    mBurstWorkersRunning(0),
+                    mBurstCancel(false),
+                    mJpegQuality(100),
+                    mPictureRunning(false),
+                    mPictureCancel(false),
+                    mPictureRequested(0),
+                    mStillBuffer(NULL),
+                    mStillWidth(0),
+                    mStillHeight(0),
+                    mStillZoomRatio(100),
+                    mStillRequest(false),
+                    mStillBusy(false),
+                    mStillDone(false),
                     previewStopped(true),
                     nQueued(0),
                     nDequeued(0),
@@ -68,6 +170,29 @@ CameraHardware::CameraHardware(int cameraId)
                     mUser(NULL),
                     mMsgEnabled(0)
 {
+    mPolicy[CONSUMER_DISPLAY] = FRAME_POLICY_LATEST;
+    mPolicy[CONSUMER_CALLBACK] = FRAME_POLICY_LATEST;
+    mPolicy[CONSUMER_RECORD] = FRAME_POLICY_BOUNDED;
+    memset(mDropped, 0, sizeof(mDropped));
+    memset(mFlatDropped, 0, sizeof(mFlatDropped));
+    memset(&mDisplayScaler, 0, sizeof(mDisplayScaler));
+    memset(&mCallbackScaler, 0, sizeof(mCallbackScaler));
+    memset(&mRecordScaler, 0, sizeof(mRecordScaler));
+    memset(&mBurstScaler, 0, sizeof(mBurstScaler));
+    memset(&mStillScaler, 0, sizeof(mStillScaler));
+    memset(&mMotion, 0, sizeof(mMotion));
+    memset(&mLuma, 0, sizeof(mLuma));
+    memset(mRecordBusy, 0, sizeof(mRecordBusy));
+    memset(mCallbackStamp, 0, sizeof(mCallbackStamp));
+    // no video node means a recording is played back instead
+    if (videoNode < 0 && ReplayCamera::GetDevice(cameraId, mDevice, sizeof(mDevice))) {
+        camera = new ReplayCamera();
+    } else {
+        snprintf(mDevice, sizeof(mDevice), "/dev/video%d", videoNode);
+        camera = new V4L2Camera();
+    }
+    mCaptureSizeCount = camera->EnumFrameSizes(mDevice, PIXEL_FORMAT,
+                                               mCaptureSizes, kMaxCaptureSizes);
     initDefaultParameters();
     mNativeWindow=NULL;
 }
@@ -90,6 +215,33 @@ void CameraHardware::initDefaultParameters()
     p.set(CameraParameters::KEY_EXPOSURE_COMPENSATION_STEP, "0");
     p.set(CameraParameters::KEY_VIDEO_STABILIZATION_SUPPORTED, "false");
     p.set(CameraParameters::KEY_SUPPORTED_PREVIEW_FRAME_RATES, "8,10,12,15,20,24,25,30");
+    p.set(KEY_SUPPORTED_POLICIES, "latest,bounded,block");
+    p.set(KEY_DISPLAY_POLICY, policyNames[mPolicy[CONSUMER_DISPLAY]]);
+    p.set(KEY_CALLBACK_POLICY, policyNames[mPolicy[CONSUMER_CALLBACK]]);
+    p.set(KEY_RECORD_POLICY, policyNames[mPolicy[CONSUMER_RECORD]]);
+    p.set(CameraParameters::KEY_ZOOM, 0);
+
+    p.set(CameraParameters::KEY_SUPPORTED_VIDEO_SIZES, CAM_SIZE);
+    p.set(CameraParameters::KEY_PREFERRED_PREVIEW_SIZE_FOR_VIDEO, CAM_SIZE);
+    p.set(CameraParameters::KEY_VIDEO_SIZE, CAM_SIZE);
+    p.set(KEY_CAPTURE_SIZE, CAPTURE_SIZE_AUTO);
+    p.set(KEY_LUMA_STATS, "off");
+    p.set(KEY_EXPOSURE_CONTROL, "off");
+    if (mCaptureSizeCount > 0) {
+        String8 sizes;
+
+        for (int i = 0; i < mCaptureSizeCount; i++)
+            sizes.appendFormat(i ? ",%dx%d" : "%dx%d",
+                               mCaptureSizes[i].width, mCaptureSizes[i].height);
+        // stills default to the full sensor
+        p.setPictureSize(mCaptureSizes[0].width, mCaptureSizes[0].height);
+        p.set(p.KEY_SUPPORTED_PICTURE_SIZES, sizes.string());
+        p.set(KEY_CAPTURE_SIZE_VALUES,
+              String8::format("%s,%s,%s", CAPTURE_SIZE_AUTO, CAPTURE_SIZE_SENSOR,
+                              sizes.string()).string());
+    } else {
+        p.set(KEY_CAPTURE_SIZE_VALUES, CAPTURE_SIZE_AUTO);
+    }
 
     if (setParameters(p) != NO_ERROR) {
         ALOGE("Failed to set default parameters?!");
@@ -98,6 +250,14 @@ void CameraHardware::initDefaultParameters()
 
 CameraHardware::~CameraHardware()
 {
+    free(mBurstRing);
+    yuyv_scaler_free(&mDisplayScaler);
+    yuyv_scaler_free(&mCallbackScaler);
+    yuyv_scaler_free(&mRecordScaler);
+    yuyv_scaler_free(&mBurstScaler);
+    yuyv_scaler_free(&mStillScaler);
+    yuyv_motion_free(&mMotion);
+    delete camera;
 }
 
 sp<IMemoryHeap> CameraHardware::getPreviewHeap() const
@@ -130,6 +290,8 @@ int CameraHardware::setPreviewWindow( preview_stream_ops_t *window)
 {
     int err;
     Mutex::Autolock lock(mLock);
+    // waits for a frame being displayed to be done with the old window
+    Mutex::Autolock windowLock(mWindowLock);
         if(mNativeWindow)
             mNativeWindow=NULL;
     if(window==NULL)
@@ -178,55 +340,347 @@ bool CameraHardware::msgTypeEnabled(int32_t msgType)
 }
 
 
+// called with mLock held
+int CameraHardware::previewFrameRate() const
+{
+    int minFps, maxFps;
+
+    mParameters.getPreviewFpsRange(&minFps, &maxFps);
+    if (maxFps >= 1000)
+        return maxFps / 1000;
+    return mParameters.getPreviewFrameRate();
+}
+
 //-------------------------------------------------------------
-int CameraHardware::previewThread()
+void CameraHardware::displayFrame(void *frame, int width, int height)
 {
-    int width, height;
-    int err;
     IMG_native_handle_t** hndl2hndl;
-    IMG_native_handle_t* handle;
     int stride;
-    mParameters.getPreviewSize(&width, &height);
-    int framesize= width * height * 1.5 ; //yuv420sp
+    int err;
+    void *dst;
 
-   if (!previewStopped) {
-    mLock.lock();
-    if (mNativeWindow != NULL)
+    if (yuyv_scaler_zoom(&mDisplayScaler, mFrameWidth, mFrameHeight,
+                         mFrameZoomRatio, width, height) != 0) {
+        __sync_fetch_and_add(&mDropped[CONSUMER_DISPLAY], 1);
+        return;
+    }
+
+    // the window may not be used once setPreviewWindow() has replaced it
+    Mutex::Autolock lock(mWindowLock);
+    if (mNativeWindow == NULL)
+        return;
     {
-    if ((err = mNativeWindow->dequeue_buffer(mNativeWindow,(buffer_handle_t**) &hndl2hndl,&stride)) != 0) {
+        StageTimer t(mStats, CameraStats::STAGE_WINDOW_DEQUEUE);
+        err = mNativeWindow->dequeue_buffer(mNativeWindow,(buffer_handle_t**) &hndl2hndl,&stride);
+    }
+    if (err != 0) {
         ALOGW("Surface::dequeueBuffer returned error %d", err);
-        return -1;
+        __sync_fetch_and_add(&mDropped[CONSUMER_DISPLAY], 1);
+        return;
     }
     mNativeWindow->lock_buffer(mNativeWindow, (buffer_handle_t*) hndl2hndl);
     GraphicBufferMapper &mapper = GraphicBufferMapper::get();
 
     Rect bounds(width, height);
-    void *tempbuf;
-    void *dst;
-    if(0 == mapper.lock((buffer_handle_t)*hndl2hndl,CAMHAL_GRALLOC_USAGE, bounds, &dst)); 
+    if (mapper.lock((buffer_handle_t)*hndl2hndl,CAMHAL_GRALLOC_USAGE, bounds, &dst) != 0) {
+        ALOGW("displayFrame: unable to lock preview buffer");
+        mNativeWindow->cancel_buffer(mNativeWindow,(buffer_handle_t*) hndl2hndl);
+        __sync_fetch_and_add(&mDropped[CONSUMER_DISPLAY], 1);
+        return;
+    }
     {
-        // Get preview frame
-        tempbuf=camera.GrabPreviewFrame();
-        convertYUYVtoRGB565((unsigned char *)tempbuf,(unsigned char *)dst, width, height);
-        mapper.unlock((buffer_handle_t)*hndl2hndl);
+        StageTimer t(mStats, CameraStats::STAGE_RGB);
+        yuyv_scale_to_rgb565(&mDisplayScaler, (const uint8_t *)frame,
+                             (uint16_t *)dst, stride);
+    }
+    mStats.addBytes(width * height * 2);
+    mapper.unlock((buffer_handle_t)*hndl2hndl);
+    {
+        StageTimer t(mStats, CameraStats::STAGE_ENQUEUE);
         mNativeWindow->enqueue_buffer(mNativeWindow,(buffer_handle_t*) hndl2hndl);
-        if ((mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME) ||
-                (mMsgEnabled & CAMERA_MSG_VIDEO_FRAME)) {
-            camera_memory_t* picture = mRequestMemory(-1, framesize, 1, NULL);
-            yuyv422_to_yuv420sp((unsigned char *)tempbuf,(unsigned char *) picture->data, width, height);
-            if ((mMsgEnabled & CAMERA_MSG_VIDEO_FRAME ) && mRecordRunning ) {
-                nsecs_t timeStamp = systemTime(SYSTEM_TIME_MONOTONIC);
-                //mTimestampFn(timeStamp, CAMERA_MSG_VIDEO_FRAME,mRecordBuffer, mUser);
+    }
+    mStats.latency(CameraStats::PATH_DISPLAY, mFrameDequeued);
+}
+
+/*
+ * Hands a preview frame to the callback thread.  A slot is claimed under
+ * mCallbackLock and filled without it, so the dispatcher is never stalled
+ * by a conversion.  Frames the policy would discard are never converted.
+ */
+void CameraHardware::postPreviewFrame(void *frame, int width, int height,
+                                      FramePolicy policy)
+{
+    int framesize = width * height * 3 / 2; //yuv420sp
+    int slot = -1;
+
+    if (yuyv_scaler_zoom(&mCallbackScaler, mFrameWidth, mFrameHeight,
+                         mFrameZoomRatio, width, height) != 0)
+        return;
+
+    {
+        Mutex::Autolock lock(mCallbackLock);
+
+        if (mCallbackMem == NULL || mCallbackFrameSize != framesize) {
+            if (mCallbackBusy >= 0)
+                return;
+            if (mCallbackMem != NULL)
+                mCallbackMem->release(mCallbackMem);
+            mCallbackQueue.clear();
+            mCallbackMem = mRequestMemory(-1, framesize, kCallbackBufferCount, NULL);
+            mCallbackFrameSize = mCallbackMem ? framesize : 0;
+            if (mCallbackMem == NULL)
+                return;
+        }
+
+        switch (policy) {
+        case FRAME_POLICY_BLOCK:
+            while ((int)mCallbackQueue.size() >= kCallbackBufferCount - 1 &&
+                   !previewStopped)
+                mCallbackCond.waitRelative(mCallbackLock, kBlockTimeout);
+            break;
+        case FRAME_POLICY_LATEST:
+            // take back the frame nobody has seen yet and overwrite it
+            if (!mCallbackQueue.isEmpty()) {
+                slot = mCallbackQueue.top();
+                mCallbackQueue.pop();
+                __sync_fetch_and_add(&mDropped[CONSUMER_CALLBACK], 1);
+            }
+            break;
+        case FRAME_POLICY_BOUNDED:
+        default:
+            break;
+        }
+
+        if (slot < 0) {
+            if ((int)mCallbackQueue.size() >= kCallbackBufferCount - 1) {
+                __sync_fetch_and_add(&mDropped[CONSUMER_CALLBACK], 1);
+                return;
+            }
+            for (slot = 0; slot < kCallbackBufferCount; slot++) {
+                if (slot == mCallbackBusy)
+                    continue;
+                size_t i;
+                for (i = 0; i < mCallbackQueue.size(); i++)
+                    if (mCallbackQueue[i] == slot)
+                        break;
+                if (i == mCallbackQueue.size())
+                    break;
             }
-            mDataFn(CAMERA_MSG_PREVIEW_FRAME,picture,0,NULL,mUser);
-	    picture->release(picture);
-	}
-        camera.ReleasePreviewFrame();
+        }
+    }
+
+    ATRACE_INT("cameraCallbackDrops", mDropped[CONSUMER_CALLBACK]);
+    unsigned char *dst = (unsigned char *)mCallbackMem->data + slot * framesize;
+    {
+        StageTimer t(mStats, CameraStats::STAGE_NV21);
+        yuyv_scale_to_nv21(&mCallbackScaler, (const uint8_t *)frame, dst);
+    }
+    mStats.addBytes(framesize);
+
+    Mutex::Autolock lock(mCallbackLock);
+    mCallbackQueue.push(slot);
+    mCallbackStamp[slot] = mFrameDequeued;
+    mCallbackCond.broadcast();
+}
+
+/*
+ * Recording buffers stay with the encoder until releaseRecordingFrame(),
+ * so the pool itself is the queue: a frame needs a free buffer or it is
+ * dropped (or, with FRAME_POLICY_BLOCK, capture waits for one).
+ */
+void CameraHardware::postRecordingFrame(void *frame, FramePolicy policy)
+{
+    int framesize;
+    int slot;
+
+    {
+        Mutex::Autolock lock(mRecordLock);
+
+        if (mRecordMem == NULL)
+            return;
+        if (yuyv_scaler_zoom(&mRecordScaler, mFrameWidth, mFrameHeight,
+                             mFrameZoomRatio, mRecordWidth, mRecordHeight) != 0)
+            return;
+        framesize = mRecordFrameSize;
+
+        for (;;) {
+            for (slot = 0; slot < kRecordBufferCount; slot++)
+                if (!mRecordBusy[slot])
+                    break;
+            if (slot < kRecordBufferCount || policy != FRAME_POLICY_BLOCK ||
+                !mRecordRunning || previewStopped)
+                break;
+            mRecordCond.waitRelative(mRecordLock, kBlockTimeout);
+        }
+
+        if (slot == kRecordBufferCount) {
+            __sync_fetch_and_add(&mDropped[CONSUMER_RECORD], 1);
+            ATRACE_INT("cameraRecordDrops", mDropped[CONSUMER_RECORD]);
+            return;
+        }
+        mRecordBusy[slot] = true;
+        mRecordPosting = true;
     }
+
+    nsecs_t timeStamp = systemTime(SYSTEM_TIME_MONOTONIC);
+    unsigned char *dst = (unsigned char *)mRecordMem->data + slot * framesize;
+    {
+        StageTimer t(mStats, CameraStats::STAGE_NV21);
+        yuyv_scale_to_nv21(&mRecordScaler, (const uint8_t *)frame, dst);
+    }
+    mStats.addBytes(framesize);
+    {
+        StageTimer t(mStats, CameraStats::STAGE_CALLBACK);
+        mTimestampFn(timeStamp, CAMERA_MSG_VIDEO_FRAME, mRecordMem, slot, mUser);
     }
+    mStats.latency(CameraStats::PATH_RECORD, mFrameDequeued);
+
+    Mutex::Autolock lock(mRecordLock);
+    mRecordPosting = false;
+    mRecordCond.broadcast();
+}
+
+int CameraHardware::callbackThread()
+{
+    int slot;
+    nsecs_t stamp;
+
+    mCallbackLock.lock();
+    if (mCallbackQueue.isEmpty())
+        mCallbackCond.waitRelative(mCallbackLock, kBlockTimeout);
+    if (mCallbackQueue.isEmpty()) {
+        mCallbackLock.unlock();
+        return NO_ERROR;
+    }
+    slot = mCallbackQueue[0];
+    mCallbackQueue.removeAt(0);
+    mCallbackBusy = slot;
+    stamp = mCallbackStamp[slot];
+    mCallbackLock.unlock();
+
+    if (mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME) {
+        {
+            StageTimer t(mStats, CameraStats::STAGE_CALLBACK);
+            mDataFn(CAMERA_MSG_PREVIEW_FRAME, mCallbackMem, slot, NULL, mUser);
+        }
+        mStats.latency(CameraStats::PATH_CALLBACK, stamp);
+    }
+
+    mCallbackLock.lock();
+    mCallbackBusy = -1;
+    mCallbackCond.broadcast();
+    mCallbackLock.unlock();
+
+    return NO_ERROR;
+}
+
+void *CameraHardware::grabFrame()
+{
+    void *frame;
+
+    {
+        StageTimer t(mStats, CameraStats::STAGE_DQBUF);
+        frame = camera->GrabPreviewFrame();
+    }
+    if (frame != NULL) {
+        mFrameDequeued = systemTime(SYSTEM_TIME_MONOTONIC);
+        mStats.frameCaptured(camera->FrameSequence());
+    }
+    return frame;
+}
+
+int CameraHardware::previewThread()
+{
+    ATRACE_CALL();
+    int width, height;
+    int callbackWidth, callbackHeight;
+    void *tempbuf;
+    int32_t msgs;
+    FramePolicy policy[CONSUMER_COUNT];
+    bool display, callback, record, still;
+    int motionThreshold, motionMinBlocks, exposureTarget;
+    bool lumaStats;
+
+    if (previewStopped)
+        return NO_ERROR;
+
+    mLock.lock();
+    mParameters.getPreviewSize(&width, &height);
+    callbackWidth = mCallbackWidth ? mCallbackWidth : width;
+    callbackHeight = mCallbackHeight ? mCallbackHeight : height;
+    msgs = mMsgEnabled;
+    memcpy(policy, mPolicy, sizeof(policy));
+    mFrameZoomRatio = kZoomRatios[mZoom];
+    still = mStillRequest;
+    motionThreshold = (msgs & CAMERA_MSG_PREVIEW_METADATA) ? mMotionThreshold : 0;
+    motionMinBlocks = mMotionMinBlocks;
+    lumaStats = mLumaStats || mExposureControl;
+    exposureTarget = mExposureControl ? mExposureTarget : 0;
+    display = mNativeWindow != NULL;
     mLock.unlock();
+
+    callback = (msgs & CAMERA_MSG_PREVIEW_FRAME) != 0;
+    record = (msgs & CAMERA_MSG_VIDEO_FRAME) && mRecordRunning;
+
+    // Get preview frame
+    tempbuf = grabFrame();
+    if (tempbuf == NULL)
+        return -1;
+
+    /*
+     * When no active consumer needs every frame, requeue stale buffers
+     * straight away and work on the newest one, so a slow consumer costs
+     * latency on neither the driver nor the other consumers.
+     */
+    if (mBurstTotal == 0 &&
+        policy[CONSUMER_DISPLAY] == FRAME_POLICY_LATEST &&
+        (!callback || policy[CONSUMER_CALLBACK] == FRAME_POLICY_LATEST) &&
+        (!record || policy[CONSUMER_RECORD] == FRAME_POLICY_LATEST)) {
+        while (camera->FrameReady()) {
+            camera->ReleasePreviewFrame();
+            if (display)
+                __sync_fetch_and_add(&mDropped[CONSUMER_DISPLAY], 1);
+            if (callback)
+                __sync_fetch_and_add(&mDropped[CONSUMER_CALLBACK], 1);
+            if (record)
+                __sync_fetch_and_add(&mDropped[CONSUMER_RECORD], 1);
+            tempbuf = grabFrame();
+            if (tempbuf == NULL)
+                return -1;
+        }
     }
 
+    // consumers are scaled from whatever the driver actually delivers
+    mFrameWidth = camera->Width();
+    mFrameHeight = camera->Height();
+
+    if (motionThreshold > 0 || lumaStats) {
+        analyzeFrame(tempbuf, motionThreshold, motionMinBlocks,
+                     lumaStats, exposureTarget);
+    } else {
+        yuyv_motion_reset(&mMotion);
+        mMotionActive = false;
+    }
+    if (exposureTarget == 0 && mExposureActive) {
+        camera->StopManualExposure();
+        mExposureActive = false;
+    }
+    if (still)
+        captureStill(tempbuf);
+    if (mBurstTotal != 0)
+        captureBurstFrame(tempbuf);
+
+    if (display)
+        displayFrame(tempbuf, width, height);
+
+    if (callback)
+        postPreviewFrame(tempbuf, callbackWidth, callbackHeight,
+                         policy[CONSUMER_CALLBACK]);
+    if (record)
+        postRecordingFrame(tempbuf, policy[CONSUMER_RECORD]);
+
+    camera->ReleasePreviewFrame();
+
     return NO_ERROR;
 }
 
@@ -234,12 +688,13 @@ status_t CameraHardware::startPreview()
 {
     int ret;
     int width, height;
-    int i;
     IMG_native_handle_t** hndl2hndl;
     IMG_native_handle_t* handle;
     int stride;
-    char devnode[15];
     Mutex::Autolock lock(mLock);
+    // the still capture owns the device until it is done
+    while (mPictureRunning)
+        mPictureCond.wait(mLock);
     if (mPreviewThread != 0) {
         //already running
         return INVALID_OPERATION;
@@ -247,70 +702,98 @@ status_t CameraHardware::startPreview()
 #if 1
     ALOGI("startPreview: in startpreview \n");
     mParameters.getPreviewSize(&width, &height);
-    for( i=MAX_VIDEONODE; i>=MIN_VIDEONODE; i--) {
-        sprintf(devnode,"/dev/video%d",i);
-        ALOGI("trying the node %s width=%d height=%d \n",devnode,width,height);
-        ret = camera.Open(devnode, width, height, PIXEL_FORMAT);
-        if( ret >= 0)
-            break;
-        }
-
+    captureSize(mParameters, &mCaptureWidth, &mCaptureHeight);
+    ALOGI("opening %s capture %dx%d preview %dx%d\n", mDevice,
+          mCaptureWidth, mCaptureHeight, width, height);
+    ret = camera->Open(mDevice, mCaptureWidth, mCaptureHeight, PIXEL_FORMAT);
     if( ret < 0)
         return -1;
+    camera->SetFrameRate(previewFrameRate());
+
+    if (mNativeWindow != NULL)
+        mNativeWindow->set_buffers_geometry(mNativeWindow, width, height,
+                                            HAL_PIXEL_FORMAT_RGB_565);
 
     mPreviewFrameSize = width * height * 2;
 
     mHeap = new MemoryHeapBase(mPreviewFrameSize);
     mBuffer = new MemoryBase(mHeap, 0, mPreviewFrameSize);
 
-    ret = camera.Init();
+    ret = camera->Init();
     if (ret != 0) {  
         ALOGI("startPreview: Camera.Init failed\n");
-        camera.Close();
+        camera->Close();
         return ret;
     }
 
-    ret = camera.StartStreaming();
+    ret = camera->StartStreaming();
     if (ret != 0) {  
         ALOGI("startPreview: Camera.StartStreaming failed\n");
-        camera.Uninit();
-        camera.Close();
+        camera->Uninit();
+        camera->Close();
         return ret;
     }
 
+    memset(mDropped, 0, sizeof(mDropped));
+    mStats.reset();
+    yuyv_motion_reset(&mMotion);
+    mMotionActive = false;
+    mExposureActive = false;
+    mExposureUnsupported = false;
     previewStopped = false;
+    mCallbackThread = new CallbackThread(this);
     mPreviewThread = new PreviewThread(this);
 
 #endif
     return NO_ERROR;
 }
 
+void CameraHardware::freeFrameBuffers()
+{
+    Mutex::Autolock lock(mCallbackLock);
+    if (mCallbackMem != NULL) {
+        mCallbackMem->release(mCallbackMem);
+        mCallbackMem = NULL;
+    }
+    mCallbackFrameSize = 0;
+    mCallbackQueue.clear();
+}
+
 void CameraHardware::stopPreview()
 {
     sp<PreviewThread> previewThread;
+    sp<CallbackThread> callbackThread;
 
+    // the picture thread and the framework may both stop preview; only
+    // the caller that takes the threads over tears the device down
     { // scope for the lock
         Mutex::Autolock lock(mLock);
         previewStopped = true;
-    }
-
-    {
-        Mutex::Autolock lock(mLock);
         previewThread = mPreviewThread;
+        callbackThread = mCallbackThread;
+        mPreviewThread.clear();
+        mCallbackThread.clear();
     }
 
     if (previewThread != 0) {
         previewThread->requestExitAndWait();
     }
+    cancelBurst();
 
-    if (mPreviewThread != 0) {
-        camera.Uninit();
-        camera.StopStreaming();
-        camera.Close();
+    if (callbackThread != 0) {
+        callbackThread->requestExitAndWait();
     }
+    freeFrameBuffers();
 
-    Mutex::Autolock lock(mLock);
-    mPreviewThread.clear();
+    if (previewThread != 0) {
+        if (mExposureActive) {
+            camera->StopManualExposure();
+            mExposureActive = false;
+        }
+        camera->Uninit();
+        camera->StopStreaming();
+        camera->Close();
+    }
 }
 
 bool CameraHardware::previewEnabled()
@@ -322,9 +805,18 @@ bool CameraHardware::previewEnabled()
 status_t CameraHardware::startRecording()
 {
     Mutex::Autolock lock(mLock);
-
-    mRecordHeap = new MemoryHeapBase(mPreviewFrameSize*3/4);
-    mRecordBuffer = new MemoryBase(mRecordHeap, 0, mPreviewFrameSize*3/4);
+    Mutex::Autolock recordLock(mRecordLock);
+
+    mParameters.getVideoSize(&mRecordWidth, &mRecordHeight);
+    if (mRecordWidth <= 0 || mRecordHeight <= 0)
+        mParameters.getPreviewSize(&mRecordWidth, &mRecordHeight);
+    mRecordFrameSize = mRecordWidth * mRecordHeight * 3 / 2;
+    mRecordMem = mRequestMemory(-1, mRecordFrameSize, kRecordBufferCount, NULL);
+    if (mRecordMem == NULL) {
+        ALOGE("startRecording: unable to allocate recording buffers");
+        return NO_MEMORY;
+    }
+    memset(mRecordBusy, 0, sizeof(mRecordBusy));
     mRecordRunning = true;
 
     return NO_ERROR;
@@ -332,7 +824,17 @@ status_t CameraHardware::startRecording()
 
 void CameraHardware::stopRecording()
 {
+    Mutex::Autolock lock(mRecordLock);
+
     mRecordRunning = false;
+    mRecordCond.broadcast();
+    // the preview thread may still be handing a frame to the encoder
+    while (mRecordPosting)
+        mRecordCond.wait(mRecordLock);
+    if (mRecordMem != NULL) {
+        mRecordMem->release(mRecordMem);
+        mRecordMem = NULL;
+    }
 }
 
 bool CameraHardware::recordingEnabled()
@@ -342,7 +844,19 @@ bool CameraHardware::recordingEnabled()
 
 void CameraHardware::releaseRecordingFrame(const void *opaque)
 {
+    Mutex::Autolock lock(mRecordLock);
+
+    if (mRecordMem == NULL || mRecordFrameSize == 0)
+        return;
 
+    int slot = ((const unsigned char *)opaque -
+                (const unsigned char *)mRecordMem->data) / mRecordFrameSize;
+    if (slot < 0 || slot >= kRecordBufferCount) {
+        ALOGW("releaseRecordingFrame: unknown frame %p", opaque);
+        return;
+    }
+    mRecordBusy[slot] = false;
+    mRecordCond.signal();
 }
 
 // ---------------------------------------------------------------------------
@@ -376,113 +890,811 @@ status_t CameraHardware::cancelAutoFocus()
 /*static*/ int CameraHardware::beginPictureThread(void *cookie)
 {
     CameraHardware *c = (CameraHardware *)cookie;
-    return c->pictureThread();
+    int ret = c->pictureThread();
+
+    Mutex::Autolock lock(c->mLock);
+    c->mPictureRunning = false;
+    c->mPictureCond.broadcast();
+    return ret;
 }
 
 int CameraHardware::pictureThread()
 {
-    unsigned char *frame;
-    int bufferSize;
-    int w,h;
-    int ret;
-    struct v4l2_buffer buffer;
-    struct v4l2_format format;
-    struct v4l2_buffer cfilledbuffer;
-    struct v4l2_requestbuffers creqbuf;
-    struct v4l2_capability cap;
-    int i;
-    char devnode[15];
+    ATRACE_CALL();
+    int width, height;
+    int zoomRatio;
+    bool live, ok;
+    uint8_t *still;
     camera_memory_t* picture = NULL;
+    nsecs_t requested;
 
+    {
+        Mutex::Autolock lock(mLock);
+        requested = mPictureRequested;
+        mParameters.getPictureSize(&width, &height);
+        zoomRatio = kZoomRatios[mZoom];
+        live = mPreviewThread != 0 &&
+               mCaptureWidth >= width && mCaptureHeight >= height;
+    }
+    ALOGD("Picture Size: Width = %d \t Height = %d", width, height);
 
-   if (mMsgEnabled & CAMERA_MSG_SHUTTER)
+    still = (uint8_t *)malloc(width * height * 2);
+    ok = still != NULL && live && grabLiveStill(still, width, height);
+    stopPreview();
+    if (still != NULL && !ok && !mPictureCancel)
+        ok = grabStill(still, width, height, zoomRatio);
+
+    if (!ok) {
+        if (!mPictureCancel && (mMsgEnabled & CAMERA_MSG_ERROR))
+            mNotifyFn(CAMERA_MSG_ERROR, CAMERA_ERROR_UNKNOWN, 0, mUser);
+        free(still);
+        return -1;
+    }
+
+    // the frame has been exposed by now
+    if ((mMsgEnabled & CAMERA_MSG_SHUTTER) && !mPictureCancel) {
         mNotifyFn(CAMERA_MSG_SHUTTER, 0, 0, mUser);
+        mStats.latency(CameraStats::PATH_SHUTTER, requested);
+    }
 
-    mParameters.getPictureSize(&w, &h);
-    ALOGD("Picture Size: Width = %d \t Height = %d", w, h);
+    if ((mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE) && !mPictureCancel) {
+        ALOGD ("mJpegPictureCallback");
+        picture = V4L2Camera::CompressJpeg(still, width, height, mJpegQuality,
+                                               NULL, mRequestMemory, &mPictureCancel);
+    }
+    free(still);
 
-    int width, height;
-    mParameters.getPictureSize(&width, &height);
-    mParameters.getPreviewSize(&width, &height);
+    if (picture != NULL) {
+        if (!mPictureCancel) {
+            mDataFn(CAMERA_MSG_COMPRESSED_IMAGE,picture,0,NULL ,mUser);
+            mStats.latency(CameraStats::PATH_PICTURE, requested);
+        }
+        picture->release(picture);
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ * One decimating pass over the frame feeds both motion detection and the
+ * luma statistics; the exposure loop runs on the latter.
+ */
+void CameraHardware::analyzeFrame(void *frame, int motionThreshold, int motionMinBlocks,
+                                  bool lumaStats, int exposureTarget)
+{
+    MotionEvent event;
+    int changed;
+
+    if (yuyv_motion_configure(&mMotion, mFrameWidth, mFrameHeight,
+                              kMotionCols, kMotionRows) < 0)
+        return;
+
+    memset(&event, 0, sizeof(event));
+    changed = yuyv_motion_update(&mMotion, (const uint8_t *)frame, motionThreshold,
+                                 motionThreshold > 0 ? event.bitmap : NULL,
+                                 &event.score, lumaStats ? &mFrameLuma : NULL);
+
+    if (lumaStats) {
+        if (exposureTarget > 0)
+            adjustExposure(mFrameLuma.mean, exposureTarget);
+
+        Mutex::Autolock lock(mLock);
+        mLuma = mFrameLuma;
+        mLumaExposure = mExposureActive ? mExposureValue : -1;
+        mLumaSeq++;
+    }
+
+    if (motionThreshold <= 0)
+        mMotionActive = false;
+    else if (changed >= 0)
+        postMotionEvent(event, changed, motionMinBlocks);
+}
+
+/*
+ * Nothing is sent while the scene is still, so an app can leave preview
+ * callbacks off until this fires.
+ */
+void CameraHardware::postMotionEvent(MotionEvent& event, int changed, int minBlocks)
+{
+    camera_frame_metadata_t metadata;
+    camera_memory_t *mem;
+    bool moving;
+
+    moving = changed >= minBlocks;
+    if (!moving && !mMotionActive)
+        return;
+    mMotionActive = moving;
+
+    event.sequence = camera->FrameSequence();
+    event.cols = kMotionCols;
+    event.rows = kMotionRows;
+    event.changed = changed;
+
+    mem = mRequestMemory(-1, sizeof(event), 1, NULL);
+    if (mem == NULL)
+        return;
+    memcpy(mem->data, &event, sizeof(event));
+    metadata.number_of_faces = 0;
+    metadata.faces = NULL;
+    mDataFn(CAMERA_MSG_PREVIEW_METADATA, mem, 0, &metadata, mUser);
+    mem->release(mem);
+}
+
+/*
+ * Proportional step towards the target mean, at most a quarter of the
+ * current exposure at a time and only every few frames, since the sensor
+ * needs that long before a change shows up in the statistics.
+ */
+void CameraHardware::adjustExposure(int mean, int target)
+{
+    int value, step;
+
+    if (!mExposureActive) {
+        if (mExposureUnsupported)
+            return;
+        mExposureValue = camera->StartManualExposure(&mExposureMin, &mExposureMax);
+        if (mExposureValue < 0) {
+            ALOGW("no exposure control, HAL exposure loop disabled");
+            mExposureUnsupported = true;
+            return;
+        }
+        mExposureActive = true;
+        mExposureFrames = 0;
+    }
+
+    if (++mExposureFrames < kExposureInterval)
+        return;
+    mExposureFrames = 0;
+    if (mean > target - kExposureDeadband && mean < target + kExposureDeadband)
+        return;
+
+    value = (int)((int64_t)mExposureValue * target / (mean > 0 ? mean : 1));
+    step = mExposureValue / 4 > 1 ? mExposureValue / 4 : 1;
+    if (value > mExposureValue + step)
+        value = mExposureValue + step;
+    if (value < mExposureValue - step)
+        value = mExposureValue - step;
+    if (value > mExposureMax)
+        value = mExposureMax;
+    if (value < mExposureMin)
+        value = mExposureMin;
+
+    if (value != mExposureValue && camera->SetExposure(value) == 0) {
+        OTRACE("exposure", mean, mExposureValue, value);
+        mExposureValue = value;
+    }
+}
 
-    for(i=MAX_VIDEONODE; i>=MIN_VIDEONODE; i--) {
-        sprintf(devnode,"/dev/video%d",i);
-        ALOGI("trying the node %s \n",devnode);
-        ret = camera.Open(devnode, width, height, PIXEL_FORMAT);
-        if( ret >= 0)
+/*
+ * Asks the preview thread to scale its next frame into still.  Returns
+ * false if preview stops or nothing arrives in time; the caller then
+ * falls back to reopening the device.
+ */
+bool CameraHardware::grabLiveStill(uint8_t *still, int width, int height)
+{
+    Mutex::Autolock lock(mLock);
+    nsecs_t deadline = systemTime() + kStillTimeout;
+
+    mStillBuffer = still;
+    mStillWidth = width;
+    mStillHeight = height;
+    mStillZoomRatio = kZoomRatios[mZoom];
+    mStillDone = false;
+    mStillRequest = true;
+
+    for (;;) {
+        // never give the buffer back while the preview thread writes it
+        if (mStillBusy) {
+            mPictureCond.wait(mLock);
+            continue;
+        }
+        if (!mStillRequest || mPictureCancel || mPreviewThread == 0)
+            break;
+        nsecs_t left = deadline - systemTime();
+        if (left <= 0)
             break;
+        mPictureCond.waitRelative(mLock, left);
     }
+    mStillRequest = false;
+    mStillBuffer = NULL;
 
-    if( ret < 0)
-        return -1;
+    return mStillDone;
+}
 
-    camera.Init();
-    camera.StartStreaming();
-    //TODO xxx : Optimize the memory capture call. Too many memcpy
-    if (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE) {
-        ALOGD ("mJpegPictureCallback");
-        picture = camera.GrabJpegFrame(mRequestMemory);
-        mDataFn(CAMERA_MSG_COMPRESSED_IMAGE,picture,0,NULL ,mUser);
+// preview thread side of grabLiveStill()
+void CameraHardware::captureStill(void *frame)
+{
+    uint8_t *still;
+    int width, height, zoomRatio;
+    bool ok = false;
+
+    {
+        Mutex::Autolock lock(mLock);
+        if (!mStillRequest)
+            return;
+        mStillRequest = false;
+        mStillBusy = true;
+        still = mStillBuffer;
+        width = mStillWidth;
+        height = mStillHeight;
+        zoomRatio = mStillZoomRatio;
     }
 
-    camera.Uninit();
-    camera.StopStreaming();
-    camera.Close();
+    if (yuyv_scaler_zoom(&mStillScaler, mFrameWidth, mFrameHeight,
+                         zoomRatio, width, height) == 0) {
+        yuyv_scale_to_yuyv(&mStillScaler, (const uint8_t *)frame, still);
+        mStats.addBytes(width * height * 2);
+        ok = true;
+    }
 
-    return NO_ERROR;
+    Mutex::Autolock lock(mLock);
+    mStillBusy = false;
+    mStillDone = ok;
+    mPictureCond.broadcast();
 }
 
+/* Opens the device at the smallest mode that covers the picture. */
+bool CameraHardware::grabStill(uint8_t *still, int width, int height, int zoomRatio)
+{
+    int captureWidth, captureHeight;
+    void *frame;
+    bool ok = false;
+
+    pickCaptureSize(width, height, &captureWidth, &captureHeight);
+    ALOGI("opening %s at %dx%d for a %dx%d still\n", mDevice,
+          captureWidth, captureHeight, width, height);
+    if (camera->Open(mDevice, captureWidth, captureHeight, PIXEL_FORMAT) < 0)
+        return false;
+
+    camera->Init();
+    camera->StartStreaming();
+
+    frame = mPictureCancel ? NULL : camera->GrabPreviewFrame();
+    if (frame != NULL) {
+        struct yuyv_scaler scaler;
+
+        memset(&scaler, 0, sizeof(scaler));
+        if (yuyv_scaler_zoom(&scaler, camera->Width(), camera->Height(),
+                             zoomRatio, width, height) == 0) {
+            yuyv_scale_to_yuyv(&scaler, (const uint8_t *)frame, still);
+            ok = true;
+        }
+        yuyv_scaler_free(&scaler);
+        camera->ReleasePreviewFrame();
+    }
+
+    camera->Uninit();
+    camera->StopStreaming();
+    camera->Close();
+
+    return ok;
+}
+
+/*
+ * Queues the capture to its own thread and returns.  The preview is
+ * stopped, the still is exposed and encoded and the JPEG delivered from
+ * there; cancelPicture() may abort it at any of those steps.
+ */
 status_t CameraHardware::takePicture()
 {
-        ALOGD ("takepicture");
-    stopPreview();
+    ALOGD ("takepicture");
+    Mutex::Autolock lock(mLock);
 
-    pictureThread();
+    if (mPictureRunning) {
+        ALOGW("takePicture: capture already in progress");
+        return INVALID_OPERATION;
+    }
+
+    mPictureCancel = false;
+    mPictureRunning = true;
+    mPictureRequested = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (createThread(beginPictureThread, this) == false) {
+        mPictureRunning = false;
+        return UNKNOWN_ERROR;
+    }
 
     return NO_ERROR;
 }
 
 status_t CameraHardware::cancelPicture()
 {
+    Mutex::Autolock lock(mLock);
+
+    // once this returns no shutter or JPEG callback may follow
+    mPictureCancel = true;
+    mPictureCond.broadcast();
+    while (mPictureRunning)
+        mPictureCond.wait(mLock);
+
+    return NO_ERROR;
+}
+
+// ---------------------------------------------------------------------------
+
+/*
+ * Burst capture: the preview thread copies the next mBurstTotal frames
+ * into a preallocated ring while a small pool of workers encodes them
+ * behind it.  JPEGs are delivered strictly in capture order.
+ */
+status_t CameraHardware::startBurst(int count)
+{
+    int width, height;
+
+    if (count <= 0) {
+        cancelBurst();
+        return NO_ERROR;
+    }
+    if (count > kMaxBurstCount)
+        return BAD_VALUE;
+
+    {
+        Mutex::Autolock lock(mLock);
+        if (mPreviewThread == 0) {
+            ALOGE("startBurst: preview is not running");
+            return INVALID_OPERATION;
+        }
+        mParameters.getPictureSize(&width, &height);
+        // like pictureThread's live path, never upscale a stream frame
+        if (mCaptureWidth < width || mCaptureHeight < height) {
+            ALOGE("startBurst: capture stream %dx%d is smaller than the "
+                  "%dx%d picture", mCaptureWidth, mCaptureHeight, width, height);
+            return INVALID_OPERATION;
+        }
+    }
+
+    Mutex::Autolock lock(mBurstLock);
+    if (mBurstTotal != 0 || mBurstWorkersRunning != 0)
+        return INVALID_OPERATION;
+
+    size_t frameSize = width * height * 2;
+    if (frameSize * count > kMaxBurstBytes) {
+        ALOGE("startBurst: %d frames of %dx%d do not fit", count, width, height);
+        return BAD_VALUE;
+    }
+    if (mBurstRingSize < frameSize * count) {
+        unsigned char *ring = (unsigned char *)realloc(mBurstRing, frameSize * count);
+        if (ring == NULL)
+            return NO_MEMORY;
+        mBurstRing = ring;
+        mBurstRingSize = frameSize * count;
+    }
+
+    mBurstFrameSize = frameSize;
+    mBurstWidth = width;
+    mBurstHeight = height;
+    mBurstCaptured = 0;
+    mBurstEncodeNext = 0;
+    mBurstDelivered = 0;
+    mBurstCancel = false;
+    for (int i = 0; i < kBurstWorkers && i < count; i++) {
+        if (createThread(beginBurstWorker, this) == false)
+            break;
+        mBurstWorkersRunning++;
+    }
+    if (mBurstWorkersRunning == 0)
+        return UNKNOWN_ERROR;
+    mBurstTotal = count;
+
+    return NO_ERROR;
+}
+
+void CameraHardware::cancelBurst()
+{
+    Mutex::Autolock lock(mBurstLock);
+
+    mBurstCancel = true;
+    mBurstCond.broadcast();
+    while (mBurstWorkersRunning != 0)
+        mBurstCond.wait(mBurstLock);
+    mBurstTotal = 0;
+}
+
+void CameraHardware::captureBurstFrame(void *frame)
+{
+    int index, width, height;
+
+    {
+        Mutex::Autolock lock(mBurstLock);
+        if (mBurstCaptured >= mBurstTotal || mBurstCancel)
+            return;
+        index = mBurstCaptured;
+        width = mBurstWidth;
+        height = mBurstHeight;
+    }
+
+    // bursts are stills: picture size, scaled from the capture stream
+    if (yuyv_scaler_zoom(&mBurstScaler, mFrameWidth, mFrameHeight,
+                         mFrameZoomRatio, width, height) != 0)
+        return;
+
+    // the slot is not visible to the workers until mBurstCaptured moves
+    yuyv_scale_to_yuyv(&mBurstScaler, (const uint8_t *)frame,
+                       mBurstRing + index * mBurstFrameSize);
+    mStats.addBytes(mBurstFrameSize);
+    if (mMsgEnabled & CAMERA_MSG_SHUTTER)
+        mNotifyFn(CAMERA_MSG_SHUTTER, 0, 0, mUser);
+
+    Mutex::Autolock lock(mBurstLock);
+    mBurstFrames[index].sequence = camera->FrameSequence();
+    mBurstFrames[index].timestamp = camera->FrameTimestamp();
+    mBurstCaptured++;
+    mBurstCond.broadcast();
+}
+
+/*static*/ int CameraHardware::beginBurstWorker(void *cookie)
+{
+    CameraHardware *c = (CameraHardware *)cookie;
+    int ret = c->burstWorker();
+
+    Mutex::Autolock lock(c->mBurstLock);
+    if (--c->mBurstWorkersRunning == 0)
+        c->mBurstTotal = 0;
+    c->mBurstCond.broadcast();
+    return ret;
+}
+
+int CameraHardware::burstWorker()
+{
+    ATRACE_CALL();
+    char comment[64];
+    int index;
+
+    for (;;) {
+        {
+            Mutex::Autolock lock(mBurstLock);
+            while (!mBurstCancel && mBurstEncodeNext < mBurstTotal &&
+                   mBurstEncodeNext >= mBurstCaptured)
+                mBurstCond.wait(mBurstLock);
+            if (mBurstCancel || mBurstEncodeNext >= mBurstTotal)
+                break;
+            index = mBurstEncodeNext++;
+            snprintf(comment, sizeof(comment), "burst %d/%d seq %u ts %lld",
+                     index + 1, mBurstTotal, mBurstFrames[index].sequence,
+                     (long long)mBurstFrames[index].timestamp);
+        }
+
+        camera_memory_t *picture = V4L2Camera::CompressJpeg(
+                mBurstRing + index * mBurstFrameSize, mBurstWidth, mBurstHeight,
+                mJpegQuality, comment, mRequestMemory, &mBurstCancel);
+
+        {
+            Mutex::Autolock lock(mBurstLock);
+            while (!mBurstCancel && mBurstDelivered != index)
+                mBurstCond.wait(mBurstLock);
+        }
+
+        if (picture != NULL) {
+            if (!mBurstCancel && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE))
+                mDataFn(CAMERA_MSG_COMPRESSED_IMAGE, picture, 0, NULL, mUser);
+            picture->release(picture);
+        }
+
+        Mutex::Autolock lock(mBurstLock);
+        mBurstDelivered++;
+        mBurstCond.broadcast();
+    }
 
     return NO_ERROR;
 }
 
 status_t CameraHardware::dump(int fd, const Vector<String16>& args) const
 {
+    String8 result;
+    struct v4l2_pix_format pix;
+    int width, height, recordBusy = 0;
+
+    // formatted under the locks, written after: a slow dumpsys reader
+    // must not hold up the preview thread
+    mLock.lock();
+    mParameters.getPreviewSize(&width, &height);
+    result.appendFormat("CameraHardware %d: preview %s, recording %s\n",
+                        mCameraId, mPreviewThread != 0 ? "running" : "stopped",
+                        mRecordRunning ? "on" : "off");
+    result.appendFormat("  requested %dx%d @ %d fps, msgs 0x%x\n",
+                        width, height, mParameters.getPreviewFrameRate(),
+                        mMsgEnabled);
+    if (mPreviewThread != 0) {
+        camera->GetFormat(&pix);
+        result.appendFormat("  negotiated %ux%u %.4s, %u bytes/line, "
+                            "%d/%d buffers queued to driver\n",
+                            pix.width, pix.height, (const char *)&pix.pixelformat,
+                            pix.bytesperline, camera->BuffersQueued(), NB_BUFFER);
+    }
+    mStats.dump(result);
+
+    {
+        Mutex::Autolock lock(mCallbackLock);
+        result.appendFormat("  callback: policy %s, %u dropped, %d/%d pending\n",
+                            policyNames[mPolicy[CONSUMER_CALLBACK]],
+                            mDropped[CONSUMER_CALLBACK],
+                            (int)mCallbackQueue.size(), kCallbackBufferCount);
+    }
+    {
+        Mutex::Autolock lock(mRecordLock);
+        for (int i = 0; i < kRecordBufferCount; i++)
+            recordBusy += mRecordBusy[i];
+        result.appendFormat("  record:   policy %s, %u dropped, %d/%d with encoder\n",
+                            policyNames[mPolicy[CONSUMER_RECORD]],
+                            mDropped[CONSUMER_RECORD],
+                            recordBusy, kRecordBufferCount);
+    }
+    result.appendFormat("  display:  policy %s, %u dropped\n",
+                        policyNames[mPolicy[CONSUMER_DISPLAY]],
+                        mDropped[CONSUMER_DISPLAY]);
+    mLock.unlock();
+
+    write(fd, result.string(), result.size());
+    otrace_dump(fd);
     return NO_ERROR;
 }
 
-status_t CameraHardware::setParameters(const CameraParameters& params)
+static bool keyChanged(const CameraParameters& a, const CameraParameters& b,
+                       const char *key)
 {
-    Mutex::Autolock lock(mLock);
+    const char *va = a.get(key);
+    const char *vb = b.get(key);
 
-    if (strcmp(params.getPictureFormat(), "jpeg") != 0) {
-        ALOGE("Only jpeg still pictures are supported");
-        return -1;
+    if (va == NULL || vb == NULL)
+        return va != vb;
+    return strcmp(va, vb) != 0;
+}
+
+static bool isOn(const char *str)
+{
+    return str != NULL && !strcmp(str, "on");
+}
+
+static bool parseSize(const char *str, int *width, int *height)
+{
+    char *end;
+
+    if (str == NULL)
+        return false;
+    int w = (int)strtol(str, &end, 10);
+    if (*end != 'x')
+        return false;
+    int h = (int)strtol(end + 1, &end, 10);
+    if (*end != '\0' || w <= 0 || h <= 0 || (w & 1))
+        return false;
+    *width = w;
+    *height = h;
+    return true;
+}
+
+/*
+ * Smallest sensor mode covering needWidth x needHeight, or the largest
+ * mode if none does.  mCaptureSizes is sorted largest first.
+ */
+void CameraHardware::pickCaptureSize(int needWidth, int needHeight,
+                                     int *width, int *height) const
+{
+    if (mCaptureSizeCount == 0) {
+        *width = needWidth;
+        *height = needHeight;
+        return;
     }
 
-    int w, h;
-    int framerate;
+    *width = mCaptureSizes[0].width;
+    *height = mCaptureSizes[0].height;
+    for (int i = mCaptureSizeCount - 1; i >= 0; i--) {
+        if (mCaptureSizes[i].width >= needWidth &&
+            mCaptureSizes[i].height >= needHeight) {
+            *width = mCaptureSizes[i].width;
+            *height = mCaptureSizes[i].height;
+            return;
+        }
+    }
+}
 
-    mParameters = params;
-    params.getPictureSize(&w, &h);
-    mParameters.setPictureSize(w,h);
-    params.getPreviewSize(&w, &h);
-    mParameters.setPreviewSize(w,h);
-    framerate = params.getPreviewFrameRate();
-    ALOGD("PREVIEW SIZE: w=%d h=%d framerate=%d", w, h, framerate);
-    mParameters = params;
-    mParameters.setPreviewSize(w,h);
-    mParameters.set(CameraParameters::KEY_SUPPORTED_PREVIEW_FPS_RANGE, supportedFpsRanges);
-    mParameters.set(CameraParameters::KEY_SUPPORTED_PREVIEW_SIZES, "320x240,352x288,640x480,720x480,720x576,848x480");
+/* The mode the stream is opened at, independent of the preview size. */
+void CameraHardware::captureSize(const CameraParameters& params,
+                                 int *width, int *height) const
+{
+    const char *mode = params.get(KEY_CAPTURE_SIZE);
+    int needWidth, needHeight, w, h;
+
+    if (parseSize(mode, width, height))
+        return;
+    if (mode != NULL && !strcmp(mode, CAPTURE_SIZE_SENSOR) && mCaptureSizeCount > 0) {
+        pickCaptureSize(INT_MAX, INT_MAX, width, height);
+        return;
+    }
+
+    params.getPreviewSize(&needWidth, &needHeight);
+    params.getVideoSize(&w, &h);
+    if (w > 0 && h > 0) {
+        if (w > needWidth)
+            needWidth = w;
+        if (h > needHeight)
+            needHeight = h;
+    }
+    if (parseSize(params.get(KEY_CALLBACK_SIZE), &w, &h)) {
+        if (w > needWidth)
+            needWidth = w;
+        if (h > needHeight)
+            needHeight = h;
+    }
+    pickCaptureSize(needWidth, needHeight, width, height);
+}
+
+/*
+ * Most keys only need storing.  The stream is torn down and set up again
+ * only when preview size, format or frame rate actually change while
+ * preview is running; everything else is applied in place.
+ */
+status_t CameraHardware::setParameters(const CameraParameters& params)
+{
+    bool restart;
+
+    {
+        Mutex::Autolock lock(mLock);
+
+        if (strcmp(params.getPictureFormat(), "jpeg") != 0) {
+            ALOGE("Only jpeg still pictures are supported");
+            return -1;
+        }
+
+        int zoom = params.getInt(CameraParameters::KEY_ZOOM);
+        if (zoom < 0)
+            zoom = 0;
+        if (zoom >= kZoomSteps) {
+            ALOGE("zoom %d out of range 0..%d", zoom, kZoomSteps - 1);
+            return BAD_VALUE;
+        }
+
+        int pictureWidth, pictureHeight;
+        params.getPictureSize(&pictureWidth, &pictureHeight);
+        if (pictureWidth <= 0 || pictureHeight <= 0 || (pictureWidth & 1)) {
+            ALOGE("invalid picture size %dx%d", pictureWidth, pictureHeight);
+            return BAD_VALUE;
+        }
+
+        int captureWidth, captureHeight;
+        captureSize(params, &captureWidth, &captureHeight);
+
+        int compensation = 0;
+        if (params.get(CameraParameters::KEY_EXPOSURE_COMPENSATION) != NULL)
+            compensation = params.getInt(CameraParameters::KEY_EXPOSURE_COMPENSATION);
+        if (compensation < -kMaxExposureCompensation || compensation > kMaxExposureCompensation) {
+            if (isOn(params.get(KEY_EXPOSURE_CONTROL))) {
+                ALOGE("exposure compensation %d out of range", compensation);
+                return BAD_VALUE;
+            }
+            compensation = 0;
+        }
+
+        restart = captureWidth != mCaptureWidth || captureHeight != mCaptureHeight ||
+                  keyChanged(mParameters, params, CameraParameters::KEY_PREVIEW_SIZE) ||
+                  keyChanged(mParameters, params, CameraParameters::KEY_PREVIEW_FORMAT) ||
+                  keyChanged(mParameters, params, CameraParameters::KEY_PREVIEW_FRAME_RATE) ||
+                  keyChanged(mParameters, params, CameraParameters::KEY_PREVIEW_FPS_RANGE);
+        if (restart) {
+            int w, h;
+            params.getPreviewSize(&w, &h);
+            ALOGD("PREVIEW SIZE: w=%d h=%d framerate=%d", w, h,
+                  params.getPreviewFrameRate());
+        }
+
+        mParameters = params;
+        mParameters.set(CameraParameters::KEY_SUPPORTED_PREVIEW_FPS_RANGE, supportedFpsRanges);
+        mParameters.set(CameraParameters::KEY_SUPPORTED_PREVIEW_SIZES, "320x240,352x288,640x480,720x480,720x576,848x480");
+        mParameters.set(CameraParameters::KEY_ZOOM_SUPPORTED, CameraParameters::TRUE);
+        mParameters.set(CameraParameters::KEY_SMOOTH_ZOOM_SUPPORTED, CameraParameters::FALSE);
+        mParameters.set(CameraParameters::KEY_MAX_ZOOM, kZoomSteps - 1);
+        mParameters.set(CameraParameters::KEY_ZOOM_RATIOS, supportedZoomRatios);
+        mParameters.set(CameraParameters::KEY_ZOOM, zoom);
+
+        int quality = params.getInt(CameraParameters::KEY_JPEG_QUALITY);
+        if (quality > 0 && quality <= 100)
+            mJpegQuality = quality;
+
+        mZoom = zoom;
+
+        if (!parseSize(params.get(KEY_CALLBACK_SIZE), &mCallbackWidth, &mCallbackHeight))
+            mCallbackWidth = mCallbackHeight = 0;
+
+        mLumaStats = isOn(params.get(KEY_LUMA_STATS));
+        mExposureControl = isOn(params.get(KEY_EXPOSURE_CONTROL));
+        // compensation only means something while the HAL runs exposure
+        if (mExposureControl) {
+            mParameters.set(CameraParameters::KEY_MAX_EXPOSURE_COMPENSATION,
+                            kMaxExposureCompensation);
+            mParameters.set(CameraParameters::KEY_MIN_EXPOSURE_COMPENSATION,
+                            -kMaxExposureCompensation);
+            mParameters.set(CameraParameters::KEY_EXPOSURE_COMPENSATION_STEP, "0.333333");
+            mParameters.set(CameraParameters::KEY_EXPOSURE_COMPENSATION, compensation);
+        } else {
+            mParameters.set(CameraParameters::KEY_MAX_EXPOSURE_COMPENSATION, 0);
+            mParameters.set(CameraParameters::KEY_MIN_EXPOSURE_COMPENSATION, 0);
+            mParameters.set(CameraParameters::KEY_EXPOSURE_COMPENSATION_STEP, "0");
+            mParameters.set(CameraParameters::KEY_EXPOSURE_COMPENSATION, 0);
+        }
+        mExposureTarget = kExposureTargets[compensation + kMaxExposureCompensation];
+
+        mPolicy[CONSUMER_DISPLAY] = policyFromString(
+                params.get(KEY_DISPLAY_POLICY), mPolicy[CONSUMER_DISPLAY]);
+        mPolicy[CONSUMER_CALLBACK] = policyFromString(
+                params.get(KEY_CALLBACK_POLICY), mPolicy[CONSUMER_CALLBACK]);
+        mPolicy[CONSUMER_RECORD] = policyFromString(
+                params.get(KEY_RECORD_POLICY), mPolicy[CONSUMER_RECORD]);
+        // the native window queue is already bounded, so bounded means block
+        if (mPolicy[CONSUMER_DISPLAY] == FRAME_POLICY_BOUNDED)
+            mPolicy[CONSUMER_DISPLAY] = FRAME_POLICY_BLOCK;
+
+        mParamsVersion++;
+        restart = restart && mPreviewThread != 0;
+    }
+
+    if (restart) {
+        ALOGI("setParameters: stream format changed, restarting preview");
+        stopPreview();
+        return startPreview();
+    }
 
     return NO_ERROR;
 }
 
+/*static*/ CameraHardware::FramePolicy
+CameraHardware::policyFromString(const char *str, FramePolicy def)
+{
+    if (str == NULL)
+        return def;
+    for (int i = 0; i < (int)(sizeof(policyNames) / sizeof(policyNames[0])); i++)
+        if (!strcmp(str, policyNames[i]))
+            return (FramePolicy)i;
+    ALOGW("Unknown frame policy '%s'", str);
+    return def;
+}
+
 status_t CameraHardware::sendCommand(int32_t command, int32_t arg1, int32_t arg2)
 {
-    return BAD_VALUE;
+    switch (command) {
+    case CAMERA_CMD_BURST_CAPTURE:
+        return startBurst(arg1);
+    case CAMERA_CMD_MOTION_DETECTION: {
+        if (arg1 < 0 || arg1 > 255 || arg2 > kMotionCols * kMotionRows)
+            return BAD_VALUE;
+        Mutex::Autolock lock(mLock);
+        mMotionThreshold = arg1;
+        mMotionMinBlocks = arg2 > 0 ? arg2 : 1;
+        return NO_ERROR;
+    }
+    case CAMERA_CMD_SET_DISPLAY_ORIENTATION:
+    case CAMERA_CMD_ENABLE_SHUTTER_SOUND:
+    case CAMERA_CMD_PLAY_RECORDING_SOUND:
+    case CAMERA_CMD_ENABLE_FOCUS_MOVE_MSG:
+    case CAMERA_CMD_PING:
+        // nothing for a fixed focus USB camera to do
+        return NO_ERROR;
+    default:
+        return BAD_VALUE;
+    }
+}
+
+// called with mLock held
+void CameraHardware::fillParametersLocked(CameraParameters& params) const
+{
+    params = mParameters;
+    params.set(KEY_DISPLAY_POLICY, policyNames[mPolicy[CONSUMER_DISPLAY]]);
+    params.set(KEY_CALLBACK_POLICY, policyNames[mPolicy[CONSUMER_CALLBACK]]);
+    params.set(KEY_RECORD_POLICY, policyNames[mPolicy[CONSUMER_RECORD]]);
+    params.set(KEY_DISPLAY_DROPS, (int)mDropped[CONSUMER_DISPLAY]);
+    params.set(KEY_CALLBACK_DROPS, (int)mDropped[CONSUMER_CALLBACK]);
+    params.set(KEY_RECORD_DROPS, (int)mDropped[CONSUMER_RECORD]);
+
+    if ((mLumaStats || mExposureControl) && mLumaSeq != 0) {
+        String8 hist, regions;
+
+        for (int i = 0; i < YUYV_LUMA_BINS; i++)
+            hist.appendFormat(i ? ",%u" : "%u", mLuma.hist[i]);
+        for (int i = 0; i < kMotionCols * kMotionRows; i++)
+            regions.appendFormat(i ? ",%d" : "%d", mLuma.region[i]);
+        params.set(KEY_LUMA_MEAN, mLuma.mean);
+        params.set(KEY_LUMA_HISTOGRAM, hist.string());
+        params.set(KEY_LUMA_REGIONS, regions.string());
+    }
+    if (mLumaExposure >= 0)
+        params.set(KEY_EXPOSURE, mLumaExposure);
 }
 
 CameraParameters CameraHardware::getParameters() const
@@ -490,13 +1702,39 @@ CameraParameters CameraHardware::getParameters() const
     CameraParameters params;
 
     Mutex::Autolock lock(mLock);
-    params = mParameters;
+    fillParametersLocked(params);
 
     return params;
 }
 
+/*
+ * Flattened parameters for the HAL module.  The string is cached and only
+ * rebuilt after setParameters(), when a drop counter has moved or when new
+ * luma statistics are out, so the common case is a single malloc and
+ * memcpy.  The caller frees the result.
+ */
+char* CameraHardware::getParametersString() const
+{
+    Mutex::Autolock lock(mLock);
+
+    if (mFlatVersion != mParamsVersion || mFlatLumaSeq != mLumaSeq ||
+            memcmp(mFlatDropped, mDropped, sizeof(mDropped)) != 0) {
+        CameraParameters params;
+
+        fillParametersLocked(params);
+        mFlatParams = params.flatten();
+        mFlatVersion = mParamsVersion;
+        mFlatLumaSeq = mLumaSeq;
+        memcpy(mFlatDropped, mDropped, sizeof(mDropped));
+        ALOGV("parameters v%u: %s", mFlatVersion, mFlatParams.string());
+    }
+
+    return strndup(mFlatParams.string(), mFlatParams.length());
+}
+
 void CameraHardware::release()
 {
+    cancelPicture();
     close(camera_device);
 }
 
@@ -44,6 +44,7 @@
 #include "binder/MemoryHeapBase.h"
 #include <utils/threads.h>
 #include <camera/CameraParameters.h>
+#include <cutils/properties.h>
 #include <hardware/camera.h>
 #include <sys/ioctl.h>
 #include <utils/threads.h>
@@ -51,12 +52,20 @@
 #include <binder/MemoryHeapBase.h>
 #include <utils/threads.h>
 #include "V4L2Camera.h"
+#include "ReplayCamera.h"
+#include "CameraStats.h"
+#include "yuvscale.h"
+#include "yuvmotion.h"
 
 #include <hardware/camera.h>
 
 #include <sys/ioctl.h>
 #include "V4L2Camera.h"
 
+/* UVC cameras enumerate behind the fimc/mfc nodes */
+#define MAX_VIDEONODE      5
+#define MIN_VIDEONODE      4
+
 namespace android {
 
 class CameraHardware  {
@@ -103,16 +112,76 @@ public:
     virtual status_t    dump(int fd, const Vector<String16>& args) const;
     virtual status_t    setParameters(const CameraParameters& params);
     virtual CameraParameters  getParameters() const;
+            char*       getParametersString() const;
     virtual void release();
     virtual status_t sendCommand(int32_t cmd, int32_t arg1, int32_t arg2);
-                        CameraHardware(int cameraId);
+                        CameraHardware(int cameraId, int videoNode);
 
     virtual             ~CameraHardware();
 
+    /*
+     * Vendor sendCommand() ids.  CAMERA_CMD_BURST_CAPTURE takes the
+     * number of stills in arg1 (0 cancels a running burst); each JPEG
+     * carries its V4L2 sequence number and capture time in a COM marker.
+     * Bursts are taken from the running stream and are refused unless it
+     * is at least the picture size, e.g. with odroid-capture-size=sensor.
+     */
+    enum {
+        CAMERA_CMD_BURST_CAPTURE = 0x1000,
+        CAMERA_CMD_MOTION_DETECTION = 0x1001,
+    };
+
+    /*
+     * CAMERA_CMD_MOTION_DETECTION takes the per block threshold in arg1
+     * (mean absolute luma difference, 1..255; 0 turns detection off) and
+     * the number of changed blocks that counts as motion in arg2.  While
+     * something moves, every preview frame sends CAMERA_MSG_PREVIEW_METADATA
+     * with no faces and a MotionEvent as data; one more event with fewer
+     * changed blocks follows when the scene settles.
+     */
+    enum {
+        kMotionCols = 16,
+        kMotionRows = 12,
+    };
+
+    struct MotionEvent {
+        uint32_t            sequence;   /* V4L2 frame sequence */
+        uint32_t            score;      /* mean difference, 8.8 fixed point */
+        uint16_t            cols;
+        uint16_t            rows;
+        uint16_t            changed;    /* blocks over the threshold */
+        uint16_t            reserved;
+        uint32_t            bitmap[kMotionRows]; /* bit x of word y: block x,y */
+    };
+
+    /* How a frame consumer reacts when it cannot keep up with capture. */
+    enum FramePolicy {
+        FRAME_POLICY_LATEST = 0,    /* newest frame replaces a pending one */
+        FRAME_POLICY_BOUNDED,       /* queue a few frames, drop when full */
+        FRAME_POLICY_BLOCK,         /* stall capture until there is room */
+    };
+
+    enum FrameConsumer {
+        CONSUMER_DISPLAY = 0,
+        CONSUMER_CALLBACK,
+        CONSUMER_RECORD,
+        CONSUMER_COUNT
+    };
+
 private:
 
 
     static const int kBufferCount = 4;
+    static const int kCallbackBufferCount = 4;
+    static const int kRecordBufferCount = 6;
+    static const nsecs_t kBlockTimeout = 100000000LL; /* 100ms */
+    static const int kMaxBurstCount = 30;
+    static const size_t kMaxBurstBytes = 64 << 20;
+    static const int kBurstWorkers = 2;
+    static const int kMaxCaptureSizes = 16;
+    static const nsecs_t kStillTimeout = 1000000000LL; /* 1s */
+    static const int kExposureInterval = 3;    /* frames for a change to show */
+    static const int kExposureDeadband = 6;    /* luma levels */
 
     class PreviewThread : public Thread {
         CameraHardware* mHardware;
@@ -129,30 +198,81 @@ private:
         }
     };
 
+    class CallbackThread : public Thread {
+        CameraHardware* mHardware;
+    public:
+        CallbackThread(CameraHardware* hw)
+            : Thread(false), mHardware(hw) { }
+        virtual void onFirstRef() {
+            run("CameraCallbackThread", PRIORITY_DISPLAY);
+        }
+        virtual bool threadLoop() {
+            mHardware->callbackThread();
+            // loop until we need to quit
+            return true;
+        }
+    };
+
     void initDefaultParameters();
     bool initHeapLocked();
+    int previewFrameRate() const;
+    void pickCaptureSize(int needWidth, int needHeight, int *width, int *height) const;
+    void captureSize(const CameraParameters& params, int *width, int *height) const;
+    void fillParametersLocked(CameraParameters& params) const;
 
     int previewThread();
+    int callbackThread();
+    void *grabFrame();
+
+    void displayFrame(void *frame, int width, int height);
+    void postPreviewFrame(void *frame, int width, int height,
+                          FramePolicy policy);
+    void postRecordingFrame(void *frame, FramePolicy policy);
+    void captureStill(void *frame);
+    bool grabLiveStill(uint8_t *still, int width, int height);
+    bool grabStill(uint8_t *still, int width, int height, int zoomRatio);
+    void analyzeFrame(void *frame, int motionThreshold, int motionMinBlocks,
+                      bool lumaStats, int exposureTarget);
+    void postMotionEvent(MotionEvent& event, int changed, int minBlocks);
+    void adjustExposure(int mean, int target);
+    void freeFrameBuffers();
+
+    static FramePolicy policyFromString(const char *str, FramePolicy def);
 
     static int beginAutoFocusThread(void *cookie);
     int autoFocusThread();
 
     static int beginPictureThread(void *cookie);
     int pictureThread();
+
+    status_t startBurst(int count);
+    void cancelBurst();
+    void captureBurstFrame(void *frame);
+    static int beginBurstWorker(void *cookie);
+    int burstWorker();
     camera_request_memory   mRequestMemory;
     mutable Mutex           mLock;
+    // set under mLock and mWindowLock; displayFrame() only holds
+    // mWindowLock, so a blocking compositor does not stall mLock
     preview_stream_ops_t*  mNativeWindow;
+    mutable Mutex           mWindowLock;
 
     int                     mCameraId;
+    char                    mDevice[PROPERTY_VALUE_MAX];
     CameraParameters        mParameters;
 
+    // modes the device offers, largest first; fixed after construction
+    FrameSize               mCaptureSizes[kMaxCaptureSizes];
+    int                     mCaptureSizeCount;
+    // mode the stream runs at, protected by mLock
+    int                     mCaptureWidth;
+    int                     mCaptureHeight;
+
     sp<MemoryHeapBase>      mHeap;
     sp<MemoryBase>          mBuffer;
 
     sp<MemoryHeapBase>      mPreviewHeap;
     sp<MemoryHeapBase>      mRawHeap;
-    sp<MemoryHeapBase>      mRecordHeap;
-    sp<MemoryBase>          mRecordBuffer;
 
     bool                    mPreviewRunning;
     bool                    mRecordRunning;
@@ -163,6 +283,113 @@ private:
 
     // only used from PreviewThread
     int                     mCurrentPreviewFrame;
+    int                     mFrameWidth;
+    int                     mFrameHeight;
+    int                     mFrameZoomRatio;
+    nsecs_t                 mFrameDequeued;
+    struct yuyv_scaler      mDisplayScaler;
+    struct yuyv_scaler      mCallbackScaler;
+    struct yuyv_scaler      mRecordScaler;
+    struct yuyv_scaler      mBurstScaler;
+    struct yuyv_scaler      mStillScaler;
+    struct yuyv_motion      mMotion;
+    bool                    mMotionActive;
+    struct yuyv_luma_stats  mFrameLuma;
+    bool                    mExposureActive;
+    bool                    mExposureUnsupported;
+    int                     mExposureValue;
+    int                     mExposureMin;
+    int                     mExposureMax;
+    int                     mExposureFrames;
+
+    // index into the zoom ratio table, protected by mLock
+    int                     mZoom;
+    // size of CAMERA_MSG_PREVIEW_FRAME buffers, protected by mLock
+    int                     mCallbackWidth;
+    int                     mCallbackHeight;
+
+    // motion detection settings, protected by mLock
+    int                     mMotionThreshold;
+    int                     mMotionMinBlocks;
+
+    // luma statistics and exposure loop, protected by mLock; mLuma is
+    // the last published frame, mLumaSeq counts publications
+    bool                    mLumaStats;
+    bool                    mExposureControl;
+    int                     mExposureTarget;
+    struct yuyv_luma_stats  mLuma;
+    uint32_t                mLumaSeq;
+    int                     mLumaExposure;
+
+    // per-consumer frame policy, protected by mLock; the drop counts
+    // are bumped with __sync_fetch_and_add from paths that hold the
+    // consumer's own lock or none, and read as plain words
+    FramePolicy             mPolicy[CONSUMER_COUNT];
+    uint32_t                mDropped[CONSUMER_COUNT];
+
+    // flattened getParameters() result, rebuilt when mParamsVersion or
+    // the drop counts move on; protected by mLock
+    uint32_t                mParamsVersion;
+    mutable uint32_t        mFlatVersion;
+    mutable uint32_t        mFlatDropped[CONSUMER_COUNT];
+    mutable uint32_t        mFlatLumaSeq;
+    mutable String8         mFlatParams;
+
+    // preview callback ring, protected by mCallbackLock
+    mutable Mutex           mCallbackLock;
+    Condition               mCallbackCond;
+    sp<CallbackThread>      mCallbackThread;
+    camera_memory_t*        mCallbackMem;
+    int                     mCallbackFrameSize;
+    Vector<int>             mCallbackQueue;
+    nsecs_t                 mCallbackStamp[kCallbackBufferCount];
+    int                     mCallbackBusy;
+
+    // recording buffers owned by the encoder, protected by mRecordLock
+    mutable Mutex           mRecordLock;
+    Condition               mRecordCond;
+    camera_memory_t*        mRecordMem;
+    int                     mRecordFrameSize;
+    int                     mRecordWidth;
+    int                     mRecordHeight;
+    bool                    mRecordBusy[kRecordBufferCount];
+    bool                    mRecordPosting;
+
+    // burst capture ring, protected by mBurstLock
+    struct BurstFrame {
+        uint32_t            sequence;
+        nsecs_t             timestamp;
+    };
+    Mutex                   mBurstLock;
+    Condition               mBurstCond;
+    unsigned char*          mBurstRing;
+    size_t                  mBurstRingSize;
+    int                     mBurstFrameSize;
+    int                     mBurstWidth;
+    int                     mBurstHeight;
+    BurstFrame              mBurstFrames[kMaxBurstCount];
+    volatile int            mBurstTotal;
+    int                     mBurstCaptured;
+    int                     mBurstEncodeNext;
+    int                     mBurstDelivered;
+    int                     mBurstWorkersRunning;
+    volatile bool           mBurstCancel;
+
+    int                     mJpegQuality;
+
+    // still capture state, protected by mLock
+    Condition               mPictureCond;
+    bool                    mPictureRunning;
+    volatile bool           mPictureCancel;
+    nsecs_t                 mPictureRequested;
+    // a still taken from the running stream, handed over through mPictureCond
+    uint8_t*                mStillBuffer;
+    int                     mStillWidth;
+    int                     mStillHeight;
+    int                     mStillZoomRatio;
+    bool                    mStillRequest;
+    bool                    mStillBusy;
+    bool                    mStillDone;
 
     void *                  framebuffer;
     bool                    previewStopped;
@@ -170,7 +397,8 @@ private:
     void*                   mem[4];
     int                     nQueued;
     int                     nDequeued;
-    V4L2Camera              camera;
+    CaptureBackend*         camera;
+    mutable CameraStats     mStats;
     camera_notify_callback         mNotifyFn;
     camera_data_callback           mDataFn;
     camera_data_timestamp_callback mTimestampFn;
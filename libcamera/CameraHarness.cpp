@@ -0,0 +1,454 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Drives the camera HAL the way the camera service does, through
+ * camera_device_ops, with a stub preview window and stub callbacks, and
+ * reports what every consumer path saw.  Given a file the frames come
+ * from the ReplayCamera backend, so no sensor is needed; without one the
+ * camera's own sensor is measured:
+ *
+ *   camera_harness [-c id] [-t seconds] [-p WxH] [-r] [-j] [FILE:WxH[@FPS]]
+ *
+ * -r also records (the stub encoder returns every buffer at once), -j
+ * takes a picture at the end.  The HAL's own per-path latency comes from
+ * its dump, printed after the run.
+ */
+
+#define LOG_TAG "CameraHarness"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+#include <hardware/camera.h>
+#include <hardware/hardware.h>
+#include <camera/CameraParameters.h>
+#include <ui/GraphicBufferAllocator.h>
+#include <utils/Log.h>
+#include <utils/Mutex.h>
+#include <utils/Condition.h>
+#include <utils/Timers.h>
+
+using namespace android;
+
+static const int kMaxWindowBuffers = 8;
+static const nsecs_t kPictureTimeout = seconds(5);
+
+/* deliveries seen by one stub consumer */
+struct PathStats {
+    const char  *name;
+    uint32_t    count;
+    nsecs_t     first;
+    nsecs_t     last;
+    nsecs_t     maxGap;
+};
+
+static void pathDelivered(PathStats *p)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    if (p->count == 0)
+        p->first = now;
+    else if (now - p->last > p->maxGap)
+        p->maxGap = now - p->last;
+    p->last = now;
+    p->count++;
+}
+
+static void pathReport(const PathStats *p)
+{
+    double fps = 0;
+
+    if (p->count > 1)
+        fps = (p->count - 1) * 1e9 / (p->last - p->first);
+    printf("  %-9s %6u frames, %6.2f fps, longest gap %.1f ms\n",
+           p->name, p->count, fps, p->maxGap / 1e6);
+}
+
+/*
+ * Preview window backed by gralloc buffers that are never composed:
+ * enqueue only returns the buffer to the free list.
+ */
+struct StubWindow {
+    preview_stream_ops_t ops;   /* first, the HAL only sees this */
+    int             width;
+    int             height;
+    int             format;
+    int             usage;
+    int             count;
+    int             stride;
+    buffer_handle_t buffers[kMaxWindowBuffers];
+    bool            dequeued[kMaxWindowBuffers];
+    PathStats       stats;
+};
+
+static StubWindow *toWindow(preview_stream_ops_t *w)
+{
+    return (StubWindow *)w;
+}
+
+static void windowFree(StubWindow *win)
+{
+    GraphicBufferAllocator &alloc = GraphicBufferAllocator::get();
+
+    for (int i = 0; i < kMaxWindowBuffers; i++) {
+        if (win->buffers[i] != NULL)
+            alloc.free(win->buffers[i]);
+        win->buffers[i] = NULL;
+        win->dequeued[i] = false;
+    }
+}
+
+static int windowDequeue(preview_stream_ops_t *w, buffer_handle_t **buffer,
+                         int *stride)
+{
+    StubWindow *win = toWindow(w);
+
+    for (int i = 0; i < win->count; i++) {
+        if (win->dequeued[i])
+            continue;
+        if (win->buffers[i] == NULL) {
+            status_t err = GraphicBufferAllocator::get().alloc(
+                    win->width, win->height, win->format, win->usage,
+                    &win->buffers[i], &win->stride);
+            if (err != NO_ERROR)
+                return err;
+        }
+        win->dequeued[i] = true;
+        *buffer = &win->buffers[i];
+        *stride = win->stride;
+        return 0;
+    }
+    return -EBUSY;
+}
+
+static int windowReturn(preview_stream_ops_t *w, buffer_handle_t *buffer)
+{
+    StubWindow *win = toWindow(w);
+    int i = buffer - win->buffers;
+
+    if (i < 0 || i >= win->count || !win->dequeued[i])
+        return -EINVAL;
+    win->dequeued[i] = false;
+    return 0;
+}
+
+static int windowEnqueue(preview_stream_ops_t *w, buffer_handle_t *buffer)
+{
+    int err = windowReturn(w, buffer);
+
+    if (err == 0)
+        pathDelivered(&toWindow(w)->stats);
+    return err;
+}
+
+static int windowSetCount(preview_stream_ops_t *w, int count)
+{
+    StubWindow *win = toWindow(w);
+
+    if (count < 1 || count > kMaxWindowBuffers)
+        return -EINVAL;
+    windowFree(win);
+    win->count = count;
+    return 0;
+}
+
+static int windowSetGeometry(preview_stream_ops_t *w, int width, int height,
+                             int format)
+{
+    StubWindow *win = toWindow(w);
+
+    windowFree(win);
+    win->width = width;
+    win->height = height;
+    win->format = format;
+    return 0;
+}
+
+static int windowSetUsage(preview_stream_ops_t *w, int usage)
+{
+    toWindow(w)->usage = usage;
+    return 0;
+}
+
+static int windowSetCrop(preview_stream_ops_t *, int, int, int, int)
+{
+    return 0;
+}
+
+static int windowSetSwapInterval(preview_stream_ops_t *, int)
+{
+    return 0;
+}
+
+static int windowMinUndequeued(const preview_stream_ops_t *, int *count)
+{
+    *count = 1;
+    return 0;
+}
+
+static int windowLock(preview_stream_ops_t *, buffer_handle_t *)
+{
+    return 0;
+}
+
+static int windowSetTimestamp(preview_stream_ops_t *, int64_t)
+{
+    return 0;
+}
+
+/* callback side, the stand-in for the camera service */
+struct Harness {
+    camera_device_t *dev;
+    PathStats       callback;
+    PathStats       record;
+    Mutex           lock;
+    Condition       cond;
+    nsecs_t         pictureStart;
+    nsecs_t         shutter;
+    nsecs_t         picture;
+    size_t          pictureSize;
+    int             errors;
+};
+
+/* heap memory in place of ashmem, the buffers never leave the process */
+struct HarnessMemory {
+    camera_memory_t mem;        /* first, the HAL only sees this */
+    size_t          bufferSize;
+};
+
+static void memoryRelease(camera_memory_t *mem)
+{
+    free(mem->data);
+    delete (HarnessMemory *)mem;
+}
+
+static camera_memory_t *getMemory(int fd, size_t size, unsigned int count,
+                                  void *)
+{
+    HarnessMemory *m = new HarnessMemory;
+
+    m->mem.data = fd < 0 ? calloc(count, size) : NULL;
+    if (m->mem.data == NULL) {
+        delete m;
+        return NULL;
+    }
+    m->mem.size = size * count;
+    m->mem.handle = NULL;
+    m->mem.release = memoryRelease;
+    m->bufferSize = size;
+    return &m->mem;
+}
+
+static void notifyCb(int32_t msg, int32_t ext1, int32_t, void *user)
+{
+    Harness *h = (Harness *)user;
+    Mutex::Autolock lock(h->lock);
+
+    if (msg == CAMERA_MSG_SHUTTER) {
+        h->shutter = systemTime(SYSTEM_TIME_MONOTONIC);
+    } else if (msg == CAMERA_MSG_ERROR) {
+        ALOGE("camera error %d", ext1);
+        h->errors++;
+        h->cond.broadcast();
+    }
+}
+
+static void dataCb(int32_t msg, const camera_memory_t *mem, unsigned int,
+                   camera_frame_metadata_t *, void *user)
+{
+    Harness *h = (Harness *)user;
+
+    if (msg == CAMERA_MSG_PREVIEW_FRAME) {
+        pathDelivered(&h->callback);
+    } else if (msg == CAMERA_MSG_COMPRESSED_IMAGE) {
+        Mutex::Autolock lock(h->lock);
+        h->picture = systemTime(SYSTEM_TIME_MONOTONIC);
+        h->pictureSize = mem->size;
+        h->cond.broadcast();
+    }
+}
+
+/* the stub encoder is done with a frame as soon as it gets it */
+static void dataTimestampCb(nsecs_t, int32_t msg, const camera_memory_t *mem,
+                            unsigned int index, void *user)
+{
+    Harness *h = (Harness *)user;
+
+    if (msg != CAMERA_MSG_VIDEO_FRAME)
+        return;
+    pathDelivered(&h->record);
+    h->dev->ops->release_recording_frame(h->dev, (char *)mem->data +
+            index * ((const HarnessMemory *)mem)->bufferSize);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: camera_harness [-c id] [-t seconds] [-p WxH] [-r] [-j] "
+            "[FILE:WxH[@FPS]]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const camera_module_t *module;
+    camera_device_t *dev;
+    StubWindow win;
+    Harness h;
+    const char *previewSize = NULL;
+    const char *source = "sensor";
+    char key[PROPERTY_KEY_MAX], id[8];
+    int cameraId = 0, secs = 5, opt;
+    bool record = false, picture = false;
+    int32_t msgs = CAMERA_MSG_PREVIEW_FRAME;
+
+    while ((opt = getopt(argc, argv, "c:t:p:rj")) != -1) {
+        switch (opt) {
+        case 'c': cameraId = atoi(optarg); break;
+        case 't': secs = atoi(optarg); break;
+        case 'p': previewSize = optarg; break;
+        case 'r': record = true; break;
+        case 'j': picture = true; break;
+        default: usage();
+        }
+    }
+    if (optind < argc - 1)
+        usage();
+    if (optind < argc)
+        source = argv[optind];
+
+    /* the HAL picks the replay backend up when the device is opened; an
+     * empty property leaves it on the sensor
+     */
+    snprintf(key, sizeof(key), "debug.odroid.camera%d.replay", cameraId);
+    if (property_set(key, optind < argc ? argv[optind] : "") != 0) {
+        fprintf(stderr, "cannot set %s (not root?)\n", key);
+        return 1;
+    }
+
+    if (hw_get_module(CAMERA_HARDWARE_MODULE_ID,
+                      (const hw_module_t **)&module) != 0) {
+        fprintf(stderr, "no camera HAL\n");
+        return 1;
+    }
+    snprintf(id, sizeof(id), "%d", cameraId);
+    if (module->common.methods->open(&module->common, id,
+                                     (hw_device_t **)&dev) != 0) {
+        fprintf(stderr, "cannot open camera %d\n", cameraId);
+        return 1;
+    }
+
+    memset(&win, 0, sizeof(win));
+    win.ops.dequeue_buffer = windowDequeue;
+    win.ops.enqueue_buffer = windowEnqueue;
+    win.ops.cancel_buffer = windowReturn;
+    win.ops.set_buffer_count = windowSetCount;
+    win.ops.set_buffers_geometry = windowSetGeometry;
+    win.ops.set_crop = windowSetCrop;
+    win.ops.set_usage = windowSetUsage;
+    win.ops.set_swap_interval = windowSetSwapInterval;
+    win.ops.get_min_undequeued_buffer_count = windowMinUndequeued;
+    win.ops.lock_buffer = windowLock;
+    win.ops.set_timestamp = windowSetTimestamp;
+    win.count = 3;
+    win.stats.name = "display";
+
+    h.dev = dev;
+    memset(&h.callback, 0, sizeof(h.callback));
+    memset(&h.record, 0, sizeof(h.record));
+    h.callback.name = "callback";
+    h.record.name = "record";
+    h.pictureStart = h.shutter = h.picture = 0;
+    h.pictureSize = 0;
+    h.errors = 0;
+
+    if (previewSize != NULL) {
+        char *flat = dev->ops->get_parameters(dev);
+        CameraParameters params((String8(flat)));
+        int w, h2;
+
+        dev->ops->put_parameters(dev, flat);
+        if (sscanf(previewSize, "%dx%d", &w, &h2) != 2)
+            usage();
+        params.setPreviewSize(w, h2);
+        if (dev->ops->set_parameters(dev, params.flatten().string()) != 0)
+            fprintf(stderr, "preview size %s refused\n", previewSize);
+    }
+
+    dev->ops->set_callbacks(dev, notifyCb, dataCb, dataTimestampCb,
+                            getMemory, &h);
+    dev->ops->set_preview_window(dev, &win.ops);
+    if (record)
+        msgs |= CAMERA_MSG_VIDEO_FRAME;
+    dev->ops->enable_msg_type(dev, msgs);
+
+    if (dev->ops->start_preview(dev) != 0) {
+        fprintf(stderr, "start_preview failed\n");
+        return 1;
+    }
+    if (record && dev->ops->start_recording(dev) != 0)
+        fprintf(stderr, "start_recording failed\n");
+
+    sleep(secs);
+
+    if (record)
+        dev->ops->stop_recording(dev);
+
+    if (picture) {
+        Mutex::Autolock lock(h.lock);
+
+        dev->ops->enable_msg_type(dev, CAMERA_MSG_SHUTTER |
+                                  CAMERA_MSG_COMPRESSED_IMAGE);
+        h.pictureStart = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (dev->ops->take_picture(dev) != 0)
+            fprintf(stderr, "take_picture failed\n");
+        else
+            while (h.picture == 0 && h.errors == 0 &&
+                   h.cond.waitRelative(h.lock, kPictureTimeout) == NO_ERROR)
+                ;
+    }
+
+    dev->ops->stop_preview(dev);
+
+    printf("camera %d, %d s from %s\n", cameraId, secs, source);
+    pathReport(&win.stats);
+    pathReport(&h.callback);
+    if (record)
+        pathReport(&h.record);
+    if (picture) {
+        if (h.picture != 0)
+            printf("  picture   shutter %.1f ms, jpeg %.1f ms, %u bytes\n",
+                   h.shutter ? (h.shutter - h.pictureStart) / 1e6 : -1.,
+                   (h.picture - h.pictureStart) / 1e6,
+                   (unsigned)h.pictureSize);
+        else
+            printf("  picture   not delivered\n");
+    }
+    printf("  errors    %d\n\n", h.errors);
+    fflush(stdout);
+
+    dev->ops->dump(dev, STDOUT_FILENO);
+
+    dev->ops->release(dev);
+    dev->common.close(&dev->common);
+    windowFree(&win);
+    return h.errors != 0;
+}
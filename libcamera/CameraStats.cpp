@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "CameraStats"
+#include <utils/Log.h>
+#include <string.h>
+
+#include "CameraStats.h"
+
+namespace android {
+
+static const char * const stageNames[CameraStats::STAGE_COUNT] = {
+    "dqbuf",
+    "rgb565",
+    "nv21",
+    "callback",
+    "win-deq",
+    "enqueue",
+};
+
+static const char * const pathNames[CameraStats::PATH_COUNT] = {
+    "display",
+    "callback",
+    "record",
+    "shutter",
+    "picture",
+};
+
+/*static*/ const char *CameraStats::stageName(Stage stage)
+{
+    return stageNames[stage];
+}
+
+CameraStats::CameraStats()
+{
+    memset(mLatency, 0, sizeof(mLatency));
+    reset();
+}
+
+void CameraStats::reset()
+{
+    memset(mStage, 0, sizeof(mStage));
+    memset(mLatency, 0, PATH_SHUTTER * sizeof(mLatency[0]));
+    mStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    mLastFrame = 0;
+    mFrames = 0;
+    mLastSequence = 0;
+    mSequenceGaps = 0;
+    mBytes = 0;
+}
+
+void CameraStats::record(Stage stage, nsecs_t elapsed)
+{
+    Histogram& h = mStage[stage];
+    uint32_t us = elapsed > 0 ? (uint32_t)(elapsed / 1000) : 0;
+    int b = us ? 32 - __builtin_clz(us) : 0;
+
+    if (b >= kBuckets)
+        b = kBuckets - 1;
+    h.bucket[b]++;
+    h.count++;
+    h.total += elapsed;
+    if (elapsed > h.max)
+        h.max = elapsed;
+}
+
+/*
+ * Below 8us one bucket per microsecond, above that 8 buckets per power
+ * of two: the top three bits after the leading one select the bucket.
+ */
+/*static*/ int CameraStats::latencyBucket(uint32_t us)
+{
+    int e, b;
+
+    if (us < 8)
+        return us;
+    e = 31 - __builtin_clz(us);
+    b = (e - 2) * 8 + ((us >> (e - 3)) & 7);
+    return b < kLatencyBuckets ? b : kLatencyBuckets - 1;
+}
+
+/* Midpoint of a bucket in microseconds. */
+/*static*/ uint32_t CameraStats::bucketValue(int bucket)
+{
+    int e;
+
+    if (bucket < 8)
+        return bucket;
+    e = bucket / 8 + 2;
+    return ((8 + bucket % 8) << (e - 3)) + (1 << (e - 3)) / 2;
+}
+
+/*static*/ double CameraStats::percentile(const Latency& l, int permille)
+{
+    uint64_t want = ((uint64_t)l.count * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (int b = 0; b < kLatencyBuckets; b++) {
+        seen += l.bucket[b];
+        if (seen >= want && seen > 0)
+            return bucketValue(b) / 1000.;
+    }
+    return 0.;
+}
+
+void CameraStats::latency(Path path, nsecs_t since)
+{
+    Latency& l = mLatency[path];
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t elapsed = now - since;
+
+    if (since == 0 || elapsed < 0)
+        return;
+    l.bucket[latencyBucket(elapsed < 0xffffffffLL * 1000 ?
+                           (uint32_t)(elapsed / 1000) : 0xffffffffU)]++;
+    if (l.count++ == 0)
+        l.first = now;
+    l.last = now;
+    if (elapsed > l.max)
+        l.max = elapsed;
+}
+
+void CameraStats::frameCaptured(uint32_t sequence)
+{
+    if (mFrames && sequence > mLastSequence + 1)
+        mSequenceGaps += sequence - mLastSequence - 1;
+    mLastSequence = sequence;
+    mLastFrame = systemTime(SYSTEM_TIME_MONOTONIC);
+    mFrames++;
+}
+
+void CameraStats::dump(String8& out) const
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    double secs = (now - mStart) / 1e9;
+
+    out.appendFormat("  frames %u in %.1fs (%.2f fps), sequence gaps %u\n",
+                     mFrames, secs, secs > 0 ? mFrames / secs : 0.,
+                     mSequenceGaps);
+    out.appendFormat("  copied %.1f KB/s, last frame %lldms ago\n",
+                     secs > 0 ? mBytes / secs / 1024. : 0.,
+                     mLastFrame ? (long long)ns2ms(now - mLastFrame) : -1LL);
+
+    out.append("  stage       count   avg(us)   max(us)  histogram (<1us,<2us,<4us..)\n");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const Histogram& h = mStage[i];
+        int last = kBuckets - 1;
+
+        while (last > 0 && h.bucket[last] == 0)
+            last--;
+        out.appendFormat("  %-9s %7u %9lld %9lld  ", stageNames[i], h.count,
+                         h.count ? (long long)(h.total / h.count / 1000) : 0LL,
+                         (long long)(h.max / 1000));
+        for (int b = 0; b <= last; b++)
+            out.appendFormat(b ? ",%u" : "%u", h.bucket[b]);
+        out.append("\n");
+    }
+
+    out.append("  path        count   p50(ms)   p99(ms)   max(ms)      fps\n");
+    for (int i = 0; i < PATH_COUNT; i++) {
+        const Latency& l = mLatency[i];
+        double span = (l.last - l.first) / 1e9;
+
+        if (l.count == 0)
+            continue;
+        out.appendFormat("  %-9s %7u %9.2f %9.2f %9.2f %8.2f\n", pathNames[i], l.count,
+                         percentile(l, 500), percentile(l, 990), l.max / 1e6,
+                         span > 0 ? (l.count - 1) / span : 0.);
+    }
+}
+
+}; // namespace android
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_CAMERA_STATS_H
+#define ANDROID_HARDWARE_CAMERA_STATS_H
+
+#include <stdint.h>
+#include <cutils/trace.h>
+#include <utils/String8.h>
+#include <utils/Timers.h>
+
+namespace android {
+
+/*
+ * Always-on counters for the preview pipeline.  Every stage is timed
+ * into a log2 histogram of microseconds; updates are plain stores done
+ * by the thread owning the stage, so a concurrent dump may be off by a
+ * frame but never costs the hot path a lock.
+ */
+class CameraStats {
+public:
+    enum Stage {
+        STAGE_DQBUF = 0,
+        STAGE_RGB,
+        STAGE_NV21,
+        STAGE_CALLBACK,
+        STAGE_WINDOW_DEQUEUE,
+        STAGE_ENQUEUE,
+        STAGE_COUNT
+    };
+
+    /*
+     * End-to-end paths, each timed from the moment its frame left the
+     * driver (or from takePicture() for stills) to the return of the
+     * call that handed it over.
+     */
+    enum Path {
+        PATH_DISPLAY = 0,       /* to enqueue_buffer */
+        PATH_CALLBACK,          /* to the preview data callback */
+        PATH_RECORD,            /* to the video timestamp callback */
+        PATH_SHUTTER,           /* takePicture() to the shutter */
+        PATH_PICTURE,           /* takePicture() to the JPEG callback */
+        PATH_COUNT
+    };
+
+    static const int kBuckets = 21;     /* 1us .. ~1s */
+    /* 8 per octave for ~6% resolution; 1us .. ~16s */
+    static const int kLatencyBuckets = 184;
+
+    CameraStats();
+
+    /* Still capture paths survive this, as they restart preview. */
+    void reset();
+    void record(Stage stage, nsecs_t elapsed);
+    void latency(Path path, nsecs_t since);
+    void frameCaptured(uint32_t sequence);
+    void addBytes(uint32_t bytes) { mBytes += bytes; }
+
+    void dump(String8& out) const;
+
+    static const char *stageName(Stage stage);
+
+private:
+    struct Histogram {
+        uint32_t count;
+        uint32_t bucket[kBuckets];
+        nsecs_t  total;
+        nsecs_t  max;
+    };
+
+    struct Latency {
+        uint32_t count;
+        uint32_t bucket[kLatencyBuckets];
+        nsecs_t  max;
+        nsecs_t  first;         /* first and last delivery, for the rate */
+        nsecs_t  last;
+    };
+
+    static int latencyBucket(uint32_t us);
+    static uint32_t bucketValue(int bucket);
+    static double percentile(const Latency& l, int permille);
+
+    Histogram   mStage[STAGE_COUNT];
+    Latency     mLatency[PATH_COUNT];
+    nsecs_t     mStart;
+    nsecs_t     mLastFrame;
+    uint32_t    mFrames;
+    uint32_t    mLastSequence;
+    uint32_t    mSequenceGaps;
+    uint64_t    mBytes;
+};
+
+/*
+ * Times the enclosing scope into one stage of a CameraStats, and marks
+ * it as a systrace slice when the camera trace tag is enabled.
+ */
+class StageTimer {
+public:
+    StageTimer(CameraStats& stats, CameraStats::Stage stage)
+        : mStats(stats), mStage(stage), mStart(systemTime(SYSTEM_TIME_MONOTONIC)) {
+        atrace_begin(ATRACE_TAG_CAMERA, CameraStats::stageName(stage));
+    }
+    ~StageTimer() {
+        atrace_end(ATRACE_TAG_CAMERA);
+        mStats.record(mStage, systemTime(SYSTEM_TIME_MONOTONIC) - mStart);
+    }
+private:
+    CameraStats&        mStats;
+    CameraStats::Stage  mStage;
+    nsecs_t             mStart;
+};
+
+}; // namespace android
+
+#endif
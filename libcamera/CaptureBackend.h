@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CAPTURE_BACKEND_H
+#define _CAPTURE_BACKEND_H
+
+#include <stdint.h>
+#include <linux/videodev2.h>
+#include <utils/Timers.h>
+
+/* buffers queued to the driver while streaming */
+#define NB_BUFFER 4
+
+namespace android {
+
+struct FrameSize {
+    int width;
+    int height;
+};
+
+/*
+ * Where CameraHardware gets its frames from.  V4L2Camera drives a real
+ * /dev/videoN node; ReplayCamera streams a recorded file so the whole
+ * pipeline can run and be profiled without a camera attached.
+ *
+ * Calls come in the order Open, SetFrameRate, Init, StartStreaming, then
+ * GrabPreviewFrame / ReleasePreviewFrame pairs, and back down through
+ * Uninit, StopStreaming and Close.  At most one frame is held at a time;
+ * the Frame* accessors describe the held frame.
+ */
+class CaptureBackend {
+public:
+    virtual ~CaptureBackend() {}
+
+    /* Sizes the device can stream, largest first; needs no Open(). */
+    virtual int EnumFrameSizes (const char *device, int pixelformat,
+                                FrameSize *sizes, int max) = 0;
+
+    /* The device may settle on another size; Width()/Height() tell. */
+    virtual int Open (const char *device, int width, int height, int pixelformat) = 0;
+    virtual void Close () = 0;
+    virtual int SetFrameRate (int fps) = 0;
+    virtual int Width () const = 0;
+    virtual int Height () const = 0;
+    virtual void GetFormat (struct v4l2_pix_format *pix) const = 0;
+
+    virtual int Init () = 0;
+    virtual void Uninit () = 0;
+    virtual int StartStreaming () = 0;
+    virtual int StopStreaming () = 0;
+
+    virtual void * GrabPreviewFrame () = 0;
+    virtual void ReleasePreviewFrame () = 0;
+    virtual bool FrameReady () = 0;
+    virtual uint32_t FrameSequence () const = 0;
+    virtual nsecs_t FrameTimestamp () const = 0;
+    virtual int BuffersQueued () const = 0;
+
+    /* See V4L2Camera; backends without exposure control return -1. */
+    virtual int StartManualExposure (int *minimum, int *maximum) = 0;
+    virtual int SetExposure (int value) = 0;
+    virtual void StopManualExposure () = 0;
+};
+
+}; // namespace android
+
+#endif
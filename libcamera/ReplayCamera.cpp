@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ReplayCamera"
+#define ATRACE_TAG ATRACE_TAG_CAMERA
+#include <utils/Log.h>
+#include <utils/Trace.h>
+#include <cutils/properties.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ReplayCamera.h"
+
+namespace android {
+
+ReplayCamera::ReplayCamera ()
+    : mFd(-1), mMap(NULL), mMapSize(0), mFrameCount(0),
+      mWidth(0), mHeight(0), mFileFps(0), mInterval(0),
+      mStreaming(false), mStart(0), mNext(0), mEmpty(0),
+      mFilledHead(0), mFilledCount(0), mSequence(0), mTimestamp(0)
+{
+}
+
+ReplayCamera::~ReplayCamera ()
+{
+    Close();
+}
+
+bool ReplayCamera::GetDevice (int cameraId, char *device, size_t len)
+{
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+
+    snprintf(key, sizeof(key), "debug.odroid.camera%d.replay", cameraId);
+    if (property_get(key, value, NULL) <= 0)
+        return false;
+    snprintf(device, len, "%s", value);
+    return true;
+}
+
+bool ReplayCamera::ParseDevice (const char *device, char *path, size_t len,
+                                int *width, int *height, int *fps)
+{
+    const char *sep = strrchr(device, ':');
+
+    *fps = 0;
+    if (sep == NULL || (size_t)(sep - device) >= len ||
+        sscanf(sep + 1, "%dx%d@%d", width, height, fps) < 2 ||
+        *width <= 0 || *height <= 0 || (*width & 1) || *fps < 0) {
+        ALOGE("bad replay device '%s', want path:WIDTHxHEIGHT[@FPS]", device);
+        return false;
+    }
+    memcpy(path, device, sep - device);
+    path[sep - device] = '\0';
+    return true;
+}
+
+int ReplayCamera::EnumFrameSizes (const char *device, int pixelformat,
+                                  FrameSize *sizes, int max)
+{
+    char path[PATH_MAX];
+    int width, height, fps;
+
+    if (max < 1 || pixelformat != V4L2_PIX_FMT_YUYV ||
+        !ParseDevice(device, path, sizeof(path), &width, &height, &fps))
+        return 0;
+    sizes[0].width = width;
+    sizes[0].height = height;
+    return 1;
+}
+
+int ReplayCamera::Open (const char *device, int width, int height, int pixelformat)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    size_t frameSize;
+
+    if (pixelformat != V4L2_PIX_FMT_YUYV) {
+        ALOGE("Open: only YUYV recordings can be replayed");
+        return -1;
+    }
+    if (!ParseDevice(device, path, sizeof(path), &mWidth, &mHeight, &mFileFps))
+        return -1;
+
+    if ((mFd = open(path, O_RDONLY)) < 0) {
+        ALOGE("Open: %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    frameSize = (size_t)mWidth * mHeight * 2;
+    if (fstat(mFd, &st) < 0 || st.st_size < (off_t)frameSize) {
+        ALOGE("Open: %s holds no %dx%d frame", path, mWidth, mHeight);
+        Close();
+        return -1;
+    }
+    mFrameCount = st.st_size / frameSize;
+    mMapSize = mFrameCount * frameSize;
+
+    // private and writable, so a consumer scribbling on a frame cannot fault
+    mMap = (uint8_t *)mmap(NULL, mMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, mFd, 0);
+    if (mMap == MAP_FAILED) {
+        ALOGE("Open: mmap %s: %s", path, strerror(errno));
+        mMap = NULL;
+        Close();
+        return -1;
+    }
+
+    if (mWidth != width || mHeight != height)
+        ALOGW("Open: asked for %dx%d, recording is %dx%d", width, height, mWidth, mHeight);
+    ALOGI("replaying %d frames of %dx%d from %s", mFrameCount, mWidth, mHeight, path);
+
+    mInterval = 1000000000LL / (mFileFps ? mFileFps : 30);
+    return 0;
+}
+
+void ReplayCamera::Close ()
+{
+    if (mMap != NULL)
+        munmap(mMap, mMapSize);
+    if (mFd >= 0)
+        close(mFd);
+    mMap = NULL;
+    mMapSize = 0;
+    mFd = -1;
+    mStreaming = false;
+}
+
+/* A rate given in the device string wins, as a recording has only one. */
+int ReplayCamera::SetFrameRate (int fps)
+{
+    if (fps <= 0)
+        return -1;
+    if (mFileFps == 0)
+        mInterval = 1000000000LL / fps;
+    return 0;
+}
+
+void ReplayCamera::GetFormat (struct v4l2_pix_format *pix) const
+{
+    memset(pix, 0, sizeof(*pix));
+    pix->width = mWidth;
+    pix->height = mHeight;
+    pix->pixelformat = V4L2_PIX_FMT_YUYV;
+    pix->field = V4L2_FIELD_NONE;
+    pix->bytesperline = mWidth * 2;
+    pix->sizeimage = mWidth * mHeight * 2;
+}
+
+int ReplayCamera::StartStreaming ()
+{
+    if (mMap == NULL)
+        return -1;
+    mStart = systemTime();
+    mNext = 0;
+    mEmpty = NB_BUFFER;
+    mFilledHead = 0;
+    mFilledCount = 0;
+    mStreaming = true;
+    return 0;
+}
+
+int ReplayCamera::StopStreaming ()
+{
+    mStreaming = false;
+    return 0;
+}
+
+/* Let the sensor deliver every frame due by now into the empty buffers. */
+void ReplayCamera::CatchUp (nsecs_t now)
+{
+    while (now >= mStart + (nsecs_t)mNext * mInterval) {
+        if (mEmpty == 0) {
+            // nowhere to put them: skip straight past what is due
+            mNext = (now - mStart) / mInterval + 1;
+            break;
+        }
+        mFilled[(mFilledHead + mFilledCount) % NB_BUFFER] = mNext++;
+        mFilledCount++;
+        mEmpty--;
+    }
+}
+
+void * ReplayCamera::GrabPreviewFrame ()
+{
+    ATRACE_CALL();
+
+    if (!mStreaming)
+        return NULL;
+
+    CatchUp(systemTime());
+    if (mFilledCount == 0) {
+        nsecs_t due = mStart + (nsecs_t)mNext * mInterval;
+        struct timespec ts;
+
+        if (mEmpty == 0)
+            return NULL;
+        ts.tv_sec = due / 1000000000LL;
+        ts.tv_nsec = due % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+        CatchUp(due);
+    }
+
+    mSequence = mFilled[mFilledHead];
+    mFilledHead = (mFilledHead + 1) % NB_BUFFER;
+    mFilledCount--;
+    mTimestamp = mStart + (nsecs_t)mSequence * mInterval;
+    ATRACE_INT("cameraFrameSeq", mSequence);
+
+    return mMap + (size_t)(mSequence % mFrameCount) * mWidth * mHeight * 2;
+}
+
+void ReplayCamera::ReleasePreviewFrame ()
+{
+    // frames that came due while it was out could not use this buffer
+    CatchUp(systemTime());
+    mEmpty++;
+}
+
+bool ReplayCamera::FrameReady ()
+{
+    if (!mStreaming)
+        return false;
+    CatchUp(systemTime());
+    return mFilledCount > 0;
+}
+
+}; // namespace android
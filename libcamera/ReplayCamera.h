@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _REPLAY_CAMERA_H
+#define _REPLAY_CAMERA_H
+
+#include "CaptureBackend.h"
+
+namespace android {
+
+/*
+ * Capture backend that plays back a file of raw YUYV frames, such as
+ * "v4l2-ctl --stream-mmap --stream-to=FILE" writes, in a loop.  The
+ * device string is "path:WIDTHxHEIGHT[@FPS]".  Frames are handed out at
+ * the recorded rate (or, without @FPS, the rate the HAL asks for) with
+ * CLOCK_MONOTONIC timestamps on that schedule.  Buffers are modelled
+ * like a driver's: NB_BUFFER of them, filled in order while queued, and
+ * frames that find none free are lost, which shows as a jump in the
+ * sequence number.
+ */
+class ReplayCamera : public CaptureBackend {
+public:
+    ReplayCamera();
+    virtual ~ReplayCamera();
+
+    /*
+     * Camera cameraId replays the file named by the property
+     * debug.odroid.camera<cameraId>.replay when that is set.
+     */
+    static bool GetDevice (int cameraId, char *device, size_t len);
+
+    virtual int EnumFrameSizes (const char *device, int pixelformat,
+                                FrameSize *sizes, int max);
+
+    virtual int Open (const char *device, int width, int height, int pixelformat);
+    virtual void Close ();
+    virtual int SetFrameRate (int fps);
+    virtual int Width () const { return mWidth; }
+    virtual int Height () const { return mHeight; }
+    virtual void GetFormat (struct v4l2_pix_format *pix) const;
+
+    virtual int Init () { return 0; }
+    virtual void Uninit () { }
+    virtual int StartStreaming ();
+    virtual int StopStreaming ();
+
+    virtual void * GrabPreviewFrame ();
+    virtual void ReleasePreviewFrame ();
+    virtual bool FrameReady ();
+    virtual uint32_t FrameSequence () const { return mSequence; }
+    virtual nsecs_t FrameTimestamp () const { return mTimestamp; }
+    virtual int BuffersQueued () const { return mEmpty + mFilledCount; }
+
+    virtual int StartManualExposure (int *, int *) { return -1; }
+    virtual int SetExposure (int) { return -1; }
+    virtual void StopManualExposure () { }
+
+private:
+    static bool ParseDevice (const char *device, char *path, size_t len,
+                             int *width, int *height, int *fps);
+    void CatchUp (nsecs_t now);
+
+    int         mFd;
+    uint8_t*    mMap;
+    size_t      mMapSize;
+    int         mFrameCount;
+    int         mWidth;
+    int         mHeight;
+    int         mFileFps;       /* from the device string, 0 if not given */
+    nsecs_t     mInterval;
+
+    bool        mStreaming;
+    nsecs_t     mStart;
+    uint32_t    mNext;          /* sequence of the next frame due */
+    int         mEmpty;         /* buffers queued and waiting for a frame */
+    uint32_t    mFilled[NB_BUFFER];     /* sequences waiting to be dequeued */
+    int         mFilledHead;
+    int         mFilledCount;
+    uint32_t    mSequence;      /* the dequeued frame */
+    nsecs_t     mTimestamp;
+};
+
+}; // namespace android
+
+#endif
@@ -9,21 +9,23 @@
  */
 
 #define LOG_TAG "V4L2Camera"
+#define ATRACE_TAG ATRACE_TAG_CAMERA
 #include <utils/Log.h>
+#include <utils/Trace.h>
 #include <utils/threads.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "V4L2Camera.h"
 
 extern "C" { /* Android jpeglib.h missed extern "C" */
 #include <jpeglib.h>
-     void convertYUYVtoRGB565(unsigned char *buf, unsigned char *rgb, int width, int height);
 }
 
 namespace android {
 
 V4L2Camera::V4L2Camera ()
-    : nQueued(0), nDequeued(0)
+    : nQueued(0), nDequeued(0), exposureId(0), exposureAuto(-1)
 {
     videoIn = (struct vdIn *) calloc (1, sizeof (struct vdIn));
 }
@@ -45,17 +47,17 @@ int V4L2Camera::Open (const char *device, int width, int height, int pixelformat
     ret = ioctl (fd, VIDIOC_QUERYCAP, &videoIn->cap);
     if (ret < 0) {
         ALOGE("Error opening device: unable to query device.");
-        return -1;
+        goto fail;
     }
 
     if ((videoIn->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) == 0) {
         ALOGE("Error opening device: video capture not supported.");
-        return -1;
+        goto fail;
     }
 
     if (!(videoIn->cap.capabilities & V4L2_CAP_STREAMING)) {
         ALOGE("Capture device does not support streaming i/o");
-        return -1;
+        goto fail;
     }
 
     videoIn->width = width;
@@ -71,12 +73,175 @@ int V4L2Camera::Open (const char *device, int width, int height, int pixelformat
     ret = ioctl(fd, VIDIOC_S_FMT, &videoIn->format);
     if (ret < 0) {
         ALOGE("Open: VIDIOC_S_FMT Failed: %s", strerror(errno));
+        close(fd);
+        fd = -1;
         return ret;
     }
 
+    // the driver picks the nearest mode it has
+    if (videoIn->format.fmt.pix.width != (unsigned)width ||
+        videoIn->format.fmt.pix.height != (unsigned)height) {
+        ALOGW("Open: asked for %dx%d, got %ux%u", width, height,
+              videoIn->format.fmt.pix.width, videoIn->format.fmt.pix.height);
+        videoIn->width = videoIn->format.fmt.pix.width;
+        videoIn->height = videoIn->format.fmt.pix.height;
+        videoIn->framesizeIn = videoIn->width * videoIn->height << 1;
+    }
+
+    return 0;
+
+fail:
+    close(fd);
+    fd = -1;
+    return -1;
+}
+
+/*
+ * Lists the discrete frame sizes the device offers for pixelformat,
+ * largest first.  Stepwise devices report their largest size only.
+ * Returns the number of sizes found, 0 if the device cannot tell.
+ */
+int V4L2Camera::EnumFrameSizes (const char *device, int pixelformat,
+                                FrameSize *sizes, int max)
+{
+    struct v4l2_frmsizeenum frmsize;
+    int dev, count = 0;
+
+    if ((dev = open(device, O_RDWR)) == -1)
+        return 0;
+
+    memset(&frmsize, 0, sizeof(frmsize));
+    frmsize.pixel_format = pixelformat;
+    while (count < max && ioctl(dev, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0) {
+        if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+            sizes[count].width = frmsize.discrete.width;
+            sizes[count].height = frmsize.discrete.height;
+        } else {
+            sizes[count].width = frmsize.stepwise.max_width;
+            sizes[count].height = frmsize.stepwise.max_height;
+            count++;
+            break;
+        }
+        count++;
+        frmsize.index++;
+    }
+    close(dev);
+
+    // insertion sort, largest area first; there are only a handful
+    for (int i = 1; i < count; i++) {
+        FrameSize s = sizes[i];
+        int j = i;
+        while (j > 0 && sizes[j - 1].width * sizes[j - 1].height < s.width * s.height) {
+            sizes[j] = sizes[j - 1];
+            j--;
+        }
+        sizes[j] = s;
+    }
+
+    return count;
+}
+
+/* Must be called before the stream is started; most UVC drivers refuse it later. */
+int V4L2Camera::SetFrameRate (int fps)
+{
+    struct v4l2_streamparm parm;
+    int ret;
+
+    if (fps <= 0)
+        return -1;
+
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = fps;
+
+    ret = ioctl(fd, VIDIOC_S_PARM, &parm);
+    if (ret < 0)
+        ALOGW("SetFrameRate: VIDIOC_S_PARM %d fps failed: %s", fps, strerror(errno));
+
+    return ret;
+}
+
+int V4L2Camera::GetControl (int id, int *value)
+{
+    struct v4l2_control ctrl;
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.id = id;
+    if (ioctl(fd, VIDIOC_G_CTRL, &ctrl) < 0)
+        return -1;
+    *value = ctrl.value;
+    return 0;
+}
+
+int V4L2Camera::SetControl (int id, int value)
+{
+    struct v4l2_control ctrl;
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.id = id;
+    ctrl.value = value;
+    if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+        ALOGW("SetControl: 0x%x = %d failed: %s", id, value, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
+int V4L2Camera::StartManualExposure (int *minimum, int *maximum)
+{
+    /* sensor drivers use EXPOSURE, UVC cameras EXPOSURE_ABSOLUTE */
+    static const int ids[] = { V4L2_CID_EXPOSURE, V4L2_CID_EXPOSURE_ABSOLUTE };
+    struct v4l2_queryctrl qc;
+    int value;
+
+    exposureId = 0;
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]) && exposureId == 0; i++) {
+        memset(&qc, 0, sizeof(qc));
+        qc.id = ids[i];
+        if (ioctl(fd, VIDIOC_QUERYCTRL, &qc) == 0 &&
+            !(qc.flags & V4L2_CTRL_FLAG_DISABLED) && qc.maximum > qc.minimum)
+            exposureId = qc.id;
+    }
+    if (exposureId == 0)
+        return -1;
+
+    exposureAuto = -1;
+    if (GetControl(V4L2_CID_EXPOSURE_AUTO, &value) == 0 && value != V4L2_EXPOSURE_MANUAL) {
+        if (SetControl(V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL) < 0) {
+            exposureId = 0;
+            return -1;
+        }
+        exposureAuto = value;
+    }
+
+    if (GetControl(exposureId, &value) < 0) {
+        StopManualExposure();
+        return -1;
+    }
+    *minimum = qc.minimum;
+    *maximum = qc.maximum;
+    ALOGI("HAL exposure control on 0x%x, %d..%d, now %d",
+          exposureId, qc.minimum, qc.maximum, value);
+
+    return value;
+}
+
+int V4L2Camera::SetExposure (int value)
+{
+    if (exposureId == 0)
+        return -1;
+    return SetControl(exposureId, value);
+}
+
+void V4L2Camera::StopManualExposure ()
+{
+    if (exposureAuto >= 0)
+        SetControl(V4L2_CID_EXPOSURE_AUTO, exposureAuto);
+    exposureAuto = -1;
+    exposureId = 0;
+}
+
 void V4L2Camera::Close ()
 {
     close(fd);
@@ -201,6 +366,7 @@ int V4L2Camera::StopStreaming ()
 
 void * V4L2Camera::GrabPreviewFrame ()
 {
+    ATRACE_CALL();
     unsigned char *tmpBuffer;
     int ret;
 
@@ -214,20 +380,35 @@ void * V4L2Camera::GrabPreviewFrame ()
         return NULL;
     }
     nDequeued++;
+    ATRACE_INT("cameraFrameSeq", videoIn->buf.sequence);
+    ATRACE_ASYNC_BEGIN("cameraFrame", videoIn->buf.sequence);
     return  videoIn->mem[videoIn->buf.index];
 }
 
 void V4L2Camera::ReleasePreviewFrame ()
 {
+    ATRACE_CALL();
     int ret;
     ret = ioctl(fd, VIDIOC_QBUF, &videoIn->buf);
     nQueued++;
+    ATRACE_ASYNC_END("cameraFrame", videoIn->buf.sequence);
     if (ret < 0) {
         ALOGE("GrabPreviewFrame: VIDIOC_QBUF Failed");
         return;
     }
 }
 
+/* True when another filled buffer can be dequeued without waiting. */
+bool V4L2Camera::FrameReady ()
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
 
 sp<IMemory> V4L2Camera::GrabRawFrame ()
 {
@@ -298,53 +479,45 @@ int MemoryStream::readPipe()
     return 0;
 }
 
-camera_memory_t*  V4L2Camera::GrabJpegFrame (camera_request_memory   mRequestMemory)
+/*
+ * Encodes any YUYV image, optionally tagging it with a COM marker.  Only
+ * the arguments are touched, so it may run on several threads while the
+ * device keeps streaming.  Setting *cancel aborts the encode and returns
+ * NULL.
+ */
+camera_memory_t*  V4L2Camera::CompressJpeg (const void *frame, int width, int height, int quality,
+                                            const char *comment, camera_request_memory mRequestMemory,
+                                            const volatile bool *cancel)
 {
-    int ret;
-
-    videoIn->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    videoIn->buf.memory = V4L2_MEMORY_MMAP;
-
-    /* Dequeue buffer */
-    ret = ioctl(fd, VIDIOC_DQBUF, &videoIn->buf);
-    if (ret < 0) {
-        ALOGE("GrabJpegFrame: VIDIOC_DQBUF Failed");
-        return NULL;
-    }
-    nDequeued++;
-
-    ALOGI("GrabJpegFrame: Generated a frame from capture device");
+    ATRACE_CALL();
+    size_t bufSize = width * height * 2;
+    camera_memory_t* picture = NULL;
 
-    /* Enqueue buffer */
-    ret = ioctl(fd, VIDIOC_QBUF, &videoIn->buf);
-    if (ret < 0) {
-        ALOGE("GrabJpegFrame: VIDIOC_QBUF Failed");
-        return NULL;
-    }
-    nQueued++;
-
-    size_t bytesused = videoIn->buf.bytesused;
-    if (char *tmpBuf = new char[bytesused]) {
-        MemoryStream strm(tmpBuf, bytesused);
-        saveYUYVtoJPEG((unsigned char *)videoIn->mem[videoIn->buf.index], videoIn->width, videoIn->height, strm, 100);
+    if (char *tmpBuf = new char[bufSize]) {
+        MemoryStream strm(tmpBuf, bufSize);
+        saveYUYVtoJPEG((const unsigned char *)frame, width, height, strm, quality, comment, cancel);
         strm.closeStream();
         size_t fileSize = strm.getOffset();
-         camera_memory_t* picture = mRequestMemory(-1,fileSize,1,NULL);
-        memcpy(picture->data, tmpBuf, fileSize);
+        if (!(cancel && *cancel) && fileSize > 0) {
+            picture = mRequestMemory(-1,fileSize,1,NULL);
+            if (picture != NULL)
+                memcpy(picture->data, tmpBuf, fileSize);
+        }
         delete[] tmpBuf;
-
-        return picture;
     }
 
-    return NULL;
+    return picture;
 }
 
-int V4L2Camera::saveYUYVtoJPEG (unsigned char *inputBuffer, int width, int height, FILE *file, int quality)
+int V4L2Camera::saveYUYVtoJPEG (const unsigned char *inputBuffer, int width, int height, FILE *file, int quality,
+                                const char *comment, const volatile bool *cancel)
 {
+    ATRACE_CALL();
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     JSAMPROW row_pointer[1];
-    unsigned char *line_buffer, *yuyv;
+    unsigned char *line_buffer;
+    const unsigned char *yuyv;
     int z;
     int fileSize;
 
@@ -366,12 +539,22 @@ int V4L2Camera::saveYUYVtoJPEG (unsigned char *inputBuffer, int width, int heigh
     jpeg_set_quality (&cinfo, quality, TRUE);
 
     jpeg_start_compress (&cinfo, TRUE);
+    if (comment)
+        jpeg_write_marker (&cinfo, JPEG_COM, (const JOCTET *)comment, strlen(comment));
 
     z = 0;
     while (cinfo.next_scanline < cinfo.image_height) {
         int x;
         unsigned char *ptr = line_buffer;
 
+        if (cancel && *cancel && (cinfo.next_scanline & 15) == 0) {
+            ALOGI("saveYUYVtoJPEG: cancelled at line %u", cinfo.next_scanline);
+            jpeg_abort_compress (&cinfo);
+            jpeg_destroy_compress (&cinfo);
+            free (line_buffer);
+            return -1;
+        }
+
         for (x = 0; x < width; x++) {
             int r, g, b;
             int y, u, v;
@@ -11,13 +11,12 @@
 #ifndef _V4L2CAMERA_H
 #define _V4L2CAMERA_H
 
-#define NB_BUFFER 4
-
 #include <binder/MemoryBase.h>
 #include <binder/MemoryHeapBase.h>
 #include <linux/videodev.h>
 
 #include <hardware/camera.h>
+#include "CaptureBackend.h"
 namespace android {
 
 struct vdIn {
@@ -33,25 +32,51 @@ struct vdIn {
     int framesizeIn;
 };
 
-class V4L2Camera {
+class V4L2Camera : public CaptureBackend {
 
 public:
     V4L2Camera();
-    ~V4L2Camera();
-
-    int Open (const char *device, int width, int height, int pixelformat);
-    void Close ();
-
-    int Init ();
-    void Uninit ();
-
-    int StartStreaming ();
-    int StopStreaming ();
-
-    void * GrabPreviewFrame ();
-    void ReleasePreviewFrame ();
+    virtual ~V4L2Camera();
+
+    virtual int EnumFrameSizes (const char *device, int pixelformat,
+                                FrameSize *sizes, int max);
+
+    virtual int Open (const char *device, int width, int height, int pixelformat);
+    virtual int Width () const { return videoIn->width; }
+    virtual int Height () const { return videoIn->height; }
+    virtual void Close ();
+    virtual int SetFrameRate (int fps);
+
+    /*
+     * Manual exposure for a loop run by the HAL.  StartManualExposure()
+     * turns the device's own auto exposure off and returns the current
+     * exposure, or -1 if there is no usable control; StopManualExposure()
+     * puts auto exposure back the way it was.
+     */
+    virtual int StartManualExposure (int *minimum, int *maximum);
+    virtual int SetExposure (int value);
+    virtual void StopManualExposure ();
+
+    virtual int Init ();
+    virtual void Uninit ();
+
+    virtual int StartStreaming ();
+    virtual int StopStreaming ();
+
+    virtual void * GrabPreviewFrame ();
+    virtual void ReleasePreviewFrame ();
+    virtual bool FrameReady ();
+    virtual uint32_t FrameSequence () const { return videoIn->buf.sequence; }
+    virtual nsecs_t FrameTimestamp () const {
+        return videoIn->buf.timestamp.tv_sec * 1000000000LL +
+               videoIn->buf.timestamp.tv_usec * 1000LL;
+    }
+    virtual int BuffersQueued () const { return nQueued - nDequeued; }
+    virtual void GetFormat (struct v4l2_pix_format *pix) const { *pix = videoIn->format.fmt.pix; }
     sp<IMemory> GrabRawFrame ();
-    camera_memory_t*   GrabJpegFrame (camera_request_memory   mRequestMemory);
+    static camera_memory_t* CompressJpeg (const void *frame, int width, int height, int quality,
+                                          const char *comment, camera_request_memory mRequestMemory,
+                                          const volatile bool *cancel);
 
 private:
     struct vdIn *videoIn;
@@ -60,9 +85,15 @@ private:
     int nQueued;
     int nDequeued;
 
-    int saveYUYVtoJPEG (unsigned char *inputBuffer, int width, int height, FILE *file, int quality);
+    int exposureId;     /* control driven by SetExposure(), 0 if none */
+    int exposureAuto;   /* V4L2_CID_EXPOSURE_AUTO to restore, -1 if none */
+
+    int GetControl (int id, int *value);
+    int SetControl (int id, int value);
+
+    static int saveYUYVtoJPEG (const unsigned char *inputBuffer, int width, int height, FILE *file, int quality,
+                               const char *comment, const volatile bool *cancel);
 
-    void convert(unsigned char *buf, unsigned char *rgb, int width, int height);
     void yuv_to_rgb16(unsigned char y, unsigned char u, unsigned char v, unsigned char *rgb);
 };
 
@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "yuvmotion.h"
+
+void yuyv_motion_free(struct yuyv_motion *m)
+{
+    free(m->mem);
+    memset(m, 0, sizeof(*m));
+}
+
+int yuyv_motion_configure(struct yuyv_motion *m, int src_width, int src_height,
+                          int cols, int rows)
+{
+    int width = src_width >> YUYV_MOTION_SHIFT;
+    int height = src_height >> YUYV_MOTION_SHIFT;
+    uint8_t *p;
+    int c, x;
+
+    if (m->mem != NULL &&
+        m->src_width == src_width && m->src_height == src_height &&
+        m->cols == cols && m->rows == rows)
+        return 0;
+
+    yuyv_motion_free(m);
+
+    /* the per column sums of one block row have to fit in 16 bits */
+    if (cols < 1 || rows < 1 ||
+        cols > YUYV_MOTION_MAX_GRID || rows > YUYV_MOTION_MAX_GRID ||
+        width < cols || height < rows ||
+        (height + rows - 1) / rows > 65535 / 255)
+        return -1;
+
+    m->mem = malloc(width * (2 * sizeof(uint16_t) + 1) + width * height * 2);
+    if (m->mem == NULL)
+        return -1;
+
+    p = m->mem;
+    m->colsad = (uint16_t *) p;     p += width * sizeof(uint16_t);
+    m->colluma = (uint16_t *) p;    p += width * sizeof(uint16_t);
+    m->cur = p;                     p += width * height;
+    m->prev = p;                    p += width * height;
+    m->block = p;
+
+    m->src_width = src_width;
+    m->src_height = src_height;
+    m->width = width;
+    m->height = height;
+    m->cols = cols;
+    m->rows = rows;
+    m->valid = 0;
+
+    /* same boundaries as the block loops in yuyv_motion_update() */
+    for (c = 0; c < cols; c++)
+        for (x = c * width / cols; x < (c + 1) * width / cols; x++)
+            m->block[x] = c;
+
+    return 0;
+}
+
+#ifdef __ARM_NEON__
+/* four plane pixels from 32 luma samples of each of the four rows */
+static inline uint16x4_t decimate4(const uint8_t *const rows[4], int ofs)
+{
+    uint16x8_t a = vdupq_n_u16(0);
+    uint16x8_t b = vdupq_n_u16(0);
+    uint32x4_t sa, sb;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        a = vpadalq_u8(a, vld2q_u8(rows[i] + ofs).val[0]);
+        b = vpadalq_u8(b, vld2q_u8(rows[i] + ofs + 32).val[0]);
+    }
+    sa = vpaddlq_u16(a);
+    sb = vpaddlq_u16(b);
+
+    return vrshrn_n_u32(vcombine_u32(vpadd_u32(vget_low_u32(sa), vget_high_u32(sa)),
+                                     vpadd_u32(vget_low_u32(sb), vget_high_u32(sb))), 5);
+}
+#endif
+
+/* Rows 0, 2, 4 and 6 of an 8 row band, 8 luma samples per output pixel. */
+static void decimate_row(const uint8_t *src, size_t stride, uint8_t *dst, int width)
+{
+    const uint8_t *const rows[4] = {
+        src, src + 2 * stride, src + 4 * stride, src + 6 * stride
+    };
+    int x = 0;
+
+#ifdef __ARM_NEON__
+    for (; x + 8 <= width; x += 8)
+        vst1_u8(dst + x, vmovn_u16(vcombine_u16(decimate4(rows, 16 * x),
+                                                decimate4(rows, 16 * x + 64))));
+#endif
+    for (; x < width; x++) {
+        int sum = 0;
+        int i, j;
+
+        for (i = 0; i < 4; i++)
+            for (j = 0; j < 16; j += 2)
+                sum += rows[i][16 * x + j];
+        dst[x] = (sum + 16) >> 5;
+    }
+}
+
+static void sad_row(const uint8_t *a, const uint8_t *b, uint16_t *sum, int width)
+{
+    int x = 0;
+
+#ifdef __ARM_NEON__
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t va = vld1q_u8(a + x);
+        uint8x16_t vb = vld1q_u8(b + x);
+
+        vst1q_u16(sum + x, vabal_u8(vld1q_u16(sum + x),
+                                    vget_low_u8(va), vget_low_u8(vb)));
+        vst1q_u16(sum + x + 8, vabal_u8(vld1q_u16(sum + x + 8),
+                                        vget_high_u8(va), vget_high_u8(vb)));
+    }
+#endif
+    for (; x < width; x++)
+        sum[x] += a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+}
+
+static void sum_row(const uint8_t *a, uint16_t *sum, int width)
+{
+    int x = 0;
+
+#ifdef __ARM_NEON__
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t va = vld1q_u8(a + x);
+
+        vst1q_u16(sum + x, vaddw_u8(vld1q_u16(sum + x), vget_low_u8(va)));
+        vst1q_u16(sum + x + 8, vaddw_u8(vld1q_u16(sum + x + 8), vget_high_u8(va)));
+    }
+#endif
+    for (; x < width; x++)
+        sum[x] += a[x];
+}
+
+/* A scatter per sample, so this one stays scalar; the rows are in L1. */
+static void histogram_rows(const uint8_t *src, size_t stride, int width,
+                           uint32_t *hist)
+{
+    int i, x;
+
+    for (i = 0; i < 8; i += 2) {
+        const uint8_t *p = src + i * stride;
+
+        for (x = 0; x < width << YUYV_MOTION_SHIFT; x++)
+            hist[p[2 * x] >> 2]++;
+    }
+}
+
+static void region_means(const struct yuyv_motion *m, int r, int y0, int y1,
+                         struct yuyv_luma_stats *stats, uint64_t *total)
+{
+    uint32_t sum[YUYV_MOTION_MAX_GRID];
+    int x0 = 0;
+    int c, x;
+
+    memset(sum, 0, m->cols * sizeof(sum[0]));
+    for (x = 0; x < m->width; x++)
+        sum[m->block[x]] += m->colluma[x];
+
+    for (c = 0; c < m->cols; c++) {
+        int x1 = (c + 1) * m->width / m->cols;
+        int n = (x1 - x0) * (y1 - y0);
+
+        *total += sum[c];
+        stats->region[r * m->cols + c] = (sum[c] + n / 2) / n;
+        x0 = x1;
+    }
+}
+
+int yuyv_motion_update(struct yuyv_motion *m, const uint8_t *src, int threshold,
+                       uint32_t *bitmap, uint32_t *score,
+                       struct yuyv_luma_stats *stats)
+{
+    size_t stride = m->src_width * 2;
+    uint32_t sad[YUYV_MOTION_MAX_GRID];
+    uint64_t total = 0;
+    uint64_t luma = 0;
+    int valid = m->valid && bitmap != NULL;
+    int changed = 0;
+    int y0 = 0;
+    int r, c, x, y;
+    uint8_t *t;
+
+    if (stats != NULL) {
+        memset(stats->hist, 0, sizeof(stats->hist));
+        stats->samples = (m->width * m->height) << (2 * YUYV_MOTION_SHIFT - 1);
+    }
+
+    for (r = 0; r < m->rows; r++) {
+        int y1 = (r + 1) * m->height / m->rows;
+        int x0 = 0;
+
+        memset(m->colsad, 0, m->width * sizeof(uint16_t));
+        memset(m->colluma, 0, m->width * sizeof(uint16_t));
+        for (y = y0; y < y1; y++) {
+            const uint8_t *band = src + (y << YUYV_MOTION_SHIFT) * stride;
+            uint8_t *cur = m->cur + y * m->width;
+
+            decimate_row(band, stride, cur, m->width);
+            if (valid)
+                sad_row(cur, m->prev + y * m->width, m->colsad, m->width);
+            if (stats != NULL) {
+                sum_row(cur, m->colluma, m->width);
+                histogram_rows(band, stride, m->width, stats->hist);
+            }
+        }
+
+        if (stats != NULL)
+            region_means(m, r, y0, y1, stats, &luma);
+
+        if (valid) {
+            memset(sad, 0, m->cols * sizeof(sad[0]));
+            for (x = 0; x < m->width; x++)
+                sad[m->block[x]] += m->colsad[x];
+
+            bitmap[r] = 0;
+            for (c = 0; c < m->cols; c++) {
+                int x1 = (c + 1) * m->width / m->cols;
+
+                total += sad[c];
+                if (sad[c] > (uint32_t) (threshold * (x1 - x0) * (y1 - y0))) {
+                    bitmap[r] |= 1u << c;
+                    changed++;
+                }
+                x0 = x1;
+            }
+        }
+        y0 = y1;
+    }
+
+    t = m->prev;
+    m->prev = m->cur;
+    m->cur = t;
+    m->valid = 1;
+
+    if (stats != NULL)
+        stats->mean = (int) ((luma + m->width * m->height / 2) /
+                             (m->width * m->height));
+
+    if (!valid)
+        return -1;
+
+    *score = (uint32_t) ((total << 8) / (m->width * m->height));
+    return changed;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef YUVMOTION_H
+#define YUVMOTION_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define YUYV_MOTION_SHIFT       3       /* luma is decimated 8x8 */
+#define YUYV_MOTION_MAX_GRID    32      /* one bitmap word per block row */
+
+#define YUYV_LUMA_BINS          64
+
+/*
+ * Block-wise motion detection and luma statistics on packed YUYV frames.
+ * Each frame is reduced to a small luma plane (the mean of every other
+ * row of each 8x8 tile, so only a quarter of the frame is read) and
+ * compared with the previous one; the absolute differences are summed per
+ * block of a cols x rows grid.  The histogram is taken from the same rows
+ * while they are still in L1.  Only the small planes are kept between
+ * frames.
+ */
+struct yuyv_motion {
+    int         src_width;
+    int         src_height;
+    int         width;          /* decimated plane */
+    int         height;
+    int         cols;           /* block grid */
+    int         rows;
+    int         valid;          /* prev holds a frame of this geometry */
+
+    uint8_t     *cur;
+    uint8_t     *prev;
+    uint16_t    *colsad;        /* per column sums within one block row */
+    uint16_t    *colluma;
+    uint8_t     *block;         /* block column of each plane column */
+    void        *mem;
+};
+
+struct yuyv_luma_stats {
+    uint32_t    hist[YUYV_LUMA_BINS];   /* luma >> 2 of the sampled rows */
+    uint32_t    samples;
+    int         mean;
+    /* mean luma per block, row major */
+    uint8_t     region[YUYV_MOTION_MAX_GRID * YUYV_MOTION_MAX_GRID];
+};
+
+/*
+ * (Re)build for a new geometry; returns 0 when nothing changed or on
+ * success and -1 on bad geometry or allocation failure.  A new geometry
+ * drops the reference frame.  A zeroed struct is a valid empty detector.
+ */
+int yuyv_motion_configure(struct yuyv_motion *m, int src_width, int src_height,
+                          int cols, int rows);
+void yuyv_motion_free(struct yuyv_motion *m);
+
+/* Forget the reference frame, e.g. after the stream was restarted. */
+static inline void yuyv_motion_reset(struct yuyv_motion *m)
+{
+    m->valid = 0;
+}
+
+/*
+ * Compare src with the previous frame and make it the new reference.
+ * A block has changed when its mean absolute luma difference exceeds
+ * threshold; bit x of bitmap[y] is set for block (x, y).  *score is the
+ * mean absolute difference over the whole plane in 8.8 fixed point.
+ * Returns the number of changed blocks, or -1 if there was nothing to
+ * compare with yet or bitmap is NULL.  stats, if given, is filled in from
+ * the same pass.
+ */
+int yuyv_motion_update(struct yuyv_motion *m, const uint8_t *src, int threshold,
+                       uint32_t *bitmap, uint32_t *score,
+                       struct yuyv_luma_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YUVMOTION_H */
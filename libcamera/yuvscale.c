@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "yuvscale.h"
+
+/* weights are 0..256, 256 meaning "all of the second sample" */
+static inline uint8_t lerp8(uint8_t a, uint8_t b, int w)
+{
+    return (a * (256 - w) + b * w + 128) >> 8;
+}
+
+static inline uint8_t clamp8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/*
+ * Map n output samples onto src_len input samples, centre to centre.
+ * The left sample is clamped so that its right neighbour always exists.
+ */
+static void axis_table(int src_len, int n, int unit, int base,
+                       int32_t *ofs, uint16_t *weight)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        int64_t pos = ((int64_t) (2 * i + 1) * src_len * 32768) / n - 32768;
+        int index, w;
+
+        if (pos < 0)
+            pos = 0;
+        index = pos >> 16;
+        w = (pos & 0xffff) >> 8;
+        if (index >= src_len - 1) {
+            index = src_len - 2;
+            w = 256;
+        }
+        ofs[i] = base + index * unit;
+        weight[i] = w;
+    }
+}
+
+void yuyv_scaler_free(struct yuyv_scaler *s)
+{
+    free(s->mem);
+    memset(s, 0, sizeof(*s));
+}
+
+int yuyv_scaler_configure(struct yuyv_scaler *s, int src_width, int src_height,
+                          int crop_x, int crop_y, int crop_w, int crop_h,
+                          int dst_width, int dst_height)
+{
+    size_t vlen, hlen, size;
+    uint8_t *p;
+
+    if (s->mem != NULL &&
+        s->src_width == src_width && s->src_height == src_height &&
+        s->crop_x == crop_x && s->crop_y == crop_y &&
+        s->crop_w == crop_w && s->crop_h == crop_h &&
+        s->dst_width == dst_width && s->dst_height == dst_height)
+        return 0;
+
+    yuyv_scaler_free(s);
+
+    if ((src_width & 1) || (crop_x & 1) || (crop_w & 1) ||
+        (dst_width & 1) || (dst_height & 1) ||
+        crop_w < 4 || crop_h < 2 || dst_width < 2 || dst_height < 2 ||
+        crop_x < 0 || crop_y < 0 ||
+        crop_x + crop_w > src_width || crop_y + crop_h > src_height)
+        return -1;
+
+    vlen = crop_w * 2 + 16;
+    hlen = dst_width * 2 + 16;
+    size = (dst_height + dst_width + dst_width / 2) * (sizeof(int32_t) + sizeof(uint16_t)) +
+           2 * vlen + 2 * hlen;
+    s->mem = malloc(size);
+    if (s->mem == NULL)
+        return -1;
+
+    p = s->mem;
+    s->row = (int32_t *) p;         p += dst_height * sizeof(int32_t);
+    s->luma = (int32_t *) p;        p += dst_width * sizeof(int32_t);
+    s->chroma = (int32_t *) p;      p += dst_width / 2 * sizeof(int32_t);
+    s->row_w = (uint16_t *) p;      p += dst_height * sizeof(uint16_t);
+    s->luma_w = (uint16_t *) p;     p += dst_width * sizeof(uint16_t);
+    s->chroma_w = (uint16_t *) p;   p += dst_width / 2 * sizeof(uint16_t);
+    s->vrow[0] = p;                 p += vlen;
+    s->vrow[1] = p;                 p += vlen;
+    s->hrow[0] = p;                 p += hlen;
+    s->hrow[1] = p;
+
+    s->src_width = src_width;
+    s->src_height = src_height;
+    s->crop_x = crop_x;
+    s->crop_y = crop_y;
+    s->crop_w = crop_w;
+    s->crop_h = crop_h;
+    s->dst_width = dst_width;
+    s->dst_height = dst_height;
+
+    axis_table(crop_h, dst_height, 1, crop_y, s->row, s->row_w);
+    axis_table(crop_w, dst_width, 2, 0, s->luma, s->luma_w);
+    axis_table(crop_w / 2, dst_width / 2, 4, 0, s->chroma, s->chroma_w);
+
+    return 0;
+}
+
+int yuyv_scaler_zoom(struct yuyv_scaler *s, int src_width, int src_height,
+                     int ratio, int dst_width, int dst_height)
+{
+    int crop_w, crop_h;
+
+    if (ratio < 100 || dst_width <= 0 || dst_height <= 0)
+        return -1;
+
+    /* no stretching when the capture and consumer aspect ratios differ */
+    crop_w = src_width;
+    crop_h = (int) ((int64_t) src_width * dst_height / dst_width);
+    if (crop_h > src_height) {
+        crop_h = src_height;
+        crop_w = (int) ((int64_t) src_height * dst_width / dst_height);
+    }
+
+    crop_w = (crop_w * 100 / ratio) & ~1;
+    crop_h = crop_h * 100 / ratio;
+    if (crop_w < 4)
+        crop_w = 4;
+    if (crop_h < 2)
+        crop_h = 2;
+
+    return yuyv_scaler_configure(s, src_width, src_height,
+                                 ((src_width - crop_w) / 2) & ~1,
+                                 (src_height - crop_h) / 2,
+                                 crop_w, crop_h, dst_width, dst_height);
+}
+
+static void blend_rows(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+                       int n, int w)
+{
+    int i = 0;
+
+#ifdef __ARM_NEON__
+    uint8x8_t wa = vdup_n_u8(256 - w);
+    uint8x8_t wb = vdup_n_u8(w);
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t va = vld1q_u8(a + i);
+        uint8x16_t vb = vld1q_u8(b + i);
+        uint16x8_t lo = vmull_u8(vget_low_u8(va), wa);
+        uint16x8_t hi = vmull_u8(vget_high_u8(va), wa);
+
+        lo = vmlal_u8(lo, vget_low_u8(vb), wb);
+        hi = vmlal_u8(hi, vget_high_u8(vb), wb);
+        vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = lerp8(a[i], b[i], w);
+}
+
+/* A gather per sample, so this one stays scalar. */
+static void scale_row(const struct yuyv_scaler *s, const uint8_t *in, uint8_t *out)
+{
+    int j;
+
+    for (j = 0; j < s->dst_width / 2; j++) {
+        const uint8_t *l0 = in + s->luma[2 * j];
+        const uint8_t *l1 = in + s->luma[2 * j + 1];
+        const uint8_t *c = in + s->chroma[j];
+        int cw = s->chroma_w[j];
+
+        out[4 * j + 0] = lerp8(l0[0], l0[2], s->luma_w[2 * j]);
+        out[4 * j + 1] = lerp8(c[1], c[5], cw);
+        out[4 * j + 2] = lerp8(l1[0], l1[2], s->luma_w[2 * j + 1]);
+        out[4 * j + 3] = lerp8(c[3], c[7], cw);
+    }
+}
+
+/*
+ * Produce output row y as packed YUYV and return it.  Where no blending
+ * or sampling is needed this is a pointer into the source frame; if out
+ * is given, any row that has to be computed is written there.
+ */
+static const uint8_t *scaled_row(struct yuyv_scaler *s, const uint8_t *src,
+                                 int y, int slot, uint8_t *out)
+{
+    size_t stride = s->src_width * 2;
+    const uint8_t *a = src + s->row[y] * stride + s->crop_x * 2;
+    int w = s->row_w[y];
+    int hscale = s->crop_w != s->dst_width;
+    const uint8_t *line;
+
+    if (w == 0) {
+        line = a;
+    } else if (w == 256) {
+        line = a + stride;
+    } else {
+        uint8_t *blend = (!hscale && out != NULL) ? out : s->vrow[slot];
+
+        blend_rows(a, a + stride, blend, s->crop_w * 2, w);
+        line = blend;
+    }
+
+    if (!hscale)
+        return line;
+
+    if (out == NULL)
+        out = s->hrow[slot];
+    scale_row(s, line, out);
+    return out;
+}
+
+/*
+ * BT.601 video range, coefficients scaled by 64 so that the NEON path
+ * stays in 16 bit lanes; both paths give identical results.
+ */
+#define CY      74
+#define CRV     102
+#define CGU     25
+#define CGV     52
+#define CBU     129
+
+static inline uint16_t pixel565(int luma, int rc, int gc, int bc)
+{
+    int c = (luma - 16) * CY;
+    int r = clamp8((c + rc + 32) >> 6);
+    int g = clamp8((c + gc + 32) >> 6);
+    int b = clamp8((c + bc + 32) >> 6);
+
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+#ifdef __ARM_NEON__
+static inline uint16x8_t pack565(int16x8_t c, int16x8_t rc, int16x8_t gc, int16x8_t bc)
+{
+    uint8x8_t r = vqrshrun_n_s16(vqaddq_s16(c, rc), 6);
+    uint8x8_t g = vqrshrun_n_s16(vqaddq_s16(c, gc), 6);
+    uint8x8_t b = vqrshrun_n_s16(vqaddq_s16(c, bc), 6);
+    uint16x8_t p = vshll_n_u8(r, 8);
+
+    p = vsriq_n_u16(p, vshll_n_u8(g, 8), 5);
+    return vsriq_n_u16(p, vshll_n_u8(b, 8), 11);
+}
+#endif
+
+void yuyv_row_to_rgb565(const uint8_t *src, uint16_t *dst, int width)
+{
+    int x = 0;
+
+#ifdef __ARM_NEON__
+    const uint8x8_t k16 = vdup_n_u8(16);
+    const uint8x8_t k128 = vdup_n_u8(128);
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x8x4_t px = vld4_u8(src + 2 * x);     /* Y0 U Y1 V */
+        int16x8_t u = vreinterpretq_s16_u16(vsubl_u8(px.val[1], k128));
+        int16x8_t v = vreinterpretq_s16_u16(vsubl_u8(px.val[3], k128));
+        int16x8_t rc = vmulq_n_s16(v, CRV);
+        int16x8_t gc = vmlaq_n_s16(vmulq_n_s16(u, -CGU), v, -CGV);
+        int16x8_t bc = vmulq_n_s16(u, CBU);
+        int16x8_t c0 = vmulq_n_s16(vreinterpretq_s16_u16(vsubl_u8(px.val[0], k16)), CY);
+        int16x8_t c1 = vmulq_n_s16(vreinterpretq_s16_u16(vsubl_u8(px.val[2], k16)), CY);
+        uint16x8x2_t out;
+
+        out.val[0] = pack565(c0, rc, gc, bc);
+        out.val[1] = pack565(c1, rc, gc, bc);
+        vst2q_u16(dst + x, out);
+    }
+#endif
+    for (; x < width; x += 2) {
+        const uint8_t *p = src + 2 * x;
+        int u = p[1] - 128;
+        int v = p[3] - 128;
+        int rc = CRV * v;
+        int gc = -CGU * u - CGV * v;
+        int bc = CBU * u;
+
+        dst[x] = pixel565(p[0], rc, gc, bc);
+        dst[x + 1] = pixel565(p[2], rc, gc, bc);
+    }
+}
+
+void yuyv_rows_to_nv21(const uint8_t *src0, const uint8_t *src1,
+                       uint8_t *y0, uint8_t *y1, uint8_t *vu, int width)
+{
+    int x = 0;
+
+#ifdef __ARM_NEON__
+    for (; x + 16 <= width; x += 16) {
+        uint8x8x4_t a = vld4_u8(src0 + 2 * x);
+        uint8x8x4_t b = vld4_u8(src1 + 2 * x);
+        uint8x8x2_t la, lb, c;
+
+        la.val[0] = a.val[0];
+        la.val[1] = a.val[2];
+        lb.val[0] = b.val[0];
+        lb.val[1] = b.val[2];
+        c.val[0] = vhadd_u8(a.val[3], b.val[3]);
+        c.val[1] = vhadd_u8(a.val[1], b.val[1]);
+        vst2_u8(y0 + x, la);
+        vst2_u8(y1 + x, lb);
+        vst2_u8(vu + x, c);
+    }
+#endif
+    for (; x < width; x += 2) {
+        const uint8_t *a = src0 + 2 * x;
+        const uint8_t *b = src1 + 2 * x;
+
+        y0[x] = a[0];
+        y0[x + 1] = a[2];
+        y1[x] = b[0];
+        y1[x + 1] = b[2];
+        vu[x] = (a[3] + b[3]) >> 1;
+        vu[x + 1] = (a[1] + b[1]) >> 1;
+    }
+}
+
+void yuyv_scale_to_rgb565(struct yuyv_scaler *s, const uint8_t *src,
+                          uint16_t *dst, int dst_stride)
+{
+    int y;
+
+    for (y = 0; y < s->dst_height; y++)
+        yuyv_row_to_rgb565(scaled_row(s, src, y, 0, NULL),
+                           dst + y * dst_stride, s->dst_width);
+}
+
+void yuyv_scale_to_nv21(struct yuyv_scaler *s, const uint8_t *src, uint8_t *dst)
+{
+    int w = s->dst_width;
+    uint8_t *luma = dst;
+    uint8_t *vu = dst + w * s->dst_height;
+    int y;
+
+    for (y = 0; y < s->dst_height; y += 2)
+        yuyv_rows_to_nv21(scaled_row(s, src, y, 0, NULL),
+                          scaled_row(s, src, y + 1, 1, NULL),
+                          luma + y * w, luma + (y + 1) * w,
+                          vu + (y / 2) * w, w);
+}
+
+void yuyv_scale_to_yuyv(struct yuyv_scaler *s, const uint8_t *src, uint8_t *dst)
+{
+    size_t len = s->dst_width * 2;
+    int y;
+
+    for (y = 0; y < s->dst_height; y++) {
+        uint8_t *out = dst + y * len;
+        const uint8_t *line = scaled_row(s, src, y, 0, out);
+
+        if (line != out)
+            memcpy(out, line, len);
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef YUVSCALE_H
+#define YUVSCALE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Crop and scale of packed YUYV frames, fused with the conversion to the
+ * consumer's format.  Every output row is produced from (at most) two
+ * source rows in one go: vertical blend, horizontal bilinear sampling and
+ * colour conversion all run on a row that is still in L1, so a scaled or
+ * zoomed frame costs the same single pass over memory as a plain convert.
+ *
+ * A scaler keeps per-row and per-column tables and its scratch rows, so
+ * each thread (or consumer) needs its own.
+ */
+struct yuyv_scaler {
+    int         src_width;      /* full frame */
+    int         src_height;
+    int         crop_x;         /* even, within the frame */
+    int         crop_y;
+    int         crop_w;         /* even */
+    int         crop_h;
+    int         dst_width;      /* even */
+    int         dst_height;     /* even */
+
+    /* per output row: first source row (in the frame) and weight of the next */
+    int32_t     *row;
+    uint16_t    *row_w;
+    /* per output pixel: byte offset of the left luma sample in the crop */
+    int32_t     *luma;
+    uint16_t    *luma_w;
+    /* per output pixel pair: byte offset of the left macropixel in the crop */
+    int32_t     *chroma;
+    uint16_t    *chroma_w;
+
+    uint8_t     *vrow[2];       /* vertically blended source rows */
+    uint8_t     *hrow[2];       /* scaled rows */
+    void        *mem;
+};
+
+/*
+ * (Re)build the tables for a new geometry.  Returns 0 when nothing changed
+ * or on success, -1 on bad geometry or allocation failure (the scaler is
+ * then left empty).  A zeroed struct is a valid empty scaler.
+ */
+int yuyv_scaler_configure(struct yuyv_scaler *s, int src_width, int src_height,
+                          int crop_x, int crop_y, int crop_w, int crop_h,
+                          int dst_width, int dst_height);
+void yuyv_scaler_free(struct yuyv_scaler *s);
+
+/*
+ * Crop the largest centred region with the aspect ratio of the destination,
+ * shrink it by 100/ratio for digital zoom (ratio in percent, as in
+ * KEY_ZOOM_RATIOS) and scale it to the destination size.
+ */
+int yuyv_scaler_zoom(struct yuyv_scaler *s, int src_width, int src_height,
+                     int ratio, int dst_width, int dst_height);
+
+/* Nothing to crop or scale: the output is a straight conversion. */
+static inline int yuyv_scaler_identity(const struct yuyv_scaler *s)
+{
+    return s->crop_w == s->src_width && s->crop_h == s->src_height &&
+           s->dst_width == s->src_width && s->dst_height == s->src_height;
+}
+
+/* dst_stride is in pixels, as returned by the native window */
+void yuyv_scale_to_rgb565(struct yuyv_scaler *s, const uint8_t *src,
+                          uint16_t *dst, int dst_stride);
+void yuyv_scale_to_nv21(struct yuyv_scaler *s, const uint8_t *src, uint8_t *dst);
+void yuyv_scale_to_yuyv(struct yuyv_scaler *s, const uint8_t *src, uint8_t *dst);
+
+/* Row kernels, exported for the other conversion paths. */
+void yuyv_row_to_rgb565(const uint8_t *src, uint16_t *dst, int width);
+void yuyv_rows_to_nv21(const uint8_t *src0, const uint8_t *src1,
+                       uint8_t *y0, uint8_t *y1, uint8_t *vu, int width);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YUVSCALE_H */
@@ -18,7 +18,17 @@ LOCAL_SRC_FILES := \
 	nmea_reader.h \
 	nmea_reader.c \
 	nmea_tokenizer.h \
-	nmea_tokenizer.c
+	nmea_tokenizer.c \
+	gps_protocol.h \
+	gps_stream.c \
+	ubx_protocol.c \
+	gps_replay.h \
+	gps_replay.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libodroid-trace
+
+LOCAL_STATIC_LIBRARIES := \
+	libodroid_trace
 
 LOCAL_SHARED_LIBRARIES := \
 	libutils \
@@ -33,4 +43,129 @@ LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 
 include $(BUILD_SHARED_LIBRARY)
 
+# the reader thread's parsing, shared by the tools below
+gps_parser_src_files := \
+	gps_stream.c \
+	ubx_protocol.c \
+	nmea_reader.c \
+	nmea_tokenizer.c
+
+# parser throughput, see nmea_bench.c
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := nmea_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	nmea_bench.c \
+	$(gps_parser_src_files)
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libodroid-trace
+
+LOCAL_STATIC_LIBRARIES := \
+	libodroid_trace
+
+LOCAL_SHARED_LIBRARIES := \
+	libcutils \
+	libc
+
+LOCAL_CFLAGS += -DANDROID -Wall -Wextra
+
+include $(BUILD_EXECUTABLE)
+
+# the same on the build host
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := nmea_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	nmea_bench.c \
+	$(gps_parser_src_files)
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libodroid-trace
+
+LOCAL_STATIC_LIBRARIES := \
+	libodroid_trace \
+	libcutils \
+	liblog
+
+LOCAL_LDLIBS += -lpthread -lm
+
+LOCAL_CFLAGS += -Wall -Wextra
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# libFuzzer target, seeded from fuzz_corpus/; see nmea_fuzz.c
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := nmea_fuzz
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	nmea_fuzz.c \
+	$(gps_parser_src_files)
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libodroid-trace
+
+LOCAL_STATIC_LIBRARIES := \
+	libodroid_trace \
+	libcutils \
+	liblog
+
+LOCAL_CLANG := true
+LOCAL_CFLAGS += -Wall -Wextra -g \
+	-fsanitize=fuzzer,address,undefined -fno-sanitize-recover=undefined
+LOCAL_LDFLAGS += -fsanitize=fuzzer,address,undefined
+LOCAL_LDLIBS += -lpthread -lm
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# replays a receiver log on a pty, see gps_replay_tool.c
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := gps_replay
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	gps_replay_tool.c \
+	gps_replay.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libodroid-trace
+
+LOCAL_STATIC_LIBRARIES := \
+	libodroid_trace \
+	libcutils \
+	liblog
+
+LOCAL_LDLIBS += -lpthread
+
+LOCAL_CFLAGS += -Wall -Wextra
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# parses a log with stub callbacks and measures latency, see gps_harness.c
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := gps_harness
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := \
+	gps_harness.c \
+	gps_replay.c \
+	$(gps_parser_src_files)
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libodroid-trace
+
+LOCAL_STATIC_LIBRARIES := \
+	libodroid_trace \
+	libcutils \
+	liblog
+
+LOCAL_LDLIBS += -lpthread -lm
+
+LOCAL_CFLAGS += -Wall -Wextra
+
+include $(BUILD_HOST_EXECUTABLE)
+
 endif
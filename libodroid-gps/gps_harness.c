@@ -0,0 +1,350 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parses a receiver log through the HAL's stream and reader with stub
+ * callbacks, for latency measurements and for checking the parser
+ * against field logs:
+ *
+ *   gps_harness [-u] [-o callbacks] [-n loops] file[@speed|@max]
+ *   gps_harness [-u] [-o callbacks] [-t seconds] -d tty
+ *
+ * A log is replayed on a pty like debug.odroid.gps.replay does, once by
+ * default; -d reads a tty instead, such as one served by gps_replay.  -u
+ * frames UBX beside NMEA.  Each epoch is delivered the way the callback
+ * thread does it, and every callback is written to the callbacks file,
+ * one line each led by the milliseconds since the start; with that
+ * column cut off the file is the same for every run of a log.
+ *
+ * At the end the harness prints the callback counts, the sentence
+ * throughput, and the latency up to each location callback both from
+ * the first data of its epoch being read and, for a replayed plain log,
+ * from the first line with its time being written to the pty.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "gps_protocol.h"
+#include "gps_replay.h"
+
+#define HARNESS_BLOCK   512     /* what the reader thread reads at once */
+#define WRITE_TIMES     64      /* epochs written and not yet delivered */
+#define DAY_MS          (24 * 3600 * 1000LL)
+
+typedef struct {
+    unsigned count;
+    unsigned size;
+    int64_t *ns;
+} Samples;
+
+static NmeaReader reader;
+static GpsStream stream;
+static FILE *out;
+static int64_t start_ns;
+
+static unsigned nmea_count, location_count, sv_status_count;
+static Samples write_latency, read_latency;
+
+/* when the replay wrote the first timed line of each recent epoch */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    int64_t tod_us;
+    int64_t ns;
+} write_times[WRITE_TIMES];
+static unsigned write_next;
+
+static void samples_add(Samples * s, int64_t ns)
+{
+    if (s->count == s->size) {
+        unsigned size = s->size ? s->size * 2 : 1024;
+        int64_t *p = realloc(s->ns, size * sizeof(*p));
+
+        if (p == NULL)
+            return;
+        s->ns = p;
+        s->size = size;
+    }
+    s->ns[s->count++] = ns;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void samples_print(const char *name, Samples * s)
+{
+    if (s->count == 0) {
+        printf("%-16s %8u\n", name, 0);
+        return;
+    }
+    qsort(s->ns, s->count, sizeof(*s->ns), compare_ns);
+    printf("%-16s %8u %10.3f %10.3f %10.3f\n", name, s->count,
+           s->ns[s->count / 2] / 1e6, s->ns[s->count * 99 / 100] / 1e6,
+           s->ns[s->count - 1] / 1e6);
+}
+
+static void replay_written(void *arg, int64_t tod_us)
+{
+    unsigned last;
+
+    (void) arg;
+    pthread_mutex_lock(&write_lock);
+    last = (write_next - 1) % WRITE_TIMES;
+    if (write_next == 0 || write_times[last].tod_us != tod_us) {
+        write_times[write_next % WRITE_TIMES].tod_us = tod_us;
+        write_times[write_next % WRITE_TIMES].ns = nmea_now_ns();
+        write_next++;
+    }
+    pthread_mutex_unlock(&write_lock);
+}
+
+/* -1 if the epoch at tod_us was not written by the replay */
+static int64_t written_at(int64_t tod_us)
+{
+    int64_t ns = -1;
+    unsigned i;
+
+    pthread_mutex_lock(&write_lock);
+    for (i = 0; i < WRITE_TIMES && i < write_next; i++) {
+        if (write_times[i].tod_us == tod_us)
+            ns = write_times[i].ns;
+    }
+    pthread_mutex_unlock(&write_lock);
+    return ns;
+}
+
+static double since_start_ms(int64_t now)
+{
+    return (now - start_ns) / 1e6;
+}
+
+static void harness_nmea(GpsUtcTime timestamp, const char *nmea, int length)
+{
+    (void) timestamp;           /* the time it was read, differs per run */
+    while (length > 0 &&
+           (nmea[length - 1] == '\n' || nmea[length - 1] == '\r'))
+        length--;
+    nmea_count++;
+    if (out != NULL)
+        fprintf(out, "%.3f nmea %.*s\n", since_start_ms(nmea_now_ns()),
+                length, nmea);
+}
+
+static void harness_sv_status(GpsSvStatus * sv)
+{
+    int i;
+
+    sv_status_count++;
+    if (out == NULL)
+        return;
+    fprintf(out, "%.3f sv_status %d", since_start_ms(nmea_now_ns()),
+            sv->num_svs);
+    for (i = 0; i < sv->num_svs && i < GPS_MAX_SVS; i++)
+        fprintf(out, " %d/%.0f/%.0f/%.0f", sv->sv_list[i].prn,
+                sv->sv_list[i].snr, sv->sv_list[i].elevation,
+                sv->sv_list[i].azimuth);
+    fprintf(out, " used %08x\n", sv->used_in_fix_mask);
+}
+
+static void harness_location(GpsLocation * fix)
+{
+    int64_t now = nmea_now_ns();
+
+    location_count++;
+    if (out != NULL)
+        fprintf(out, "%.3f location %lld %04x %.6f %.6f %.1f %.1f %.1f "
+                "%.1f\n", since_start_ms(now), (long long) fix->timestamp,
+                fix->flags, fix->latitude, fix->longitude, fix->altitude,
+                fix->speed, fix->bearing, fix->accuracy);
+}
+
+/* stands in for the callback thread, without the socket round trip */
+static void harness_pending(char cmd)
+{
+    NmeaRecord *rec;
+    int i;
+
+    (void) cmd;
+    while ((rec = nmea_reader_next_record(&reader)) != NULL) {
+        for (i = 0; i < rec->count; i++)
+            harness_nmea(rec->sentence[i].timestamp,
+                         rec->batch + rec->sentence[i].offset,
+                         rec->sentence[i].length);
+        if (rec->flags & NMEA_EPOCH_HAS_SV_STATUS)
+            harness_sv_status(&rec->sv_status);
+        if (rec->flags & NMEA_EPOCH_HAS_FIX) {
+            int64_t written = written_at(rec->fix.timestamp % DAY_MS * 1000);
+
+            harness_location(&rec->fix);
+            if (written >= 0)
+                samples_add(&write_latency, nmea_now_ns() - written);
+            if (rec->arrival_ns)
+                samples_add(&read_latency, nmea_now_ns() - rec->arrival_ns);
+        }
+        nmea_reader_release_record(&reader);
+    }
+}
+
+static GpsCallbacks harness_callbacks = {
+    .size = sizeof(GpsCallbacks),
+    .location_cb = harness_location,
+    .sv_status_cb = harness_sv_status,
+    .nmea_cb = harness_nmea,
+};
+
+static int open_tty(const char *path)
+{
+    struct termios ios;
+    int fd = open(path, O_RDONLY | O_NOCTTY);
+
+    if (fd < 0)
+        return -1;
+    if (tcgetattr(fd, &ios) == 0) {
+        cfmakeraw(&ios);
+        tcsetattr(fd, TCSANOW, &ios);
+    }
+    return fd;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-u] [-o callbacks] [-n loops] "
+            "file[@speed|@max]\n"
+            "       %s [-u] [-o callbacks] [-t seconds] -d tty\n",
+            name, name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = NULL, *out_path = NULL;
+    char buf[HARNESS_BLOCK];
+    int loops = 1, seconds = 0, ubx = 0, opt, fd;
+    int64_t end_ns;
+    double elapsed;
+
+    while ((opt = getopt(argc, argv, "uo:n:t:d:")) != -1) {
+        switch (opt) {
+        case 'u':
+            ubx = 1;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'n':
+            loops = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'd':
+            device = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (device != NULL ? optind != argc : optind != argc - 1 || loops <= 0)
+        usage(argv[0]);
+
+    if (out_path != NULL) {
+        out = fopen(out_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "cannot write %s: %s\n", out_path,
+                    strerror(errno));
+            return 1;
+        }
+    }
+
+    nmea_reader_init(&reader);
+    reader.set_pending_callback_cb = harness_pending;
+    nmea_reader_set_callbacks(&reader, &harness_callbacks);
+    gps_stream_init(&stream, &reader, ubx ? &ubx_protocol : NULL);
+
+    start_ns = nmea_now_ns();
+    end_ns = seconds > 0 ? start_ns + seconds * 1000000000LL : 0;
+    if (device != NULL)
+        fd = open_tty(device);
+    else
+        fd = gps_replay_open(argv[optind], loops, replay_written, NULL);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s\n", device ? device : argv[optind]);
+        return 1;
+    }
+
+    /* a replay ends with the pty hanging up */
+    for (;;) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int timeout = -1, ret;
+
+        /* an epoch is closed once the receiver goes quiet, as in the HAL */
+        if (nmea_reader_pending(&reader))
+            timeout = NMEA_EPOCH_IDLE_MS;
+        if (end_ns) {
+            int64_t left = (end_ns - nmea_now_ns()) / 1000000 + 1;
+
+            if (left <= 0)
+                break;
+            if (timeout < 0 || left < timeout)
+                timeout = left;
+        }
+        ret = poll(&pfd, 1, timeout);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            break;
+        if (ret == 0) {
+            nmea_reader_flush(&reader);
+            continue;
+        }
+        ret = read(fd, buf, sizeof(buf));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        gps_stream_feed(&stream, buf, ret);
+    }
+    nmea_reader_flush(&reader);
+    elapsed = (nmea_now_ns() - start_ns) / 1e9;
+    close(fd);
+    if (out != NULL)
+        fclose(out);
+
+    printf("sentences %u epochs %u in %.3f s, %.0f sentences/s\n",
+           reader.sentences, reader.epochs, elapsed,
+           elapsed > 0 ? reader.sentences / elapsed : 0.);
+    printf("callbacks nmea %u location %u sv_status %u\n", nmea_count,
+           location_count, sv_status_count);
+    printf("%-16s %8s %10s %10s %10s\n", "latency ms", "count", "p50",
+           "p99", "max");
+    samples_print("written-location", &write_latency);
+    samples_print("read-location", &read_latency);
+    fflush(stdout);
+    nmea_reader_dump_stats(&reader, STDOUT_FILENO);
+    gps_stream_dump_stats(&stream, STDOUT_FILENO);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GPS_PROTOCOL_H
+#define GPS_PROTOCOL_H
+
+#include "nmea_reader.h"
+
+/*
+ * A binary receiver protocol decoded beside NMEA.
+ *
+ * Receivers interleave binary frames with NMEA text on the same line.
+ * GpsStream splits the two: text goes to the NmeaReader as before, every
+ * frame that starts with the protocol's sync bytes is collected and
+ * handed to decode().  The decoder fills the reader's fix and SV status
+ * and drives its epochs, so delivery to the framework is unchanged.
+ */
+typedef struct {
+    const char *name;
+    unsigned char sync[2];
+    int header_len;             /* bytes needed before frame_len() works */
+    /* total frame length from the header, -1 if the header is invalid */
+    int (*frame_len) (const unsigned char *hdr);
+    /* returns 0 if the frame was valid, -1 if its checksum failed */
+    int (*decode) (NmeaReader * r, const unsigned char *frame, int len);
+    /* enable the messages decode() needs, one fix every interval_ms */
+    int (*configure) (int fd, int interval_ms);
+    /* switch the receiver's serial port to baud, NULL if unsupported */
+    int (*set_baud) (int fd, int baud);
+} GpsProtocol;
+
+extern const GpsProtocol ubx_protocol;
+
+/* largest frame collected, longer ones are skipped */
+#define GPS_FRAME_MAX   1024
+
+typedef struct {
+    NmeaReader *reader;
+    const GpsProtocol *proto;   /* NULL for plain NMEA */
+    unsigned char frame[GPS_FRAME_MAX];
+    int pos;                    /* bytes of frame collected, 0 in text */
+    int need;                   /* frame length once the header is in */
+    int skip;                   /* bytes of an oversized frame to drop */
+    unsigned frames;
+    unsigned bad_frames;
+} GpsStream;
+
+void gps_stream_init(GpsStream * s, NmeaReader * r, const GpsProtocol * proto);
+
+/* Feed a block read from the receiver. */
+void gps_stream_feed(GpsStream * s, const char *buf, int len);
+
+/* Write the frame counters as text to fd. */
+void gps_stream_dump_stats(GpsStream * s, int fd);
+
+#endif /* GPS_PROTOCOL_H */
@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* posix_openpt(), ptsname() and cfmakeraw() on glibc hosts */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "gps_replay.h"
+
+/*
+ * Recording: the magic, then for every block a little endian header of
+ * the microseconds since the previous block and the block length,
+ * followed by the bytes as read.
+ */
+#define RECORD_MAGIC        "ODGPSREC"
+#define RECORD_MAGIC_LEN    8
+#define RECORD_HEADER_LEN   8
+
+/* longest pause taken from a log, so a gap in it does not stall replay */
+#define MAX_PAUSE_US        (10 * 1000000LL)
+
+/* how long a reader may leave the end of the log unread before hangup */
+#define DRAIN_STALL_US      1000000
+#define DRAIN_SETTLE_US     20000
+
+struct replay {
+    const unsigned char *data;
+    size_t size;
+    int master;
+    double speed;               /* 0 for "max" */
+    int loops;                  /* 0 for ever */
+    gps_replay_hook hook;
+    void *arg;
+};
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static uint32_t get_u4(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void put_u4(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Wait until due (log time, scaled), then write; -1 once the HAL side is
+ * closed.
+ */
+static int replay_send(struct replay *rp, int64_t start, int64_t due,
+                       const unsigned char *p, int len)
+{
+    if (rp->speed > 0) {
+        int64_t wait = start + (int64_t) (due / rp->speed) - now_us();
+
+        if (wait > 0)
+            usleep(wait);
+    }
+
+    while (len > 0) {
+        int ret = write(rp->master, p, len);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int replay_recording(struct replay *rp)
+{
+    const unsigned char *p = rp->data + RECORD_MAGIC_LEN;
+    const unsigned char *end = rp->data + rp->size;
+    int64_t start = now_us(), due = 0;
+
+    while (end - p >= RECORD_HEADER_LEN) {
+        uint32_t delta = get_u4(p);
+        uint32_t len = get_u4(p + 4);
+
+        p += RECORD_HEADER_LEN;
+        if (len > (size_t) (end - p))
+            break;
+        due += delta < MAX_PAUSE_US ? delta : MAX_PAUSE_US;
+        if (replay_send(rp, start, due, p, len) < 0)
+            return -1;
+        p += len;
+    }
+    return 0;
+}
+
+/* time of day in us if line is a GGA, RMC or GLL with a time, else -1 */
+static int64_t line_time(const unsigned char *p, const unsigned char *end)
+{
+    int field, i, v[3];
+    int64_t frac = 0, unit = 1000000;
+
+    if (end - p < 7 || p[0] != '$')
+        return -1;
+    if (!memcmp(p + 3, "GGA,", 4) || !memcmp(p + 3, "RMC,", 4))
+        field = 1;
+    else if (!memcmp(p + 3, "GLL,", 4))
+        field = 5;
+    else
+        return -1;
+
+    for (; field > 0 && p < end; p++) {
+        if (*p == ',')
+            field--;
+    }
+    if (end - p < 6)
+        return -1;
+    for (i = 0; i < 3; i++) {
+        if ((unsigned) (p[2 * i] - '0') >= 10 ||
+            (unsigned) (p[2 * i + 1] - '0') >= 10)
+            return -1;
+        v[i] = (p[2 * i] - '0') * 10 + p[2 * i + 1] - '0';
+    }
+    /* receivers above 1 Hz tell their epochs apart by the fraction */
+    if (end - p > 6 && p[6] == '.') {
+        for (p += 7; p < end && unit > 1 && (unsigned) (*p - '0') < 10; p++) {
+            unit /= 10;
+            frac += (*p - '0') * unit;
+        }
+    }
+    return ((v[0] * 60 + v[1]) * 60 + v[2]) * 1000000LL + frac;
+}
+
+/* A plain log has no timing of its own: each line is sent when the time
+ * of day in the sentences says so, the lines between go out with it.
+ */
+static int replay_plain(struct replay *rp)
+{
+    const unsigned char *p = rp->data;
+    const unsigned char *end = rp->data + rp->size;
+    int64_t start = now_us(), due = 0, last = -1;
+
+    while (p < end) {
+        const unsigned char *nl = memchr(p, '\n', end - p);
+        const unsigned char *next = nl ? nl + 1 : end;
+        int64_t t = line_time(p, next);
+
+        if (t >= 0) {
+            if (last >= 0 && t != last) {
+                int64_t delta = t - last;
+
+                if (delta < 0)
+                    delta += 24 * 3600 * 1000000LL;
+                due += delta < MAX_PAUSE_US ? delta : MAX_PAUSE_US;
+            }
+            last = t;
+        }
+        if (replay_send(rp, start, due, p, next - p) < 0)
+            return -1;
+        if (t >= 0 && rp->hook != NULL)
+            rp->hook(rp->arg, t);
+        p = next;
+    }
+    return 0;
+}
+
+/* A hangup discards what the reader has not read yet, so after the last
+ * loop wait for the slave to run empty, as long as the reader keeps
+ * reading.  Written bytes reach the slave's queue a moment later, so it
+ * has to stay empty for a while.
+ */
+static void replay_drain(struct replay *rp)
+{
+    int fd = open(ptsname(rp->master), O_RDONLY | O_NOCTTY);
+    int64_t since = now_us();
+    int last = 0, queued;
+
+    if (fd < 0)
+        return;
+    while (ioctl(fd, FIONREAD, &queued) == 0) {
+        if (queued != last) {
+            last = queued;
+            since = now_us();
+        } else if (now_us() - since >
+                   (queued ? DRAIN_STALL_US : DRAIN_SETTLE_US)) {
+            break;
+        }
+        usleep(1000);
+    }
+    close(fd);
+}
+
+static void *replay_thread(void *arg)
+{
+    struct replay *rp = arg;
+    int recording = rp->size >= RECORD_MAGIC_LEN &&
+        !memcmp(rp->data, RECORD_MAGIC, RECORD_MAGIC_LEN);
+    int loops = 0;
+
+    while (rp->loops == 0 || loops < rp->loops) {
+        int ret = recording ? replay_recording(rp) : replay_plain(rp);
+
+        if (ret < 0)
+            break;
+        OTRACE("gps_replay_loop", ++loops, 0, 0);
+    }
+
+    ALOGD("replay stopped after %d loops", loops);
+    if (loops == rp->loops)
+        replay_drain(rp);
+    close(rp->master);
+    munmap((void *) rp->data, rp->size);
+    free(rp);
+    return NULL;
+}
+
+/* the slave must pass the bytes on untouched, like a receiver's tty */
+static int replay_raw(int fd)
+{
+    struct termios ios;
+
+    if (tcgetattr(fd, &ios) < 0)
+        return -1;
+    cfmakeraw(&ios);
+    return tcsetattr(fd, TCSANOW, &ios);
+}
+
+int gps_replay_open(const char *spec, int loops, gps_replay_hook hook,
+                    void *arg)
+{
+    char path[PATH_MAX];
+    const char *at = strrchr(spec, '@');
+    struct replay *rp;
+    struct stat st;
+    pthread_t thread;
+    pthread_attr_t attr;
+    void *data;
+    int fd, slave;
+
+    snprintf(path, sizeof(path), "%.*s",
+             (int) (at ? at - spec : (int) strlen(spec)), spec);
+
+    rp = calloc(1, sizeof(*rp));
+    if (rp == NULL)
+        return -1;
+    rp->speed = 1.0;
+    if (at != NULL)
+        rp->speed = strcmp(at + 1, "max") ? atof(at + 1) : 0.;
+    if (rp->speed < 0)
+        rp->speed = 1.0;
+    rp->loops = loops;
+    rp->hook = hook;
+    rp->arg = arg;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        ALOGE("cannot replay %s: %s", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        free(rp);
+        return -1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        ALOGE("cannot map %s: %s", path, strerror(errno));
+        free(rp);
+        return -1;
+    }
+    rp->data = data;
+    rp->size = st.st_size;
+
+    /* the HAL reads the slave like any receiver tty */
+    rp->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (rp->master < 0 || grantpt(rp->master) < 0 ||
+        unlockpt(rp->master) < 0 ||
+        (slave = open(ptsname(rp->master), O_RDWR | O_NOCTTY)) < 0) {
+        ALOGE("no pseudo terminal for replay: %s", strerror(errno));
+        if (rp->master >= 0)
+            close(rp->master);
+        munmap(data, st.st_size);
+        free(rp);
+        return -1;
+    }
+    if (replay_raw(slave) < 0) {
+        ALOGE("cannot set replay tty raw: %s", strerror(errno));
+        close(slave);
+        close(rp->master);
+        munmap(data, st.st_size);
+        free(rp);
+        return -1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, replay_thread, rp) != 0) {
+        ALOGE("could not create replay thread: %s", strerror(errno));
+        close(slave);
+        close(rp->master);
+        munmap(data, st.st_size);
+        free(rp);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    ALOGD("replaying %s at %s", path, at ? at + 1 : "1");
+    return slave;
+}
+
+int gps_record_open(GpsRecord * rec, const char *path)
+{
+    rec->last_us = 0;
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (rec->fd < 0) {
+        ALOGE("cannot record to %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (write(rec->fd, RECORD_MAGIC, RECORD_MAGIC_LEN) != RECORD_MAGIC_LEN) {
+        ALOGE("cannot record to %s: %s", path, strerror(errno));
+        gps_record_close(rec);
+        return -1;
+    }
+    return 0;
+}
+
+void gps_record_write(GpsRecord * rec, const char *buf, int len)
+{
+    unsigned char header[RECORD_HEADER_LEN];
+    int64_t now = now_us();
+
+    put_u4(header, rec->last_us ? now - rec->last_us : 0);
+    put_u4(header + 4, len);
+    rec->last_us = now;
+    if (write(rec->fd, header, sizeof(header)) != sizeof(header) ||
+        write(rec->fd, buf, len) != len)
+        ALOGE("recording write failed: %s", strerror(errno));
+}
+
+void gps_record_close(GpsRecord * rec)
+{
+    if (rec->fd >= 0)
+        close(rec->fd);
+    rec->fd = -1;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GPS_REPLAY_H
+#define GPS_REPLAY_H
+
+/*
+ * Receiver record and replay for running the HAL without a receiver.
+ *
+ * "setprop debug.odroid.gps.record <file>" saves every block read from
+ * the receiver together with its arrival time.  "setprop
+ * debug.odroid.gps.replay <file>[@speed]" then plays such a recording,
+ * or a plain NMEA log, into a pseudo terminal that the HAL reads instead
+ * of the receiver, so the whole path from the tty on is exercised.
+ * speed is a multiple of real time, "max" sends as fast as the HAL
+ * reads.  Recordings keep their timing and may hold binary protocols;
+ * plain logs are paced by the time of day in GGA, RMC and GLL.  The HAL
+ * starts the log over when it ends.
+ *
+ * The same replay drives the host tools built beside the HAL: gps_replay
+ * serves a log on a pty for any reader, gps_harness parses it with stub
+ * callbacks and reports the latency from each line being written to its
+ * location callback.
+ */
+
+#include <stdint.h>
+
+/* Called from the replay thread once a line of a plain log carrying a
+ * time of day (us since midnight) has been written.
+ */
+typedef void (*gps_replay_hook) (void *arg, int64_t tod_us);
+
+/* Start replaying spec "file[@speed|@max]" loops times, 0 for ever;
+ * returns the raw mode tty to read the receiver from, -1 on error.  The
+ * tty hangs up when the last loop has been written.  hook may be NULL.
+ */
+int gps_replay_open(const char *spec, int loops, gps_replay_hook hook,
+                    void *arg);
+
+typedef struct {
+    int fd;                     /* -1 when not recording */
+    int64_t last_us;            /* previous block, 0 before the first */
+} GpsRecord;
+
+/* Create a recording; returns 0, or -1 with rec->fd set to -1. */
+int gps_record_open(GpsRecord * rec, const char *path);
+
+/* Append a block read from the receiver. */
+void gps_record_write(GpsRecord * rec, const char *buf, int len);
+
+void gps_record_close(GpsRecord * rec);
+
+#endif /* GPS_REPLAY_H */
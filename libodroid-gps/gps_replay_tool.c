@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Serves a receiver log on a pseudo terminal, as the HAL's replay does,
+ * for any program that reads a receiver tty:
+ *
+ *   gps_replay [-n loops] [-l link] file[@speed|@max]
+ *
+ * The pty's name is printed and, with -l, linked to from link.  The tool
+ * exits once the last loop has been written; by default the log plays
+ * once.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gps_replay.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n loops] [-l link] file[@speed|@max]\n",
+            name);
+    exit(2);
+}
+
+static void on_signal(int sig)
+{
+    (void) sig;
+}
+
+int main(int argc, char **argv)
+{
+    const char *link_path = NULL;
+    struct pollfd pfd;
+    struct sigaction sa;
+    char *name;
+    int loops = 1, opt, fd;
+
+    while ((opt = getopt(argc, argv, "n:l:")) != -1) {
+        switch (opt) {
+        case 'n':
+            loops = atoi(optarg);
+            break;
+        case 'l':
+            link_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || loops < 0)
+        usage(argv[0]);
+
+    fd = gps_replay_open(argv[optind], loops, NULL, NULL);
+    if (fd < 0) {
+        fprintf(stderr, "cannot replay %s\n", argv[optind]);
+        return 1;
+    }
+    name = ttyname(fd);
+    if (name == NULL) {
+        fprintf(stderr, "no name for the replay tty: %s\n", strerror(errno));
+        return 1;
+    }
+    if (link_path != NULL) {
+        unlink(link_path);
+        if (symlink(name, link_path) < 0) {
+            fprintf(stderr, "cannot link %s: %s\n", link_path,
+                    strerror(errno));
+            return 1;
+        }
+    }
+    printf("%s\n", name);
+    fflush(stdout);
+
+    /* interrupted, the link still gets removed */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* holding the slave open keeps the pty up between readers; it hangs
+     * up when the replay closes the master
+     */
+    pfd.fd = fd;
+    pfd.events = 0;
+    for (;;) {
+        int ret = poll(&pfd, 1, -1);
+
+        if (ret < 0 ? errno != EAGAIN : ret > 0)
+            break;
+    }
+
+    if (link_path != NULL)
+        unlink(link_path);
+    close(fd);
+    return 0;
+}
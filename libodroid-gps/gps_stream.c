@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "gps_protocol.h"
+
+void gps_stream_init(GpsStream * s, NmeaReader * r, const GpsProtocol * proto)
+{
+    memset(s, 0, sizeof(*s));
+    s->reader = r;
+    s->proto = proto;
+}
+
+/* Collect frame bytes from p; returns how many were consumed. */
+static int gps_stream_frame(GpsStream * s, const unsigned char *p, int len)
+{
+    const GpsProtocol *proto = s->proto;
+    int used = 0;
+
+    if (s->skip > 0) {
+        used = len < s->skip ? len : s->skip;
+        s->skip -= used;
+        return used;
+    }
+
+    /* the header first, to learn the frame length */
+    while (s->pos < proto->header_len && used < len) {
+        s->frame[s->pos++] = p[used++];
+        if (s->pos == 2 && s->frame[1] != proto->sync[1]) {
+            /* not a frame after all: drop the first sync byte and look
+             * at the second one again as text
+             */
+            s->pos = 0;
+            return used - 1;
+        }
+    }
+    if (s->pos < proto->header_len)
+        return used;
+
+    if (s->need == 0) {
+        s->need = proto->frame_len(s->frame);
+        if (s->need < 0 || s->need > GPS_FRAME_MAX) {
+            OTRACE("gps_frame_skip", s->need, 0, 0);
+            s->bad_frames++;
+            s->skip = s->need > 0 ? s->need - s->pos : 0;
+            s->pos = 0;
+            s->need = 0;
+            return used;
+        }
+    }
+
+    if (s->need - s->pos > len - used) {
+        memcpy(s->frame + s->pos, p + used, len - used);
+        s->pos += len - used;
+        return len;
+    }
+
+    memcpy(s->frame + s->pos, p + used, s->need - s->pos);
+    used += s->need - s->pos;
+    if (proto->decode(s->reader, s->frame, s->need) < 0) {
+        s->bad_frames++;
+    } else {
+        s->frames++;
+        nmea_reader_arrival(s->reader);
+    }
+    s->pos = 0;
+    s->need = 0;
+    return used;
+}
+
+/* A binary sync byte is never part of NMEA text, which is 7 bit ASCII,
+ * so the text runs in between are found with memchr and passed on
+ * whole.
+ */
+void gps_stream_feed(GpsStream * s, const char *buf, int len)
+{
+    const unsigned char *p = (const unsigned char *) buf;
+    const unsigned char *end = p + len;
+
+    if (s->proto == NULL) {
+        nmea_reader_addbuf(s->reader, buf, len);
+        return;
+    }
+
+    while (p < end) {
+        const unsigned char *sync;
+
+        if (s->pos > 0 || s->skip > 0) {
+            p += gps_stream_frame(s, p, end - p);
+            continue;
+        }
+
+        sync = memchr(p, s->proto->sync[0], end - p);
+        if (sync == NULL) {
+            nmea_reader_addbuf(s->reader, (const char *) p, end - p);
+            return;
+        }
+        if (sync > p)
+            nmea_reader_addbuf(s->reader, (const char *) p, sync - p);
+        p = sync + gps_stream_frame(s, sync, end - sync);
+    }
+}
+
+void gps_stream_dump_stats(GpsStream * s, int fd)
+{
+    char line[96];
+    int n;
+
+    if (s->proto == NULL)
+        return;
+    n = snprintf(line, sizeof(line), "%s frames %u bad %u\n",
+                 s->proto->name, s->frames, s->bad_frames);
+    write(fd, line, n);
+}
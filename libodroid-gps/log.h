@@ -21,8 +21,13 @@
 #define  LOG_TAG  "libmbm-gps"
 #include <cutils/log.h>
 
-#define ENTER ALOGV("%s: enter", __FUNCTION__)
-#define EXIT ALOGV("%s: exit", __FUNCTION__)
+#include "odroid_trace.h"
+
+/* the trace ring only gets the explicit OTRACE points, see odroid_trace.h;
+ * function entries would push an epoch's events out within a few sentences
+ */
+#define ENTER ((void)0)
+#define EXIT ((void)0)
 
 
 #endif				/* end _LIBMBMGPS_LOG_H_ */
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parser throughput benchmark.  Feeds generated NMEA and UBX through
+ * gps_stream_feed() in read()-sized blocks, framed as the HAL does with
+ * the UBX protocol enabled, with stub callbacks taking the published
+ * epochs off the ring the way the callback thread does, and prints
+ * messages per second and nanoseconds per message for each mix:
+ *
+ *   nmea_bench [seconds of receiver output per mix, default 86400]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gps_protocol.h"
+
+#define BENCH_BLOCK     512     /* what the reader thread reads at once */
+
+static NmeaReader reader;
+static GpsStream stream;
+static unsigned delivered;
+
+static void bench_location(GpsLocation * fix)
+{
+    delivered += fix->flags != 0;
+}
+
+static void bench_sv_status(GpsSvStatus * sv_status)
+{
+    delivered += sv_status->num_svs != 0;
+}
+
+static void bench_nmea(GpsUtcTime timestamp, const char *nmea, int length)
+{
+    (void) timestamp;
+    (void) nmea;
+    delivered += length > 0;
+}
+
+/* stands in for the callback thread, without the socket round trip */
+static void bench_pending(char cmd)
+{
+    NmeaRecord *rec;
+    int i;
+
+    (void) cmd;
+    while ((rec = nmea_reader_next_record(&reader)) != NULL) {
+        for (i = 0; i < rec->count; i++)
+            bench_nmea(rec->sentence[i].timestamp,
+                       rec->batch + rec->sentence[i].offset,
+                       rec->sentence[i].length);
+        if (rec->flags & NMEA_EPOCH_HAS_SV_STATUS)
+            bench_sv_status(&rec->sv_status);
+        if (rec->flags & NMEA_EPOCH_HAS_FIX)
+            bench_location(&rec->fix);
+        nmea_reader_release_record(&reader);
+    }
+}
+
+static GpsCallbacks bench_callbacks = {
+    .size = sizeof(GpsCallbacks),
+    .location_cb = bench_location,
+    .sv_status_cb = bench_sv_status,
+    .nmea_cb = bench_nmea,
+};
+
+/* append "$body*CS\r\n" */
+static int put_sentence(char *out, const char *body)
+{
+    unsigned sum = 0;
+    const char *p;
+
+    for (p = body; *p; p++)
+        sum ^= (unsigned char) *p;
+    return sprintf(out, "$%s*%02X\r\n", body, sum);
+}
+
+static void put_u2(unsigned char *p, unsigned v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_u4(unsigned char *p, uint32_t v)
+{
+    put_u2(p, v);
+    put_u2(p + 2, v >> 16);
+}
+
+/* append a UBX frame around payload */
+static int put_ubx(char *out, int cls, int id, const unsigned char *payload,
+                   int len)
+{
+    unsigned char *p = (unsigned char *) out;
+    unsigned a = 0, b = 0;
+    int i;
+
+    p[0] = 0xb5;
+    p[1] = 0x62;
+    p[2] = cls;
+    p[3] = id;
+    put_u2(p + 4, len);
+    memcpy(p + 6, payload, len);
+    for (i = 2; i < len + 6; i++) {
+        a += p[i];
+        b += a;
+    }
+    p[len + 6] = a;
+    p[len + 7] = b;
+    return len + 8;
+}
+
+enum {
+    MIX_GGA = 1 << 0,
+    MIX_RMC = 1 << 1,
+    MIX_GSA = 1 << 2,
+    MIX_GSV = 1 << 3,
+    MIX_PVT = 1 << 4,
+    MIX_SAT = 1 << 5,
+};
+
+static const struct {
+    const char *name;
+    int types;
+} mixes[] = {
+    { "gga", MIX_GGA },
+    { "rmc", MIX_RMC },
+    { "gsa", MIX_GSA },
+    { "gsv", MIX_GSV },
+    { "epoch", MIX_GGA | MIX_RMC | MIX_GSA | MIX_GSV },
+    { "pvt", MIX_PVT },
+    { "sat", MIX_SAT },
+    { "ubx", MIX_PVT | MIX_SAT },
+};
+
+/* one second of receiver output per epoch, as a u-blox 6 sends its NMEA
+ * and a u-blox 8 its UBX
+ */
+static int put_epoch(char *out, int second, int types, int *messages)
+{
+    char body[128];
+    unsigned char payload[8 + 12 * 12];
+    int hh = second / 3600 % 24, mm = second / 60 % 60, ss = second % 60;
+    int n = 0, i;
+
+    if (types & MIX_RMC) {
+        sprintf(body, "GPRMC,%02d%02d%02d.00,A,5740.841023,N,01159.626002,E,"
+                "000.4,244.0,031109,,,A", hh, mm, ss);
+        n += put_sentence(out + n, body);
+        ++*messages;
+    }
+    if (types & MIX_GGA) {
+        sprintf(body, "GPGGA,%02d%02d%02d.00,5740.857675,N,01159.649523,E,"
+                "1,08,3.0,104.0,M,46.9,M,,", hh, mm, ss);
+        n += put_sentence(out + n, body);
+        ++*messages;
+    }
+    if (types & MIX_GSA) {
+        n += put_sentence(out + n,
+                          "GPGSA,A,3,02,04,07,13,20,23,,,,,,,6.7,3.0,6.0");
+        ++*messages;
+    }
+    if (types & MIX_GSV) {
+        for (i = 1; i <= 3; i++) {
+            sprintf(body, "GPGSV,3,%d,12,%02d,40,083,46,%02d,17,308,41,"
+                    "%02d,07,344,39,%02d,22,228,45", i, i * 4 - 3, i * 4 - 2,
+                    i * 4 - 1, i * 4);
+            n += put_sentence(out + n, body);
+            ++*messages;
+        }
+    }
+    if (types & MIX_PVT) {
+        memset(payload, 0, 92);
+        put_u4(payload, (second + 86400) * 1000u);
+        put_u2(payload + 4, 2009);
+        payload[6] = 11;
+        payload[7] = 3;
+        payload[8] = hh;
+        payload[9] = mm;
+        payload[10] = ss;
+        payload[11] = 0x03;     /* date and time valid */
+        payload[20] = 3;        /* 3D */
+        payload[21] = 0x01;     /* fix OK */
+        put_u4(payload + 24, 119937667);
+        put_u4(payload + 28, 576806837);
+        put_u4(payload + 36, 104000);
+        put_u4(payload + 40, 3000);
+        put_u4(payload + 60, 400);
+        put_u4(payload + 64, 24400000);
+        n += put_ubx(out + n, 0x01, 0x07, payload, 92);
+        ++*messages;
+    }
+    if (types & MIX_SAT) {
+        memset(payload, 0, sizeof(payload));
+        put_u4(payload, (second + 86400) * 1000u);
+        payload[4] = 1;
+        payload[5] = 12;
+        for (i = 0; i < 12; i++) {
+            unsigned char *sv = payload + 8 + i * 12;
+
+            sv[0] = i < 8 ? 0 : 6;      /* GPS, then GLONASS */
+            sv[1] = i < 8 ? i * 4 + 1 : i;
+            sv[2] = 40 + i;
+            sv[3] = 10 + i * 5;
+            put_u2(sv + 4, i * 30);
+            put_u4(sv + 8, i < 6 ? 0x08 : 0);   /* used in the fix */
+        }
+        n += put_ubx(out + n, 0x01, 0x35, payload, sizeof(payload));
+        ++*messages;
+    }
+    return n;
+}
+
+static double bench_mix(int types, int seconds, int *messages)
+{
+    char *buf = malloc((size_t) seconds * 512);
+    struct timespec t0, t1;
+    int len = 0, i;
+
+    *messages = 0;
+    if (buf == NULL)
+        return 0.;
+
+    for (i = 0; i < seconds; i++)
+        len += put_epoch(buf + len, i, types, messages);
+
+    nmea_reader_init(&reader);
+    reader.set_pending_callback_cb = bench_pending;
+    nmea_reader_set_callbacks(&reader, &bench_callbacks);
+    gps_stream_init(&stream, &reader, &ubx_protocol);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < len; i += BENCH_BLOCK)
+        gps_stream_feed(&stream, buf + i,
+                        len - i < BENCH_BLOCK ? len - i : BENCH_BLOCK);
+    nmea_reader_flush(&reader);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    free(buf);
+    return (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = argc > 1 ? atoi(argv[1]) : 86400;
+    unsigned i;
+
+    if (seconds <= 0) {
+        fprintf(stderr, "usage: %s [seconds]\n", argv[0]);
+        return 2;
+    }
+
+    printf("%-6s %10s %14s %14s\n", "mix", "messages", "messages/s",
+           "ns/message");
+    for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+        int messages;
+        double ns = bench_mix(mixes[i].types, seconds, &messages);
+
+        if (messages == 0 || ns <= 0.)
+            return 1;
+
+        printf("%-6s %10d %14.0f %14.1f\n", mixes[i].name, messages,
+               messages * 1e9 / ns, ns / messages);
+    }
+    printf("callbacks %u\n", delivered);
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * libFuzzer target for everything the reader thread does with bytes from
+ * the receiver: UBX framing in gps_stream, the UBX decoder, NMEA framing
+ * and checksums, the tokenizer and the sentence parsers, and publishing
+ * epochs to stub callbacks.  An input is receiver output as read from
+ * the tty; it is fed once in blocks as large as the reader thread reads
+ * and once a byte per read, so sentences and frames split across reads
+ * are covered too.  Seeds are in
+ * fuzz_corpus/:
+ *
+ *   nmea_fuzz -max_len=4096 fuzz_corpus
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gps_protocol.h"
+
+#define FUZZ_BLOCK      512     /* what the reader thread reads at once */
+
+static NmeaReader reader;
+static GpsStream stream;
+
+static void fuzz_location(GpsLocation * fix)
+{
+    (void) fix;
+}
+
+static void fuzz_sv_status(GpsSvStatus * sv_status)
+{
+    (void) sv_status;
+}
+
+static void fuzz_nmea(GpsUtcTime timestamp, const char *nmea, int length)
+{
+    (void) timestamp;
+    (void) nmea;
+    (void) length;
+}
+
+/* what the callback thread does with a record, reading all of it */
+static void fuzz_pending(char cmd)
+{
+    NmeaRecord *rec;
+    int i;
+
+    (void) cmd;
+    while ((rec = nmea_reader_next_record(&reader)) != NULL) {
+        for (i = 0; i < rec->count; i++)
+            fuzz_nmea(rec->sentence[i].timestamp,
+                      rec->batch + rec->sentence[i].offset,
+                      rec->sentence[i].length);
+        if (rec->flags & NMEA_EPOCH_HAS_SV_STATUS)
+            fuzz_sv_status(&rec->sv_status);
+        if (rec->flags & NMEA_EPOCH_HAS_FIX)
+            fuzz_location(&rec->fix);
+        nmea_reader_release_record(&reader);
+    }
+}
+
+static GpsCallbacks fuzz_callbacks = {
+    .size = sizeof(GpsCallbacks),
+    .location_cb = fuzz_location,
+    .sv_status_cb = fuzz_sv_status,
+    .nmea_cb = fuzz_nmea,
+};
+
+static void fuzz_feed(const uint8_t * data, size_t size, size_t block)
+{
+    size_t i;
+
+    nmea_reader_init(&reader);
+    reader.set_pending_callback_cb = fuzz_pending;
+    nmea_reader_set_callbacks(&reader, &fuzz_callbacks);
+    gps_stream_init(&stream, &reader, &ubx_protocol);
+
+    for (i = 0; i < size; i += block)
+        gps_stream_feed(&stream, (const char *) data + i,
+                        size - i < block ? size - i : block);
+    nmea_reader_flush(&reader);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+    if (size == 0)
+        return 0;
+    fuzz_feed(data, size, FUZZ_BLOCK);
+    fuzz_feed(data, size, 1);
+    return 0;
+}
@@ -23,6 +23,8 @@
  */
 
 #include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <pthread.h>
 #include <termios.h>
 #include <fcntl.h>
@@ -30,6 +32,7 @@
 #include <math.h>
 #include <time.h>
 #include <time64.h>
+#include <sys/time.h>
 #include <semaphore.h>
 #include <signal.h>
 #include <unistd.h>
@@ -55,54 +58,121 @@
 /*****************************************************************/
 /*****************************************************************/
 
+/* The numeric parsers run for every field of every sentence, so they
+ * are not traced.
+ */
+#define NMEA_MAX_INT 1000000000
+
 static int str2int(const char *p, const char *end)
 {
     int result = 0;
-    int len = end - p;
-    ENTER;
-
-    /* if (len == 0) { */
-    /*      return -1; */
-    /* } */
 
-    for (; len > 0; len--, p++) {
-        int c;
-
-        if (p >= end)
-            goto Fail;
+    if (p >= end)
+        return 0;
 
-        c = *p - '0';
-        if ((unsigned) c >= 10)
-            goto Fail;
+    for (; p < end; p++) {
+        int c = *p - '0';
 
+        /* no integer field is this long, only a corrupt one overflows */
+        if ((unsigned) c >= 10 || result >= NMEA_MAX_INT / 10)
+            return -1;
         result = result * 10 + c;
     }
-    EXIT;
     return result;
+}
 
-  Fail:
-    EXIT;
-    return -1;
+#define NMEA_MAX_DIGITS 18
+
+static const int64_t pow10i[NMEA_MAX_DIGITS + 1] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL, 10000000000LL, 100000000000LL,
+    1000000000000LL, 10000000000000LL, 100000000000000LL,
+    1000000000000000LL, 10000000000000000LL, 100000000000000000LL,
+    1000000000000000000LL
+};
+
+/* Decode a decimal field as the receiver sends it: optional sign, digits,
+ * optional '.' and fraction; no exponent, no blanks.  Decoding stops at
+ * the first other character, like strtod().  The value is mant / 10^frac,
+ * or mant * 10^-frac when frac is negative because the integer part
+ * alone has more than NMEA_MAX_DIGITS significant digits.  Works on the
+ * token in place and does not depend on the locale.
+ */
+static int nmea_decimal(const char *p, const char *end, int64_t * mant)
+{
+    int64_t m = 0;
+    int digits = 0, frac = 0, neg = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+    for (; p < end && (unsigned) (*p - '0') < 10; p++) {
+        if (digits < NMEA_MAX_DIGITS) {
+            m = m * 10 + (*p - '0');
+            digits += m != 0;
+        } else if (frac > -NMEA_MAX_DIGITS) {
+            frac--;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && (unsigned) (*p - '0') < 10; p++) {
+            if (digits >= NMEA_MAX_DIGITS || frac >= NMEA_MAX_DIGITS)
+                break;
+            m = m * 10 + (*p - '0');
+            digits += m != 0;
+            frac++;
+        }
+    }
+    *mant = neg ? -m : m;
+    return frac;
 }
 
+/* Up to 15 significant digits this is the correctly rounded value, the
+ * same strtod() gives, since both mantissa and power of ten are exact.
+ */
 static double str2float(const char *p, const char *end)
 {
-    /* int result = 0; */
-    int len = end - p;
-    char temp[16];
+    int64_t mant;
+    int frac = nmea_decimal(p, end, &mant);
+
+    if (frac > 0)
+        return (double) mant / (double) pow10i[frac];
+    if (frac < 0)
+        return (double) mant * (double) pow10i[-frac];
+    return (double) mant;
+}
 
-    ENTER;
-    /* if (len == 0) { */
-    /*      return -1.0; */
-    /* } */
+/* milliseconds since midnight from "hhmmss[.sss]", -1 if malformed */
+static int nmea_time_of_day(Token tok)
+{
+    int hms, ms = 0, scale = 100;
+    const char *p;
 
-    if (len >= (int) sizeof(temp))
-        return 0.;
+    if (tok.p + 6 > tok.end)
+        return -1;
+    hms = str2int(tok.p, tok.p + 6);
+    if (hms < 0)
+        return -1;
+    p = tok.p + 6;
+    if (p < tok.end && *p == '.') {
+        for (p++; p < tok.end && scale > 0; p++, scale /= 10) {
+            if ((unsigned) (*p - '0') >= 10)
+                return -1;
+            ms += (*p - '0') * scale;
+        }
+    }
+    /* 60 seconds for a leap second */
+    if (hms / 10000 > 23 || hms / 100 % 100 > 59 || hms % 100 > 60)
+        return -1;
+    return ((hms / 10000 * 60 + hms / 100 % 100) * 60 + hms % 100) * 1000
+        + ms;
+}
 
-    memcpy(temp, p, len);
-    temp[len] = 0;
-    EXIT;
-    return strtod(temp, NULL);
+/* first character of a field, '\0' for an empty or missing one */
+static char nmea_token_char(Token tok)
+{
+    return tok.p < tok.end ? tok.p[0] : '\0';
 }
 
 static void nmea_reader_update_utc_diff(NmeaReader * r)
@@ -110,7 +180,7 @@ static void nmea_reader_update_utc_diff(NmeaReader * r)
     time_t now = time(NULL);
     struct tm tm_local;
     struct tm tm_utc;
-    long time_local, time_utc;
+    int64_t time_local, time_utc;
 
     ENTER;
     gmtime_r(&now, &tm_utc);
@@ -119,12 +189,12 @@ static void nmea_reader_update_utc_diff(NmeaReader * r)
     time_local = tm_local.tm_sec +
         60 * (tm_local.tm_min +
               60 * (tm_local.tm_hour +
-                    24 * (tm_local.tm_yday + 365 * tm_local.tm_year)));
+                    24LL * (tm_local.tm_yday + 365 * tm_local.tm_year)));
 
     time_utc = tm_utc.tm_sec +
         60 * (tm_utc.tm_min +
               60 * (tm_utc.tm_hour +
-                    24 * (tm_utc.tm_yday + 365 * tm_utc.tm_year)));
+                    24LL * (tm_utc.tm_yday + 365 * tm_utc.tm_year)));
 
     r->utc_diff = time_utc - time_local;
     EXIT;
@@ -145,59 +215,163 @@ void nmea_reader_init(NmeaReader * r)
     r->sv_status_callback = NULL;
     r->nmea_callback = NULL;
     r->update = 0;
+    r->epoch_time = -1;
+    r->used_mask_epoch = -1;
 
     nmea_reader_update_utc_diff(r);
     EXIT;
 }
 
+NmeaRecord *nmea_reader_next_record(NmeaReader * r)
+{
+    uint32_t tail = r->record_tail;
+
+    if (tail == r->record_head)
+        return NULL;
+    __sync_synchronize();
+    return &r->records[tail & (NMEA_RECORDS - 1)];
+}
+
+void nmea_reader_release_record(NmeaReader * r)
+{
+    /* the callback is done with the slot before the reader may reuse it */
+    __sync_synchronize();
+    r->record_tail++;
+}
+
+int64_t nmea_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void nmea_reader_arrival(NmeaReader * r)
+{
+    if (r->epoch.arrival_ns == 0)
+        r->epoch.arrival_ns = nmea_now_ns();
+}
+
+int nmea_reader_pending(NmeaReader * r)
+{
+    return r->epoch.count != 0 || (r->update && r->fix.flags != 0) ||
+        r->sv_status_changed;
+}
+
+/* Merge the fix and SV status into the open epoch and hand it to the
+ * callback thread as one record, woken by a single command byte.  If the
+ * callback thread is a whole ring behind, the epoch is dropped rather
+ * than blocking the reader.
+ */
+int nmea_reader_flush(NmeaReader * r)
+{
+    NmeaRecord *e = &r->epoch;
+
+    if (r->fix.flags != 0 && r->update) {
+        if (r->callback) {
+            e->fix = r->fix;
+            e->flags |= NMEA_EPOCH_HAS_FIX;
+            r->fix.flags = 0;
+            r->update = 0;
+        } else {
+            ALOGE("no callback, keeping data until needed !");
+        }
+    }
+
+    if (r->sv_status_changed != 0 && r->sv_status_callback) {
+        OTRACE("nmea_sv_status_cb", r->sv_status.num_svs, 0, 0);
+        e->sv_status = r->sv_status;
+        e->flags |= NMEA_EPOCH_HAS_SV_STATUS;
+        r->sv_status_changed = 0;
+    }
+
+    if (e->flags == 0 && e->count == 0)
+        return 0;
+
+    OTRACE("nmea_epoch", r->epoch_time, e->flags, e->count);
+    e->publish_ns = nmea_now_ns();
+    if (r->record_head - r->record_tail >= NMEA_RECORDS) {
+        r->records_dropped++;
+        OTRACE("nmea_record_drop", r->records_dropped, 0, 0);
+    } else {
+        r->records[r->record_head & (NMEA_RECORDS - 1)] = *e;
+        __sync_synchronize();
+        r->record_head++;
+        r->epochs++;
+        r->set_pending_callback_cb(CMD_EPOCH_CB);
+    }
+
+    e->flags = 0;
+    e->count = 0;
+    e->used = 0;
+    e->arrival_ns = 0;
+    return 1;
+}
+
 void nmea_reader_set_callbacks(NmeaReader * r, GpsCallbacks * cbs)
 {
     ENTER;
     if (cbs == NULL)
         return;
 
+    /* whatever is known already goes out with the next epoch */
     r->callback = cbs->location_cb;
     if (cbs->location_cb != NULL && r->fix.flags != 0) {
         ALOGD("%s: sending latest fix to new callback", __FUNCTION__);
-        //r->callback(&r->fix);
-        r->set_pending_callback_cb(CMD_LOCATION_CB);
-        r->fix.flags = 0;
+        r->update = 1;
     }
 
     r->sv_status_callback = cbs->sv_status_cb;
     if (cbs->sv_status_cb != NULL) {
         ALOGD("%s: sending latest sv_status to new callback", __FUNCTION__);
-        //r->sv_status_callback(&r->sv_status);
-        r->set_pending_callback_cb(CMD_SV_STATUS_CB);
-        r->sv_status_changed = 0;
+        r->sv_status_changed = 1;
     }
 
-    /*old data */
+    /* sentences are only kept in flight, the next one goes to the new
+     * callback
+     */
     r->nmea_callback = cbs->nmea_cb;
-    if (cbs->nmea_cb != NULL) {
-        ALOGD("%s: sending latest nmea sentence to new callback",
-             __FUNCTION__);
-        /* r->nmea_callback(time(NULL)*1000, r->in, r->pos + 1); */
-        r->set_pending_callback_cb(CMD_NMEA_CB);
-    }
 
     EXIT;
 }
 
+GpsUtcTime nmea_reader_utc_time(NmeaReader * r, int year, int mon, int day,
+                                int tod)
+{
+    /* midnight only moves when the date does */
+    if (r->utc_day_year != year || r->utc_day_mon != mon ||
+        r->utc_day_mday != day) {
+        struct tm tm;
+
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = year - 1900;
+        tm.tm_mon = mon - 1;
+        tm.tm_mday = day;
+
+        /* We use the timegm64() here, as there is no timegm() in Bionic.
+         * It returns seconds since epoch, the fix wants milliseconds.
+         */
+        r->utc_day_start = timegm64(&tm) * 1000LL;
+        r->utc_day_year = year;
+        r->utc_day_mon = mon;
+        r->utc_day_mday = day;
+    }
+    return r->utc_day_start + tod;
+}
+
 static int nmea_reader_update_time(NmeaReader * r, Token tok)
 {
-    int hour, minute;
-    double seconds;
-    double milliseconds;
-    struct tm tm;
-    time64_t fix_time;
+    int tod;
 
     ENTER;
-    if (tok.p + 6 > tok.end)
+    tod = nmea_time_of_day(tok);
+    if (tod < 0)
         return -1;
 
     if (r->utc_year < 0) {
         // no date yet, get current one
+        struct tm tm;
         time_t now = time(NULL);
         gmtime_r(&now, &tm);
         r->utc_year = tm.tm_year + 1900;
@@ -205,36 +379,8 @@ static int nmea_reader_update_time(NmeaReader * r, Token tok)
         r->utc_day = tm.tm_mday;
     }
 
-    hour = str2int(tok.p, tok.p + 2);
-    minute = str2int(tok.p + 2, tok.p + 4);
-    seconds = str2float(tok.p + 4, tok.end);
-    milliseconds = seconds * 1000.0;    /* This is seconds + milliseconds */
-
-    /* initialize all values inside the tm-struct to 0,
-       otherwise mktime(&tm) will return -1 */
-    memset(&tm, 0, sizeof(tm));
-
-    tm.tm_hour = hour;
-    tm.tm_min = minute;
-    tm.tm_sec = 0;              /* Don't set seconds; we will add them later (together with milliseconds) */
-    tm.tm_year = r->utc_year - 1900;
-    tm.tm_mon = r->utc_mon - 1;
-    tm.tm_mday = r->utc_day;
-
-    /* We use the timegm64() here, as there is no timegm() in Bionic.
-     * The timesteamp field in the fix is 64-bit anyway, so we don't need
-     * to convert back to 32-bit after this (which would be tricky to get safe).
-     * timegm64() returns seconds since epoch.
-     *
-     * We immediately convert to milliseconds, as that is what is needed
-     * in location fix struct.
-     */
-    fix_time = timegm64(&tm) * 1000LL;
-    /* Now add the seconds+millliseconds */
-    fix_time = fix_time + ((long) milliseconds);
-
-    /* Assign calculated value to fix */
-    r->fix.timestamp = (time64_t) fix_time;
+    r->fix.timestamp = nmea_reader_utc_time(r, r->utc_year, r->utc_mon,
+                                            r->utc_day, tod);
     EXIT;
     return 0;
 }
@@ -255,7 +401,7 @@ static int nmea_reader_update_date(NmeaReader * r, Token date, Token time)
     mon = str2int(tok.p + 2, tok.p + 4);
     year = str2int(tok.p + 4, tok.p + 6) + 2000;
 
-    if ((day | mon | year) < 0) {
+    if (day < 1 || day > 31 || mon < 1 || mon > 12 || year < 2000) {
         ALOGD("date not properly formatted: '%.*s'", tok.end - tok.p,
              tok.p);
         return -1;
@@ -270,13 +416,24 @@ static int nmea_reader_update_date(NmeaReader * r, Token date, Token time)
 }
 
 
+/* ddmm.mmmm or dddmm.mmmm to degrees.  The whole minutes and their
+ * fraction are kept as one scaled integer so only the final division
+ * rounds.
+ */
 static double convert_from_hhmm(Token tok)
 {
-    double val = str2float(tok.p, tok.end);
-    int degrees = (int) (floor(val) / 100);
-    double minutes = val - degrees * 100.;
-    double dcoord = degrees + minutes / 60.0;
-    return dcoord;
+    int64_t mant, scale, degrees;
+    int frac = nmea_decimal(tok.p, tok.end, &mant);
+
+    if (frac < 0)
+        return 0.;
+    if (frac > 15) {
+        mant /= pow10i[frac - 15];
+        frac = 15;
+    }
+    scale = pow10i[frac];
+    degrees = mant / (100 * scale);
+    return degrees + (double) (mant - degrees * 100 * scale) / (60. * scale);
 }
 
 
@@ -388,7 +545,184 @@ static int nmea_reader_update_speed(NmeaReader * r, Token speed)
 }
 
 
-static void nmea_reader_parse(NmeaReader * r)
+void nmea_reader_set_epoch(NmeaReader * r, int t)
+{
+    if (t < 0 || t == r->epoch_time)
+        return;
+    if (r->epoch_time >= 0)
+        nmea_reader_flush(r);
+    r->epoch_time = t;
+}
+
+static void nmea_reader_epoch(NmeaReader * r, NmeaTokenizer * tzer,
+                              Token id)
+{
+    int t;
+
+    if (!memcmp(id.p, "GGA", 3) || !memcmp(id.p, "RMC", 3))
+        t = nmea_time_of_day(nmea_tokenizer_get(tzer, 1));
+    else if (!memcmp(id.p, "GLL", 3))
+        t = nmea_time_of_day(nmea_tokenizer_get(tzer, 5));
+    else
+        return;
+
+    nmea_reader_set_epoch(r, t);
+}
+
+/* Constellation of a talker id, -1 for GN or anything else that mixes. */
+static int nmea_talker_system(const char *id)
+{
+    if (id[0] == 'G') {
+        switch (id[1]) {
+        case 'P':
+            return NMEA_SYS_GPS;
+        case 'L':
+            return NMEA_SYS_GLONASS;
+        case 'A':
+            return NMEA_SYS_GALILEO;
+        case 'B':
+            return NMEA_SYS_BEIDOU;
+        case 'Q':
+            return NMEA_SYS_QZSS;
+        }
+    } else if (id[0] == 'B' && id[1] == 'D') {
+        return NMEA_SYS_BEIDOU;
+    } else if (id[0] == 'Q' && id[1] == 'Z') {
+        return NMEA_SYS_QZSS;
+    }
+    return -1;
+}
+
+/* NMEA 4.1 system id field of GSA, -1 if absent */
+static int nmea_system_id(Token tok)
+{
+    int id = str2int(tok.p, tok.end);
+
+    if (tok.p >= tok.end || id < 1 || id > NMEA_SYS_COUNT)
+        return -1;
+    return id - 1;
+}
+
+/* for GN sentences without a system id the numbering ranges decide */
+static int nmea_prn_system(int prn)
+{
+    if (prn >= 65 && prn <= 96)
+        return NMEA_SYS_GLONASS;
+    if (prn >= 193 && prn <= 200)
+        return NMEA_SYS_QZSS;
+    if (prn >= 201 && prn <= 263)
+        return NMEA_SYS_BEIDOU;
+    if (prn >= 301 && prn <= 336)
+        return NMEA_SYS_GALILEO;
+    return NMEA_SYS_GPS;
+}
+
+/* Map a receiver PRN into the single numbering space the framework
+ * sees: GPS 1-32, SBAS 33-64, GLONASS 65-96, QZSS 193-200, BeiDou
+ * 201-263, Galileo 301-336.  Receivers that already number this way
+ * are passed through.  0, or anything above NMEA_MAX_SV_ID, is not a
+ * satellite the framework knows and is dropped by the callers; so is a
+ * number outside its constellation's range, such as the UBX GLONASS
+ * slot 255 for an unknown slot.
+ */
+int nmea_sv_id(int sys, int prn)
+{
+    switch (sys) {
+    case NMEA_SYS_GLONASS:
+        if (prn <= 32)
+            return prn + 64;
+        return prn >= 65 && prn <= 96 ? prn : 0;
+    case NMEA_SYS_GALILEO:
+        if (prn <= 36)
+            return prn + 300;
+        return prn >= 301 && prn <= 336 ? prn : 0;
+    case NMEA_SYS_BEIDOU:
+        if (prn <= 63)
+            return prn + 200;
+        return prn >= 201 && prn <= 263 ? prn : 0;
+    case NMEA_SYS_QZSS:
+        /* QZSS 9 and 10 would collide with BeiDou 201 and 202 */
+        if (prn <= 8)
+            return prn + 192;
+        return prn >= 193 && prn <= 200 ? prn : 0;
+    default:
+        return prn;
+    }
+}
+
+/* The first GSV of a constellation in a new epoch starts its table over.
+ * Until a sentence has carried a time there are no epochs, and message 1
+ * of a GSV group starts it over instead (sys < 0: every table, for a
+ * talker that does not name the constellation).
+ */
+static void nmea_reader_reset_svs(NmeaReader * r, int sys)
+{
+    int i;
+
+    for (i = 0; i < NMEA_SYS_COUNT; i++) {
+        if (sys < 0 || sys == i)
+            r->sv_tables[i].num_svs = 0;
+    }
+}
+
+/* A receiver reporting several signals (NMEA 4.1 signal id) lists the
+ * same satellite once per signal; it is kept once with the best SNR.
+ */
+static void nmea_reader_add_sv(NmeaReader * r, int sys, int svid,
+                               float elevation, float azimuth, float snr)
+{
+    NmeaSvTable *t = &r->sv_tables[sys];
+    GpsSvInfo *sv;
+    int i;
+
+    if (t->epoch_time != r->epoch_time) {
+        t->epoch_time = r->epoch_time;
+        t->num_svs = 0;
+    }
+
+    for (i = 0; i < t->num_svs; i++) {
+        sv = &t->sv[i];
+        if (sv->prn == svid) {
+            if (snr > sv->snr)
+                sv->snr = snr;
+            return;
+        }
+    }
+    if (t->num_svs >= GPS_MAX_SVS)
+        return;
+
+    sv = &t->sv[t->num_svs++];
+    sv->size = sizeof(*sv);
+    sv->prn = svid;
+    sv->elevation = elevation;
+    sv->azimuth = azimuth;
+    sv->snr = snr;
+}
+
+/* rebuild the reported list from all tables that are recent enough */
+static void nmea_reader_merge_svs(NmeaReader * r)
+{
+    int sys, i, n = 0;
+
+    for (sys = 0; sys < NMEA_SYS_COUNT; sys++) {
+        NmeaSvTable *t = &r->sv_tables[sys];
+        int age = r->epoch_time - t->epoch_time;
+
+        if (age < 0)
+            age += 24 * 3600 * 1000;
+        if (t->num_svs == 0 || age > NMEA_SV_MAX_AGE_MS)
+            continue;
+        for (i = 0; i < t->num_svs && n < GPS_MAX_SVS; i++)
+            r->sv_status.sv_list[n++] = t->sv[i];
+    }
+    r->sv_status.num_svs = n;
+    r->sv_status_changed = 1;
+}
+
+/* s points at a complete sentence of len bytes including the '\n'; it may
+ * live in the caller's read buffer rather than in r->in
+ */
+static void nmea_reader_parse(NmeaReader * r, const char *s, int len)
 {
     /* we received a complete sentence, now parse it to generate
      * a new GPS fix...
@@ -397,13 +731,13 @@ static void nmea_reader_parse(NmeaReader * r)
     Token tok;
 
     ENTER;
-    ALOGD("Received: %.*s", r->pos, r->in);
-    if (r->pos < 9) {
-        ALOGD("Too short. discarded.");
+    ALOGV("Received: %.*s", len, s);
+    if (len < 9) {
+        OTRACE("nmea_short", len, 0, 0);
         return;
     }
 
-    nmea_tokenizer_init(tzer, r->in, r->in + r->pos);
+    nmea_tokenizer_init(tzer, s, s + len);
 #if 0
     {
         int n;
@@ -417,13 +751,18 @@ static void nmea_reader_parse(NmeaReader * r)
     tok = nmea_tokenizer_get(tzer, 0);
 
     if (tok.p + 5 > tok.end) {
-        ALOGD("sentence id '%.*s' too short, ignored.", tok.end - tok.p,
+        ALOGV("sentence id '%.*s' too short, ignored.", tok.end - tok.p,
              tok.p);
         return;
     }
     /* ignore first two characters. */
     tok.p += 2;
 
+    /* a new time of day starts a new epoch; hand the previous one over
+     * before this sentence touches the fix
+     */
+    nmea_reader_epoch(r, tzer, tok);
+
 /*
 **     GGA          Global Positioning System Fix Data
 **1     123519       Fix taken at 12:35:19 UTC
@@ -449,10 +788,10 @@ static void nmea_reader_parse(NmeaReader * r)
 */
 /* GGA,214258.00,5740.857675,N,01159.649523,E,1,08,3.0,104.0,M,,,,*32 */
     if (!memcmp(tok.p, "GGA", 3)) {
-        ALOGD("GGA");
+        OTRACE("nmea_gga", len, 0, 0);
         // GPS fix
         Token tok_fixstaus = nmea_tokenizer_get(tzer, 6);
-        if (tok_fixstaus.p[0] > '0') {
+        if (nmea_token_char(tok_fixstaus) > '0') {
             Token tok_altitude = nmea_tokenizer_get(tzer, 9);
             Token tok_altitudeUnits = nmea_tokenizer_get(tzer, 10);
 
@@ -474,31 +813,44 @@ static void nmea_reader_parse(NmeaReader * r)
 */
 /* GSA,A,3,02,04,07,13,20,23,,,,,,,6.7,3.0,6.0*36 */
     } else if (!memcmp(tok.p, "GSA", 3)) {
-        ALOGD("GSA");
+        OTRACE("nmea_gsa", len, 0, 0);
         Token tok_fixStatus = nmea_tokenizer_get(tzer, 2);
         int i;
 
-        if (tok_fixStatus.p[0] != '\0' && tok_fixStatus.p[0] != '1') {
+        if (nmea_token_char(tok_fixStatus) != '\0' && nmea_token_char(tok_fixStatus) != '1') {
 
             Token tok_accuracy = nmea_tokenizer_get(tzer, 15);
+            /* GN receivers send one GSA per constellation and epoch */
+            int sys = nmea_talker_system(tok.p - 2);
+
+            if (sys < 0)
+                sys = nmea_system_id(nmea_tokenizer_get(tzer, 18));
 
             nmea_reader_update_accuracy(r, tok_accuracy);
 
-            r->sv_status.used_in_fix_mask = 0ul;
+            if (r->used_mask_epoch != r->epoch_time) {
+                r->used_mask_epoch = r->epoch_time;
+                r->used_mask = 0;
+            }
 
             for (i = 3; i <= 14; ++i) {
 
                 Token tok_prn = nmea_tokenizer_get(tzer, i);
                 int prn = str2int(tok_prn.p, tok_prn.end);
+                int svid;
 
-                if (prn > 0) {
-                    r->sv_status.used_in_fix_mask |= (1ul << (prn - 1));
-                    r->sv_status_changed = 1;
-                    ALOGD("%s: fix mask is %d", __FUNCTION__,
-                         r->sv_status.used_in_fix_mask);
-                }
+                if (prn <= 0)
+                    continue;
 
+                svid = nmea_sv_id(sys >= 0 ? sys : nmea_prn_system(prn),
+                                  prn);
+                /* the mask only has room for GPS */
+                if (svid >= 1 && svid <= 32)
+                    r->used_mask |= 1u << (svid - 1);
+                r->sv_status_changed = 1;
             }
+            r->sv_status.used_in_fix_mask = r->used_mask;
+            OTRACE("nmea_fix_mask", r->sv_status.used_in_fix_mask, sys, 0);
 
         }
 /*
@@ -511,10 +863,10 @@ static void nmea_reader_parse(NmeaReader * r)
 **  $GPGLL,4916.45,N,12311.12,W,225444,A*31
 */
     } else if (!memcmp(tok.p, "GLL", 3)) {
-        ALOGD("GLL");
+        OTRACE("nmea_gll", len, 0, 0);
         Token tok_fixStatus = nmea_tokenizer_get(tzer, 6);
 
-        if (tok_fixStatus.p[0] == 'A') {
+        if (nmea_token_char(tok_fixStatus) == 'A') {
             Token tok_time = nmea_tokenizer_get(tzer, 5);
             Token tok_fixStatus = nmea_tokenizer_get(tzer, 6);
             Token tok_latitude = nmea_tokenizer_get(tzer, 1);
@@ -522,12 +874,12 @@ static void nmea_reader_parse(NmeaReader * r)
             Token tok_longitude = nmea_tokenizer_get(tzer, 3);
             Token tok_longitudeHemi = nmea_tokenizer_get(tzer, 4);
 
-            ALOGD("in GGL, fixStatus=%c", tok_fixStatus.p[0]);
-            if (tok_fixStatus.p[0] == 'A') {
+            OTRACE("nmea_gll_status", nmea_token_char(tok_fixStatus), 0, 0);
+            if (nmea_token_char(tok_fixStatus) == 'A') {
                 nmea_reader_update_latlong(r, tok_latitude,
-                                           tok_latitudeHemi.p[0],
+                                           nmea_token_char(tok_latitudeHemi),
                                            tok_longitude,
-                                           tok_longitudeHemi.p[0]);
+                                           nmea_token_char(tok_longitudeHemi));
 
                 r->update = 1;
             }
@@ -546,10 +898,10 @@ static void nmea_reader_parse(NmeaReader * r)
 */
 /* RMC,232401.00,A,5740.841023,N,01159.626002,E,000.0,244.0,031109,,,A*56 */
     } else if (!memcmp(tok.p, "RMC", 3)) {
-        ALOGD("RMC");
+        OTRACE("nmea_rmc", len, 0, 0);
         Token tok_fixStatus = nmea_tokenizer_get(tzer, 2);
 
-        if (tok_fixStatus.p[0] == 'A') {
+        if (nmea_token_char(tok_fixStatus) == 'A') {
             Token tok_time = nmea_tokenizer_get(tzer, 1);
             Token tok_fixStatus = nmea_tokenizer_get(tzer, 2);
             Token tok_latitude = nmea_tokenizer_get(tzer, 3);
@@ -560,14 +912,14 @@ static void nmea_reader_parse(NmeaReader * r)
             Token tok_bearing = nmea_tokenizer_get(tzer, 8);
             Token tok_date = nmea_tokenizer_get(tzer, 9);
 
-            ALOGD("in RMC, fixStatus=%c", tok_fixStatus.p[0]);
-            if (tok_fixStatus.p[0] == 'A') {
+            OTRACE("nmea_rmc_status", nmea_token_char(tok_fixStatus), 0, 0);
+            if (nmea_token_char(tok_fixStatus) == 'A') {
                 nmea_reader_update_date(r, tok_date, tok_time);
 
                 nmea_reader_update_latlong(r, tok_latitude,
-                                           tok_latitudeHemi.p[0],
+                                           nmea_token_char(tok_latitudeHemi),
                                            tok_longitude,
-                                           tok_longitudeHemi.p[0]);
+                                           nmea_token_char(tok_longitudeHemi));
 
                 nmea_reader_update_bearing(r, tok_bearing);
                 nmea_reader_update_speed(r, tok_speed);
@@ -589,14 +941,14 @@ static void nmea_reader_parse(NmeaReader * r)
 **      *75          the checksum data, always begins with *
 */
 /* GSV,1,1,01,07,,,49,,,,,,,,,,,,*72 */
+/* NMEA 4.1 appends the signal id after the last satellite */
     } else if (!memcmp(tok.p, "GSV", 3)) {
-        ALOGD("GSV");
-
         Token tok_noSatellites = nmea_tokenizer_get(tzer, 3);
-        ALOGD("NR sat: '%.*s'", tok.end - tok.p, tok.p);
         int noSatellites =
             str2int(tok_noSatellites.p, tok_noSatellites.end);
 
+        OTRACE("nmea_gsv", len, noSatellites, 0);
+
         if (noSatellites > 0) {
 
             Token tok_noSentences = nmea_tokenizer_get(tzer, 1);
@@ -605,60 +957,66 @@ static void nmea_reader_parse(NmeaReader * r)
             int sentence = str2int(tok_sentence.p, tok_sentence.end);
             int totalSentences =
                 str2int(tok_noSentences.p, tok_noSentences.end);
-            int curr;
+            int talker = nmea_talker_system(tok.p - 2);
+            /* the tokenizer drops a trailing empty SNR, so round up; what
+             * follows the satellites left for this sentence is the 4.1
+             * signal id
+             */
+            int count = (tzer->count - 4 + 3) / 4;
+            int left = noSatellites - 4 * (sentence - 1);
             int i;
 
-            if (sentence == 1) {
-                r->sv_status_changed = 0;
-                r->sv_status.num_svs = 0;
-            }
-
-            curr = r->sv_status.num_svs;
+            if (count > 4)
+                count = 4;
+            if (sentence >= 1 && count > left)
+                count = left;
+            if (r->epoch_time < 0 && sentence == 1)
+                nmea_reader_reset_svs(r, talker);
 
-            i = 0;
-
-            while ((i < 4) && (r->sv_status.num_svs < noSatellites)) {
+            for (i = 0; i < count; i++) {
 
                 Token tok_prn = nmea_tokenizer_get(tzer, i * 4 + 4);
                 Token tok_elevation = nmea_tokenizer_get(tzer, i * 4 + 5);
                 Token tok_azimuth = nmea_tokenizer_get(tzer, i * 4 + 6);
                 Token tok_snr = nmea_tokenizer_get(tzer, i * 4 + 7);
-                int prn;
-                double snr;
+                int prn, sys, svid;
 
                 prn = str2int(tok_prn.p, tok_prn.end);
-                snr = str2float(tok_snr.p, tok_snr.end);
 
                 //if (prn > 0 && snr > 0) {
                 if (prn > 0) {
-                    r->sv_status.sv_list[curr].prn = prn;
-                    r->sv_status.sv_list[curr].elevation =
-                        str2float(tok_elevation.p, tok_elevation.end);
-                    r->sv_status.sv_list[curr].azimuth =
-                        str2float(tok_azimuth.p, tok_azimuth.end);
-                    r->sv_status.sv_list[curr].snr = snr;
-                    r->sv_status.num_svs += 1;
-
-                    curr += 1;
+                    /* GP also lists SBAS, QZSS and even GLONASS on some
+                     * receivers; those go where their own talker puts them
+                     * so that a satellite is reported once
+                     */
+                    if (talker < 0 || (talker == NMEA_SYS_GPS && prn > 32))
+                        sys = nmea_prn_system(prn);
+                    else
+                        sys = talker;
+                    svid = nmea_sv_id(sys, prn);
+                    if (svid <= 0 || svid > NMEA_MAX_SV_ID)
+                        continue;
+                    nmea_reader_add_sv(r, sys, svid,
+                        str2float(tok_elevation.p, tok_elevation.end),
+                        str2float(tok_azimuth.p, tok_azimuth.end),
+                        str2float(tok_snr.p, tok_snr.end));
                 }
-                i += 1;
             }
 
             if (sentence == totalSentences) {
-                r->sv_status_changed = 1;
-                ALOGD("%s: GSV message with total satellites %d",
-                     __FUNCTION__, r->sv_status.num_svs);
+                nmea_reader_merge_svs(r);
+                OTRACE("nmea_gsv_done", r->sv_status.num_svs, talker, 0);
 
             }
         }
 
     } else {
         tok.p -= 2;
-        ALOGD("unknown sentence '%.*s", tok.end - tok.p, tok.p);
+        ALOGV("unknown sentence '%.*s", tok.end - tok.p, tok.p);
     }
 
-    if ((r->fix.flags != 0) && r->update) {
 #if 0
+    if ((r->fix.flags != 0) && r->update) {
         char temp[256];
         char *p = temp;
         char *end = p + sizeof(temp);
@@ -684,71 +1042,241 @@ static void nmea_reader_parse(NmeaReader * r)
         gmtime_r((time_t *) & r->fix.timestamp, &utc);
         p += snprintf(p, end - p, " time=%s", asctime(&utc));
         ALOGD("%s", temp);
-#endif
-        if (r->callback) {
-            //r->callback(&r->fix);
-            r->set_pending_callback_cb(CMD_LOCATION_CB);
-            r->fix.flags = 0;
-            r->update = 0;
-        } else {
-            ALOGE("no callback, keeping data until needed !");
-        }
-    }
-
-    if (r->sv_status_changed != 0) {
-        if (r->sv_status_callback) {
-            ALOGD("update sv status");
-            //r->sv_status_callback(&r->sv_status);
-            r->set_pending_callback_cb(CMD_SV_STATUS_CB);
-            r->sv_status_changed = 0;
-        }
     }
+#endif
     EXIT;
 
 }
 
 void nmea_reader_add(NmeaReader * r, char *nmea)
 {
-    unsigned int i;
-
     ENTER;
-    ALOGD("%s: %s", __FUNCTION__, nmea);
+    ALOGV("%s: %s", __FUNCTION__, nmea);
 
-    for (i = 0; i < strlen(nmea); i++)
-        nmea_reader_addc(r, nmea[i]);
-    nmea_reader_addc(r, '\n');
+    nmea_reader_addbuf(r, nmea, strlen(nmea));
+    nmea_reader_addbuf(r, "\n", 1);
     EXIT;
 }
 
-void nmea_reader_addc(NmeaReader * r, int c)
+static const char *nmea_type_names[NMEA_TYPE_COUNT] = {
+    "GGA", "GSA", "GLL", "RMC", "GSV", "other"
+};
+
+static int nmea_sentence_type(const char *s, const char *end)
 {
-    ENTER;
-    ALOGV("%s: %c", __FUNCTION__, (char) c);
-    if (r->overflow) {
-        r->overflow = (c != '\n');
-        return;
+    int i;
+
+    /* "$ttSSS," : skip the '$' and the two character talker id */
+    if (end - s < 6)
+        return NMEA_TYPE_OTHER;
+    for (i = 0; i < NMEA_TYPE_OTHER; i++) {
+        if (!memcmp(s + 3, nmea_type_names[i], 3))
+            return i;
+    }
+    return NMEA_TYPE_OTHER;
+}
+
+static int hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* XOR of all bytes in [p, end), four bytes per step.  XOR does not
+ * care about byte order so the word only has to be folded at the end.
+ */
+static unsigned nmea_xor(const char *p, const char *end)
+{
+    uint32_t acc = 0, w;
+    unsigned x;
+
+    while (end - p >= 4) {
+        memcpy(&w, p, 4);
+        acc ^= w;
+        p += 4;
     }
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    x = acc & 0xff;
+    while (p < end)
+        x ^= (unsigned char) *p++;
+    return x;
+}
+
+/* Returns 1 if the sentence may be parsed, 0 if it has to be dropped,
+ * -1 if it has no checksum and may only be passed on.
+ */
+static int nmea_reader_check(NmeaReader * r, const char *s, int len)
+{
+    const char *end = s + len;
+    const char *body = s;
+    NmeaTypeStats *st;
+    int hi, lo;
+    unsigned sum;
+
+    if (end > s && end[-1] == '\n')
+        end--;
+    if (end > s && end[-1] == '\r')
+        end--;
+    st = &r->stats[nmea_sentence_type(s, end)];
+
+    if (body < end && body[0] == '$')
+        body++;
+
+    if (end - body < 3 || end[-3] != '*') {
+        /* a truncated sentence looks the same, so a missing checksum is
+         * only let through when the receiver is known to leave it out
+         */
+        if (memchr(body, '*', end - body) == NULL) {
+            st->unchecked++;
+            OTRACE("nmea_unchecked", len, r->unchecked_nmea, 0);
+            return r->unchecked_nmea ? -1 : 0;
+        }
+        st->rejected++;
+        OTRACE("nmea_malformed", len, 0, 0);
+        return 0;
+    }
+
+    hi = hexval(end[-2]);
+    lo = hexval(end[-1]);
+    if (hi < 0 || lo < 0) {
+        st->rejected++;
+        OTRACE("nmea_malformed", len, 0, 0);
+        return 0;
+    }
+    sum = nmea_xor(body, end - 3);
+    if (sum != (unsigned) (hi << 4 | lo)) {
+        st->rejected++;
+        OTRACE("nmea_bad_checksum", st - r->stats, sum, hi << 4 | lo);
+        return 0;
+    }
+    st->accepted++;
+    return 1;
+}
 
-    if (r->pos >= (int) sizeof(r->in) - 1) {
-        r->overflow = 1;
+void nmea_reader_dump_stats(NmeaReader * r, int fd)
+{
+    char line[96];
+    int i, n;
+
+    n = snprintf(line, sizeof(line), "%-6s %10s %10s %10s\n",
+                 "type", "accepted", "rejected", "unchecked");
+    write(fd, line, n);
+    for (i = 0; i < NMEA_TYPE_COUNT; i++) {
+        n = snprintf(line, sizeof(line), "%-6s %10u %10u %10u\n",
+                     nmea_type_names[i], r->stats[i].accepted,
+                     r->stats[i].rejected, r->stats[i].unchecked);
+        write(fd, line, n);
+    }
+    n = snprintf(line, sizeof(line),
+                 "sentences %u epochs %u dropped %u\n",
+                 r->sentences, r->epochs, r->records_dropped);
+    write(fd, line, n);
+}
+
+static void nmea_reader_sentence(NmeaReader * r, const char *s, int len)
+{
+    int check;
+
+    OTRACE("nmea_sentence", len, 0, 0);
+    check = nmea_reader_check(r, s, len);
+    if (check == 0) {
         r->pos = 0;
         return;
     }
+    /* with a binary protocol decoding the fixes the sentences are only
+     * passed on, as are unchecked ones
+     */
+    if (check > 0 && !r->binary)
+        nmea_reader_parse(r, s, len);
+    /* after parsing, which may have closed the previous epoch */
+    nmea_reader_arrival(r);
+    r->sentences++;
+    if (r->nmea_callback) {
+        NmeaRecord *e = &r->epoch;
+        struct timeval tv;
+
+        if (e->count == NMEA_EPOCH_SENTENCES)
+            nmea_reader_flush(r);
+
+        gettimeofday(&tv, (struct timezone *) NULL);
+        e->sentence[e->count].timestamp =
+            tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+        e->sentence[e->count].offset = e->used;
+        e->sentence[e->count].length = len;
+        memcpy(e->batch + e->used, s, len);
+        e->batch[e->used + len] = '\0';
+        e->used += len + 1;
+        e->count++;
+    }
+    r->pos = 0;
+}
+
+/* Frame sentences out of a block read from the receiver.  Complete
+ * sentences are parsed where they lie in buf; only a sentence that is
+ * still incomplete at the end of the block is copied into r->in to be
+ * continued by the next call.
+ *
+ * The result is the same as feeding the bytes one at a time to the
+ * original per-byte framer: a sentence that does not fit into r->in
+ * sets the overflow state, the byte that did not fit is dropped (even if
+ * it is the '\n') and everything up to and including the next '\n' is
+ * discarded.  '\r' is kept in the sentence, the tokenizer strips it.
+ */
+void nmea_reader_addbuf(NmeaReader * r, const char *buf, int len)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+
+    while (p < end) {
+        const char *nl;
+        int room, n;
+
+        if (r->overflow) {
+            nl = memchr(p, '\n', end - p);
+            if (nl == NULL)
+                return;
+            r->overflow = 0;
+            p = nl + 1;
+            continue;
+        }
 
-    r->in[r->pos] = (char) c;
-    r->pos += 1;
+        room = (int) sizeof(r->in) - 1 - r->pos;
+        n = end - p;
+        nl = memchr(p, '\n', n < room ? n : room);
 
-    if (c == '\n') {
-        ALOGD("Got an nmea string, parsing.");
-        nmea_reader_parse(r);
-        if (r->nmea_callback) {
-            struct timeval tv;
-            int64_t now;
-            gettimeofday(&tv, (struct timezone *) NULL);
-            now = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
-            r->set_pending_callback_cb(CMD_NMEA_CB);
+        if (nl == NULL) {
+            if (n <= room) {
+                memcpy(r->in + r->pos, p, n);
+                r->pos += n;
+                return;
+            }
+            /* room bytes fit, the one after them overflows */
+            OTRACE("nmea_overflow", r->pos + room, 0, 0);
+            r->overflow = 1;
+            r->pos = 0;
+            p += room + 1;
+            continue;
         }
-        r->pos = 0;
+
+        n = nl + 1 - p;
+        if (r->pos == 0) {
+            nmea_reader_sentence(r, p, n);
+        } else {
+            memcpy(r->in + r->pos, p, n);
+            nmea_reader_sentence(r, r->in, r->pos + n);
+        }
+        p = nl + 1;
     }
-    EXIT;
+}
+
+void nmea_reader_addc(NmeaReader * r, int c)
+{
+    char ch = (char) c;
+
+    nmea_reader_addbuf(r, &ch, 1);
 }
@@ -19,10 +19,22 @@
  *         Torgny Johansson <torgny.johansson@ericsson.com>
  */
 
+#ifndef NMEA_READER_H
+#define NMEA_READER_H
+
 #include <hardware/gps.h>
 
 #define  NMEA_MAX_SIZE  83
 
+/* epochs in flight to the callback thread, power of two */
+#define  NMEA_RECORDS   8
+
+/* sentences batched per epoch before it is handed over early */
+#define  NMEA_EPOCH_SENTENCES  24
+
+/* an open epoch is handed over once the receiver has been quiet this long */
+#define  NMEA_EPOCH_IDLE_MS    30
+
 enum {
     CMD_STATUS_CB = 0,
     CMD_AGPS_STATUS_CB,
@@ -30,27 +42,123 @@ enum {
     CMD_LOCATION_CB,
     CMD_NMEA_CB,
     CMD_NI_CB,
-    CMD_QUIT
+    CMD_EPOCH_CB,
+    CMD_QUIT,
+    /* the other way, to the reader thread */
+    CMD_CONFIGURE,
+    CMD_STOP
 };
 
 typedef void (*set_pending_callback) (char callback);
 
+/* sentence types counted by the checksum statistics */
+enum {
+    NMEA_TYPE_GGA = 0,
+    NMEA_TYPE_GSA,
+    NMEA_TYPE_GLL,
+    NMEA_TYPE_RMC,
+    NMEA_TYPE_GSV,
+    NMEA_TYPE_OTHER,
+    NMEA_TYPE_COUNT
+};
+
+typedef struct {
+    unsigned accepted;
+    unsigned rejected;          /* checksum mismatch or malformed */
+    unsigned unchecked;         /* no checksum field, see unchecked_nmea */
+} NmeaTypeStats;
+
+/* constellations the satellites are sorted into */
+enum {
+    NMEA_SYS_GPS = 0,           /* and SBAS, PRN 33-64 */
+    NMEA_SYS_GLONASS,
+    NMEA_SYS_GALILEO,
+    NMEA_SYS_BEIDOU,
+    NMEA_SYS_QZSS,
+    NMEA_SYS_COUNT
+};
+
+/* highest id of the numbering nmea_sv_id() maps into (Galileo 36) */
+#define NMEA_MAX_SV_ID  336
+
+/* a constellation's table is left out once it has not been refreshed
+ * by a GSV group for this long
+ */
+#define  NMEA_SV_MAX_AGE_MS    5000
+
+typedef struct {
+    int epoch_time;             /* epoch the table was last filled in */
+    int num_svs;
+    GpsSvInfo sv[GPS_MAX_SVS];
+} NmeaSvTable;
+
+#define  NMEA_EPOCH_HAS_FIX         0x01
+#define  NMEA_EPOCH_HAS_SV_STATUS   0x02
+
+/*
+ * Everything the receiver reported for one measurement epoch: the merged
+ * fix, the SV status and the raw sentences.  The reader thread fills a
+ * record while the epoch is open and publishes it once; the callback
+ * thread does not hand it back until all callbacks for it have returned.
+ */
+typedef struct {
+    int flags;
+    int64_t arrival_ns;         /* first data of the epoch was read */
+    int64_t publish_ns;         /* handed to the callback thread */
+    GpsLocation fix;
+    GpsSvStatus sv_status;
+    int count;
+    int used;                   /* bytes of batch in use */
+    struct {
+        GpsUtcTime timestamp;
+        short offset;
+        short length;
+    } sentence[NMEA_EPOCH_SENTENCES];
+    char batch[NMEA_EPOCH_SENTENCES * (NMEA_MAX_SIZE + 1)];
+} NmeaRecord;
+
 typedef struct {
     int pos;
     int overflow;
     int utc_year;
     int utc_mon;
     int utc_day;
+    /* milliseconds since the epoch at 00:00 of utc_day_* */
+    int64_t utc_day_start;
+    int utc_day_year;
+    int utc_day_mon;
+    int utc_day_mday;
     int utc_diff;
     GpsLocation fix;
     GpsSvStatus sv_status;
     int sv_status_changed;
+    NmeaSvTable sv_tables[NMEA_SYS_COUNT];
+    uint32_t used_mask;         /* GSA satellites of used_mask_epoch */
+    int used_mask_epoch;
     gps_location_callback callback;
     gps_sv_status_callback sv_status_callback;
     gps_nmea_callback nmea_callback;
     set_pending_callback set_pending_callback_cb;
     char in[NMEA_MAX_SIZE + 1];
     int update;
+    int binary;                 /* fixes come from a binary protocol */
+    /* sentences without a checksum are passed on to nmea_cb instead of
+     * being dropped; they are never parsed
+     */
+    int unchecked_nmea;
+    NmeaTypeStats stats[NMEA_TYPE_COUNT];
+    /* the epoch being collected, -1 until a sentence carried a time */
+    int epoch_time;
+    NmeaRecord epoch;
+    unsigned epochs;
+    unsigned sentences;
+    /* single producer (reader thread, or init before it runs), single
+     * consumer (callback thread)
+     */
+    NmeaRecord records[NMEA_RECORDS];
+    volatile uint32_t record_head;       /* records published */
+    volatile uint32_t record_tail;       /* records released */
+    unsigned records_dropped;
 } NmeaReader;
 
 void nmea_reader_init(NmeaReader * r);
@@ -59,4 +167,39 @@ void nmea_reader_set_callbacks(NmeaReader * r, GpsCallbacks * cbs);
 
 void nmea_reader_addc(NmeaReader * r, int c);
 
+void nmea_reader_addbuf(NmeaReader * r, const char *buf, int len);
+
 void nmea_reader_add(NmeaReader * r, char *nmea);
+
+/* Hand the open epoch over.  Returns 1 if there was anything to send. */
+int nmea_reader_flush(NmeaReader * r);
+
+/* Nonzero while sentences have been collected but not handed over. */
+int nmea_reader_pending(NmeaReader * r);
+
+/* CLOCK_MONOTONIC in nanoseconds. */
+int64_t nmea_now_ns(void);
+
+/* Data for the open epoch has just been read; stamps its arrival. */
+void nmea_reader_arrival(NmeaReader * r);
+
+/* Start the epoch with time of day t (ms), handing the open one over. */
+void nmea_reader_set_epoch(NmeaReader * r, int t);
+
+/* Milliseconds since the epoch of a UTC date and time of day (ms). */
+GpsUtcTime nmea_reader_utc_time(NmeaReader * r, int year, int mon, int day,
+                                int tod);
+
+/* Satellite number as reported to the framework, see NMEA_SYS_*. */
+int nmea_sv_id(int sys, int prn);
+
+/* Oldest published record, or NULL.  Callback thread only. */
+NmeaRecord *nmea_reader_next_record(NmeaReader * r);
+
+/* Hand the record returned by nmea_reader_next_record() back. */
+void nmea_reader_release_record(NmeaReader * r);
+
+/* Write the checksum and epoch counters as text to fd. */
+void nmea_reader_dump_stats(NmeaReader * r, int fd);
+
+#endif /* NMEA_READER_H */
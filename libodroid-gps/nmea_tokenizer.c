@@ -49,12 +49,14 @@
 /*****************************************************************/
 /*****************************************************************/
 
+/* The tokenizer runs for every sentence and every field access, so
+ * neither entry point is traced.
+ */
 int nmea_tokenizer_init(NmeaTokenizer * t, const char *p, const char *end)
 {
     int count = 0;
     /* char *q; */
 
-    ENTER;
     /* the initial '$' is optional */
     if (p < end && p[0] == '$')
         p += 1;
@@ -89,7 +91,6 @@ int nmea_tokenizer_init(NmeaTokenizer * t, const char *p, const char *end)
     }
 
     t->count = count;
-    EXIT;
     return count;
 }
 
@@ -98,12 +99,10 @@ Token nmea_tokenizer_get(NmeaTokenizer * t, int index)
     Token tok;
     static const char *dummy = "";
 
-    ENTER;
     if (index < 0 || index >= t->count) {
         tok.p = tok.end = dummy;
     } else
         tok = t->tokens[index];
 
-    EXIT;
     return tok;
 }
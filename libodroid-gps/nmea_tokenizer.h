@@ -24,7 +24,8 @@ typedef struct {
     const char *end;
 } Token;
 
-#define  MAX_NMEA_TOKENS  20
+/* NMEA 4.1 GSV: id, 3 counters, 4 x 4 satellite fields and a signal id */
+#define  MAX_NMEA_TOKENS  32
 
 typedef struct {
     int count;
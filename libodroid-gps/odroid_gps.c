@@ -22,6 +22,8 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <math.h>
 #include <time.h>
 #include <semaphore.h>
@@ -35,6 +37,9 @@
 #include <hardware/gps.h>
 
 #include "nmea_reader.h"
+#include "gps_protocol.h"
+#include "gps_replay.h"
+#include "odroid_trace.h"
 #include "version.h"
 
 /* Just check this file */
@@ -66,6 +71,12 @@
 #define ST_STOPPING     (1 << 5) /* 32 */
 #define ST_STOPPED      (1 << 6) /* 64 */
 
+typedef struct {
+    unsigned count;
+    int64_t sum_ns;
+    int64_t max_ns;
+} GpsLatency;
+
 struct gps_state{
     int device_state;
     NmeaReader reader[1];
@@ -81,8 +92,28 @@ struct gps_state{
 
     pthread_t main_thread;
     pthread_t thread;
+    int thread_running;         /* reader thread started, not yet joined */
+    int stop_requested;         /* reader thread got CMD_STOP */
 
     int fd;
+
+    /* binary protocol beside NMEA, NULL for NMEA only */
+    const GpsProtocol *protocol;
+    GpsStream stream;
+    int interval_ms;
+
+    /* serial link, from the mbm.gps.config.* properties */
+    char device[PROPERTY_VALUE_MAX];    /* empty for the built-in list */
+    int baud;                   /* 0 to detect; the detected rate after */
+    int max_baud;               /* raise the receiver to this, 0 to keep */
+
+    /* debug.odroid.gps.replay / .record, see gps_replay.h */
+    int replay;                 /* reading a replayed log, not a receiver */
+    GpsRecord record;
+
+    /* epoch latency up to the return of the framework callbacks */
+    GpsLatency publish_latency; /* from the reader publishing the epoch */
+    GpsLatency arrival_latency; /* from the first byte of it being read */
 };
 
 struct gps_state state;
@@ -143,6 +174,13 @@ static void set_pending_command (char cmd) {
     write(state.control_fd[0], &cmd, 1);
 }
 
+/* the other end of the control socket, read by the reader thread, which
+ * owns the receiver fd while it runs
+ */
+static void set_reader_command (char cmd) {
+    write(state.control_fd[1], &cmd, 1);
+}
+
 static void nmea_received(void *line, void *data)
 {
     if (line == NULL) {
@@ -155,62 +193,290 @@ static void nmea_received(void *line, void *data)
     nmea_reader_add(state.reader, (char *) line);
 }
 
+static void close_receiver(void)
+{
+    close(state.fd);
+    state.fd = -1;
+    gps_record_close(&state.record);
+}
+
 static void start_gps ()
 {
     int ret;
+    char prop[PROPERTY_VALUE_MAX];
 
     D("%s: enter", __FUNCTION__);
 
-    if (state.ctrl_state == ST_STOPPED ||
+    if (state.thread_running) {
+        D("GPS is already started");
+    } else if (state.ctrl_state == ST_STOPPED ||
         state.ctrl_state == ST_FAILED ||
 	    state.ctrl_state == ST_UNDEFINED) {
         state.gps_status.status = GPS_STATUS_SESSION_BEGIN;
 
+        state.replay = 0;
+        state.record.fd = -1;
+        memset(&state.publish_latency, 0, sizeof(state.publish_latency));
+        memset(&state.arrival_latency, 0, sizeof(state.arrival_latency));
+        if (property_get("debug.odroid.gps.replay", prop, NULL) > 0) {
+            state.fd = gps_replay_open(prop, 0, NULL, NULL);
+            state.replay = 1;
+        } else if (state.device[0] != '\0') {
+            /* read-write so the receiver can be configured */
+            state.fd = open(state.device, O_RDWR | O_NOCTTY);
+        } else {
 #ifdef EXTERNAL_GPS
-        state.fd = open("/dev/ttyACM0", O_RDONLY); 
+        state.fd = open("/dev/ttyACM0", O_RDWR | O_NOCTTY); 
 		if (state.fd < 0)
-        	state.fd = open("/dev/ttyUSB0", O_RDONLY); 
+        	state.fd = open("/dev/ttyUSB0", O_RDWR | O_NOCTTY); 
 #else
-        state.fd = open("/dev/ttySAC2", O_RDONLY); 
+        state.fd = open("/dev/ttySAC2", O_RDWR | O_NOCTTY); 
 #endif
+        }
 
         if (state.fd < 0)
             return;
 
+        if (!state.replay &&
+            property_get("debug.odroid.gps.record", prop, NULL) > 0)
+            gps_record_open(&state.record, prop);
+
+        gps_stream_init(&state.stream, state.reader, state.protocol);
+
         set_pending_command(CMD_STATUS_CB);
 
+        state.stop_requested = 0;
         if (pthread_create( &state.thread, NULL, gps_state_thread, &state) != 0) {
             ALOGE("could not create gps thread: %s", strerror(errno));
+            close_receiver();
+            return;
         }
+        state.thread_running = 1;
 
     } else
         D("Stop the GPS before starting");
 
-    // disable echo on serial lines
-    if ( isatty( state.fd ) ) {
-        struct termios  ios;
-        tcgetattr( state.fd, &ios );
-        ios.c_lflag = 0;  					/* disable ECHO, ICANON, etc... */
-        ios.c_oflag &= (~ONLCR); 			/* Stop \n -> \r\n translation on output */
-        ios.c_iflag &= (~(ICRNL | INLCR)); 	/* Stop \r -> \n & \n -> \r translation on input */
-        ios.c_iflag |= (IGNCR | IXOFF);  	/* Ignore \r & XON/XOFF on input */
-        tcsetattr( state.fd, TCSANOW, &ios );
+    D("%s: exit", __FUNCTION__);
+}
+
+static const struct {
+    int baud;
+    speed_t speed;
+} baud_rates[] = {
+    /* in probing order: the usual receiver defaults first */
+    { 9600, B9600 },
+    { 38400, B38400 },
+    { 115200, B115200 },
+    { 4800, B4800 },
+    { 57600, B57600 },
+    { 19200, B19200 },
+    { 230400, B230400 },
+};
+
+#define NUM_BAUD_RATES  (int) (sizeof(baud_rates) / sizeof(baud_rates[0]))
+
+/* valid sentences or frames that identify a working rate */
+#define PROBE_MESSAGES  2
+/* per rate; a 1 Hz receiver sends at least one burst in this time */
+#define PROBE_MS        1500
+
+static int set_speed(int fd, int baud)
+{
+    struct termios ios;
+    int i;
+
+    for (i = 0; i < NUM_BAUD_RATES; i++) {
+        if (baud_rates[i].baud == baud)
+            break;
+    }
+    if (i == NUM_BAUD_RATES) {
+        ALOGE("unsupported baud rate %d", baud);
+        return -1;
     }
 
-    D("%s: exit", __FUNCTION__);
+    tcgetattr(fd, &ios);
+    cfsetispeed(&ios, baud_rates[i].speed);
+    cfsetospeed(&ios, baud_rates[i].speed);
+    if (tcsetattr(fd, TCSANOW, &ios) < 0)
+        return -1;
+    tcflush(fd, TCIFLUSH);
+    return 0;
+}
+
+static unsigned probe_count(NmeaReader * r, GpsStream * s)
+{
+    unsigned n = s->frames;
+    int i;
+
+    for (i = 0; i < NMEA_TYPE_COUNT; i++)
+        n += r->stats[i].accepted;
+    return n;
+}
+
+static void probe_pending(char cmd)
+{
+    (void) cmd;
+}
+
+/* Listen at the current rate until PROBE_MESSAGES pass their checksum.
+ * Garbage at a wrong rate practically never does.
+ */
+static int probe_link(int fd, int ms)
+{
+    NmeaReader *r = malloc(sizeof(*r));
+    GpsStream *s = malloc(sizeof(*s));
+    struct timespec start, now;
+    int found = 0;
+
+    if (r == NULL || s == NULL) {
+        free(r);
+        free(s);
+        return 0;
+    }
+    nmea_reader_init(r);
+    r->set_pending_callback_cb = probe_pending;
+    gps_stream_init(s, r, state.protocol);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        struct pollfd pfd[2];
+        char buff[256];
+        int left, ret;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = ms - ((now.tv_sec - start.tv_sec) * 1000 +
+                     (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (left <= 0)
+            break;
+
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = state.control_fd[0];
+        pfd[1].events = POLLIN;
+        ret = poll(pfd, 2, left);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        /* stop must not wait for the rest of the probe */
+        if (pfd[1].revents & POLLIN) {
+            char cmd;
+
+            if (read(pfd[1].fd, &cmd, 1) == 1 && cmd == CMD_STOP) {
+                state.stop_requested = 1;
+                break;
+            }
+            continue;
+        }
+        if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+            break;
+
+        ret = read(fd, buff, sizeof(buff));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        gps_stream_feed(s, buff, ret);
+        if (probe_count(r, s) >= PROBE_MESSAGES) {
+            found = 1;
+            break;
+        }
+    }
+
+    free(r);
+    free(s);
+    return found;
+}
+
+static int detect_baud(int fd)
+{
+    int i;
+
+    /* the last rate that worked first */
+    if (state.baud > 0 && set_speed(fd, state.baud) == 0 &&
+        probe_link(fd, PROBE_MS))
+        return state.baud;
+
+    for (i = 0; i < NUM_BAUD_RATES && !state.stop_requested; i++) {
+        if (baud_rates[i].baud == state.baud)
+            continue;
+        if (set_speed(fd, baud_rates[i].baud) < 0)
+            continue;
+        OTRACE("gps_probe", baud_rates[i].baud, 0, 0);
+        if (probe_link(fd, PROBE_MS))
+            return baud_rates[i].baud;
+    }
+    return -1;
+}
+
+/* Raw 8N1 at the detected rate, raised to max_baud if the protocol can
+ * tell the receiver to switch.
+ */
+static void setup_link(int fd)
+{
+    struct termios ios;
+    int baud;
+
+    if (!isatty(fd))
+        return;
+
+    /* binary frames need every byte as sent: no echo, no \r or \n
+     * translation, no XON/XOFF; the NMEA framer copes with the \r
+     */
+    tcgetattr(fd, &ios);
+    cfmakeraw(&ios);
+    ios.c_cflag |= CLOCAL | CREAD;
+    ios.c_cc[VMIN] = 1;
+    ios.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &ios);
+
+    baud = detect_baud(fd);
+    if (state.stop_requested)
+        return;
+    if (baud < 0) {
+        ALOGE("no NMEA at any baud rate, staying at %d",
+              state.baud > 0 ? state.baud : baud_rates[0].baud);
+        set_speed(fd, state.baud > 0 ? state.baud : baud_rates[0].baud);
+        return;
+    }
+    ALOGD("receiver found at %d baud", baud);
+    state.baud = baud;
+
+    if (state.max_baud > baud && state.protocol != NULL &&
+        state.protocol->set_baud != NULL) {
+        state.protocol->set_baud(fd, state.max_baud);
+        tcdrain(fd);
+        if (set_speed(fd, state.max_baud) == 0 && probe_link(fd, PROBE_MS)) {
+            ALOGD("receiver switched to %d baud", state.max_baud);
+            state.baud = state.max_baud;
+        } else {
+            ALOGE("receiver did not switch to %d baud", state.max_baud);
+            set_speed(fd, baud);
+        }
+    }
 }
 
 static void stop_gps ()
 {
     int ret;
+    char cmd;
 
     D("%s: enter", __FUNCTION__);
 
-    if (state.ctrl_state == ST_STOPPING || state.ctrl_state == ST_STOPPED)
+    if (state.ctrl_state == ST_STOPPING || state.ctrl_state == ST_STOPPED ||
+        !state.thread_running)
         D("GPS is already stopped or stopping");
     else {
-        close(state.fd);        
-        state.fd = -1;
+        /* the reader thread may be probing: it owns the fds, the reader
+         * and the stream until it has gone
+         */
+        set_reader_command(CMD_STOP);
+        pthread_join(state.thread, NULL);
+        state.thread_running = 0;
+        /* a thread that ended on its own left the command unread */
+        while (recv(state.control_fd[0], &cmd, 1, MSG_DONTWAIT) == 1)
+            ;
+        close_receiver();
         state.gps_status.status = GPS_STATUS_SESSION_END;
         set_pending_command(CMD_STATUS_CB);
     }
@@ -247,6 +513,55 @@ static int epoll_deregister(int epoll_fd, int fd)
     return ret;
 }
 
+static void latency_add(GpsLatency *l, int64_t since, int64_t now)
+{
+    if (since == 0)
+        return;
+    l->count++;
+    l->sum_ns += now - since;
+    if (now - since > l->max_ns)
+        l->max_ns = now - since;
+}
+
+static void latency_dump(int fd, const char *name, const GpsLatency *l)
+{
+    char line[96];
+    int n;
+
+    n = snprintf(line, sizeof(line), "%s latency us: count %u avg %lld max %lld\n",
+                 name, l->count,
+                 l->count ? (long long) (l->sum_ns / l->count / 1000) : 0LL,
+                 (long long) (l->max_ns / 1000));
+    write(fd, line, n);
+}
+
+/* one byte on the control socket per epoch published by the reader */
+static void deliver_record(void)
+{
+    NmeaReader *r = state.reader;
+    NmeaRecord *rec = nmea_reader_next_record(r);
+    int64_t now;
+    int i;
+
+    if (rec == NULL)
+        return;
+
+    OTRACE("gps_epoch", rec->flags, rec->count, 0);
+    for (i = 0; i < rec->count; i++)
+        r->nmea_callback(rec->sentence[i].timestamp,
+                         rec->batch + rec->sentence[i].offset,
+                         rec->sentence[i].length);
+    if (rec->flags & NMEA_EPOCH_HAS_SV_STATUS)
+        r->sv_status_callback(&rec->sv_status);
+    if (rec->flags & NMEA_EPOCH_HAS_FIX)
+        r->callback(&rec->fix);
+
+    now = nmea_now_ns();
+    latency_add(&state.publish_latency, rec->publish_ns, now);
+    latency_add(&state.arrival_latency, rec->arrival_ns, now);
+    nmea_reader_release_record(r);
+}
+
 /* this loop is needed to be able to run callbacks in
  * the correct thread, created with the create_thread callback
  */
@@ -285,22 +600,15 @@ static void main_loop (void *arg)
                     ret = read(fd, &cmd, 1);
                 } while (ret < 0 && errno == EINTR);
 
+		OTRACE("gps_cmd", cmd, 0, 0);
 		switch (cmd) {
-		    D("%s cmd %d", __FUNCTION__, (int) cmd); 
 		case CMD_STATUS_CB:
 		   state.status_callback(&state.gps_status);
 		   break;
 		case CMD_AGPS_STATUS_CB:
 		    break;
-		case CMD_SV_STATUS_CB:
-                    state.reader->sv_status_callback(&state.reader->sv_status);
-                    break;
-                case CMD_LOCATION_CB:
-                    state.reader->callback(&state.reader->fix);
-                    break;
-                case CMD_NMEA_CB:
-		    state.reader->nmea_callback(time(NULL)*1000,
-			state.reader->in, state.reader->pos + 1);
+		case CMD_EPOCH_CB:
+                    deliver_record();
                     break;
                 case CMD_QUIT:
                     goto exit;
@@ -320,24 +628,54 @@ exit:
     epoll_deregister(epoll_fd, control_fd);
 }
 
+/* reader thread only, so commands never interleave with probing */
+static void configure_receiver(int fd)
+{
+    if (state.replay || state.protocol == NULL)
+        return;
+    if (state.protocol->configure(fd, state.interval_ms) < 0)
+        ALOGE("could not configure the receiver for %s",
+              state.protocol->name);
+}
+
 static void*
 gps_state_thread( void*  arg )
 {
     int         epoll_fd   = epoll_create(1);
     int         started    = 0;
     int         gps_fd     = 0;
+    int         control_fd = state.control_fd[0];
     gps_fd = state.fd;
 
+    /* probing may take a few seconds, so it runs here and not in start;
+     * a replayed log has no receiver to set up
+     */
+    if (!state.replay)
+        setup_link(gps_fd);
+    if (state.stop_requested)
+        goto Exit;
+    configure_receiver(gps_fd);
+
     // register control file descriptors for polling
     epoll_register( epoll_fd, gps_fd );
+    epoll_register( epoll_fd, control_fd );
 
     D("gps thread running gps_fd = %d", gps_fd);
 	
     for (;;) {
         struct epoll_event   events[1];
         int nevents;
-
-        nevents = epoll_wait( epoll_fd, events, 1, -1 );
+        int timeout;
+
+        /* receivers send an epoch as one burst: once the line goes quiet
+         * the open epoch is complete
+         */
+        timeout = nmea_reader_pending(state.reader) ? NMEA_EPOCH_IDLE_MS : -1;
+        nevents = epoll_wait( epoll_fd, events, 1, timeout );
+        if (nevents == 0) {
+            nmea_reader_flush(state.reader);
+            continue;
+        }
         if (nevents < 0) {
             if (errno != EINTR)
                 ALOGE("epoll_wait() unexpected error: %s", strerror(errno));
@@ -354,7 +692,7 @@ gps_state_thread( void*  arg )
             if (fd == gps_fd)
             {
                 char  buff[512];
-                int  nn, ret;
+                int  ret;
                 
                 D("gps fd event");
                
@@ -362,14 +700,30 @@ gps_state_thread( void*  arg )
                     ret = read(fd, buff, sizeof(buff));
                 }	while(ret < 0 && errno == EINTR); 
                 
-                if (ret > 0)	{
-                    for (nn = 0; nn < ret; nn++)	
-                        nmea_reader_addc(&state.reader, buff[nn]);
-                }
+                OTRACE("gps_read", ret, 0, 0);
+                if (ret > 0 && state.record.fd >= 0)
+                    gps_record_write(&state.record, buff, ret);
+                if (ret > 0)
+                    gps_stream_feed(&state.stream, buff, ret);
 
 
                 D("gps fd event end");
             }
+            else if (fd == control_fd)
+            {
+                char cmd = 255;
+                int ret;
+
+                do {
+                    ret = read(fd, &cmd, 1);
+                } while (ret < 0 && errno == EINTR);
+
+                OTRACE("gps_reader_cmd", cmd, 0, 0);
+                if (ret == 1 && cmd == CMD_CONFIGURE)
+                    configure_receiver(gps_fd);
+                if (ret == 1 && cmd == CMD_STOP)
+                    goto Exit;
+            }
             else
             {
                 ALOGE("epoll_wait() returned unkown fd %d ?", fd);
@@ -378,6 +732,7 @@ gps_state_thread( void*  arg )
     }
 
 Exit:
+    close(epoll_fd);
     return NULL;
 }
 
@@ -400,6 +755,8 @@ static int odroid_gps_init(GpsCallbacks * callbacks)
     }
 
     memset(&state, 0, sizeof(struct gps_state));
+    state.fd = -1;
+    state.record.fd = -1;
     state.int_state = INT_STATE_UNDEFINED;
     state.have_supl_apn = 0;
      
@@ -410,15 +767,34 @@ static int odroid_gps_init(GpsCallbacks * callbacks)
         D("Using gps ctrl device: %s", prop);
     }
 
-    if (property_get("mbm.gps.config.gps_nmea", prop, "") == 0) {
+    if (property_get("mbm.gps.config.gps_nmea", state.device, "") == 0) {
         D("No gps nmea device set, using the default instead.");
-        snprintf(prop, PROPERTY_VALUE_MAX, "%s", "/dev/ttyACM2");
     } else {
-        D("Using gps nmea device: %s", prop);
+        D("Using gps nmea device: %s", state.device);
     }
 
+    /* "auto" or a fixed rate */
+    property_get("mbm.gps.config.baud", prop, "auto");
+    state.baud = atoi(prop);
+    property_get("mbm.gps.config.max_baud", prop, "0");
+    state.max_baud = atoi(prop);
+
     nmea_reader_init(state.reader);
 
+    /* "1" for a receiver that sends sentences without checksums; those
+     * only reach nmea_cb
+     */
+    property_get("mbm.gps.config.unchecked_nmea", prop, "0");
+    state.reader->unchecked_nmea = atoi(prop) > 0;
+
+    /* "ubx" decodes u-blox binary navigation messages beside NMEA */
+    property_get("mbm.gps.config.rate", prop, "1000");
+    state.interval_ms = atoi(prop) > 0 ? atoi(prop) : 1000;
+    property_get("mbm.gps.config.protocol", prop, "nmea");
+    if (!strcmp(prop, ubx_protocol.name))
+        state.protocol = &ubx_protocol;
+    D("Using protocol %s", state.protocol ? state.protocol->name : "nmea");
+
     state.control_fd[0] = -1;
     state.control_fd[1] = -1;
     if (socketpair(AF_LOCAL, SOCK_STREAM, 0, state.control_fd) < 0) {
@@ -460,6 +836,9 @@ static void odroid_gps_cleanup(void)
         }
     }
 
+    /* the reader thread uses the control socket until it is joined */
+    if (state.thread_running)
+        stop_gps();
     set_pending_command(CMD_QUIT);
 
     close(state.control_fd[0]);
@@ -485,10 +864,53 @@ static int odroid_gps_start()
     return 0;
 }
 
+/* "setprop debug.odroid.gps.trace <file>" keeps the trace of each session */
+static void dump_trace(void)
+{
+    char path[PROPERTY_VALUE_MAX];
+    int fd;
+
+    if (property_get("debug.odroid.gps.trace", path, NULL) <= 0)
+        return;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ALOGE("cannot write trace to %s: %s", path, strerror(errno));
+        return;
+    }
+    otrace_dump(fd);
+    close(fd);
+}
+
+/* "setprop debug.odroid.gps.stats <file>" keeps the checksum counters
+ * and the epoch latencies
+ */
+static void dump_stats(void)
+{
+    char path[PROPERTY_VALUE_MAX];
+    int fd;
+
+    if (property_get("debug.odroid.gps.stats", path, NULL) <= 0)
+        return;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ALOGE("cannot write stats to %s: %s", path, strerror(errno));
+        return;
+    }
+    nmea_reader_dump_stats(state.reader, fd);
+    gps_stream_dump_stats(&state.stream, fd);
+    latency_dump(fd, "publish", &state.publish_latency);
+    latency_dump(fd, "arrival", &state.arrival_latency);
+    close(fd);
+}
+
 static int odroid_gps_stop()
 {
     D("%s: enter", __FUNCTION__);
     stop_gps();    
+    dump_trace();
+    dump_stats();
     D("%s: exit 0", __FUNCTION__);
     return 0;
 }
@@ -557,6 +979,13 @@ static int odroid_gps_set_position_mode(GpsPositionMode mode,
 	ALOGD("%s:enter  %s min_interval = %d pref=%d", __FUNCTION__,
 			get_mode_name(mode), min_interval, preferred_time);
 
+	/* the receiver computes no more fixes than asked for */
+	if (min_interval > 0 && (int) min_interval != state.interval_ms) {
+		state.interval_ms = min_interval;
+		if (state.fd >= 0)
+			set_reader_command(CMD_CONFIGURE);
+	}
+
 	switch (mode) {
 	case GPS_POSITION_MODE_MS_BASED:
 		ALOGE("MS_BASED mode setting SUPL");
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * u-blox UBX protocol: NAV-PVT for the fix, NAV-SAT for the satellites.
+ *
+ * Frame: 0xb5 0x62, class, id, little endian payload length, payload and
+ * an 8-bit Fletcher checksum over everything from class to the end of
+ * the payload.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "gps_protocol.h"
+
+#define UBX_SYNC1           0xb5
+#define UBX_SYNC2           0x62
+#define UBX_HEADER_LEN      6
+#define UBX_OVERHEAD        8
+
+#define UBX_CLASS_NAV       0x01
+#define UBX_CLASS_ACK       0x05
+#define UBX_CLASS_CFG       0x06
+#define UBX_CLASS_NMEA      0xf0
+
+#define UBX_NAV_PVT         0x07
+#define UBX_NAV_SAT         0x35
+#define UBX_ACK_NAK         0x00
+#define UBX_ACK_ACK         0x01
+#define UBX_CFG_PRT         0x00
+#define UBX_CFG_MSG         0x01
+#define UBX_CFG_RATE        0x08
+
+#define UBX_NAV_PVT_LEN     92
+#define UBX_NAV_SAT_HDR     8
+#define UBX_NAV_SAT_SV      12
+
+/* NAV-PVT valid and flags bits */
+#define UBX_PVT_VALID_DATE  0x01
+#define UBX_PVT_VALID_TIME  0x02
+#define UBX_PVT_FIX_OK      0x01
+
+/* NAV-SAT flags bit */
+#define UBX_SAT_USED        0x08
+
+#define MS_PER_DAY          (24 * 3600 * 1000)
+
+static uint16_t u2(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t u4(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static int32_t i4(const unsigned char *p)
+{
+    return (int32_t) u4(p);
+}
+
+static void ubx_checksum(const unsigned char *p, int len, unsigned char *ck)
+{
+    unsigned a = 0, b = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        a += p[i];
+        b += a;
+    }
+    ck[0] = a;
+    ck[1] = b;
+}
+
+static int ubx_frame_len(const unsigned char *hdr)
+{
+    return UBX_OVERHEAD + u2(hdr + 4);
+}
+
+static void ubx_nav_pvt(NmeaReader * r, const unsigned char *p)
+{
+    uint32_t itow = u4(p);
+    int fix_type = p[20];
+    int tod;
+
+    /* GPS time of week only orders the epochs, the fix carries UTC */
+    nmea_reader_set_epoch(r, itow % MS_PER_DAY);
+    r->binary = 1;
+
+    if (!(p[21] & UBX_PVT_FIX_OK) || fix_type < 2 || fix_type > 4) {
+        OTRACE("ubx_no_fix", fix_type, p[21], p[23]);
+        return;
+    }
+
+    if ((p[11] & (UBX_PVT_VALID_DATE | UBX_PVT_VALID_TIME)) ==
+        (UBX_PVT_VALID_DATE | UBX_PVT_VALID_TIME)) {
+        /* nano is -1e9..1e9 around the whole second */
+        tod = ((p[8] * 60 + p[9]) * 60 + p[10]) * 1000 + i4(p + 16) / 1000000;
+        r->fix.timestamp = nmea_reader_utc_time(r, u2(p + 4), p[6], p[7], tod);
+    }
+
+    r->fix.flags = GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_SPEED |
+        GPS_LOCATION_HAS_BEARING | GPS_LOCATION_HAS_ACCURACY;
+    r->fix.longitude = i4(p + 24) * 1e-7;
+    r->fix.latitude = i4(p + 28) * 1e-7;
+    if (fix_type != 2) {
+        /* above mean sea level, like the GGA altitude */
+        r->fix.flags |= GPS_LOCATION_HAS_ALTITUDE;
+        r->fix.altitude = i4(p + 36) * 1e-3;
+    }
+    r->fix.accuracy = u4(p + 40) * 1e-3;
+    r->fix.speed = i4(p + 60) * 1e-3;
+    r->fix.bearing = i4(p + 64) * 1e-5;
+    r->update = 1;
+}
+
+/* gnssId of NAV-SAT to the NMEA_SYS_* tables, -1 for SBAS */
+static int ubx_system(int gnss)
+{
+    switch (gnss) {
+    case 0:
+        return NMEA_SYS_GPS;
+    case 2:
+        return NMEA_SYS_GALILEO;
+    case 3:
+        return NMEA_SYS_BEIDOU;
+    case 5:
+        return NMEA_SYS_QZSS;
+    case 6:
+        return NMEA_SYS_GLONASS;
+    default:
+        return -1;
+    }
+}
+
+static void ubx_nav_sat(NmeaReader * r, const unsigned char *p, int len)
+{
+    GpsSvStatus *st = &r->sv_status;
+    int count = p[5];
+    uint32_t used = 0;
+    int i, n = 0;
+
+    nmea_reader_set_epoch(r, u4(p) % MS_PER_DAY);
+
+    if (UBX_NAV_SAT_HDR + count * UBX_NAV_SAT_SV > len)
+        count = (len - UBX_NAV_SAT_HDR) / UBX_NAV_SAT_SV;
+
+    for (i = 0; i < count && n < GPS_MAX_SVS; i++) {
+        const unsigned char *sv = p + UBX_NAV_SAT_HDR + i * UBX_NAV_SAT_SV;
+        int sys = ubx_system(sv[0]);
+        int svid;
+
+        if (sys < 0) {
+            /* SBAS PRN 120-158 is NMEA 33-71 */
+            if (sv[0] != 1)
+                continue;
+            svid = sv[1] - 87;
+        } else {
+            svid = nmea_sv_id(sys, sv[1]);
+        }
+        if (svid <= 0 || svid > NMEA_MAX_SV_ID)
+            continue;
+
+        st->sv_list[n].size = sizeof(st->sv_list[n]);
+        st->sv_list[n].prn = svid;
+        st->sv_list[n].snr = sv[2];
+        st->sv_list[n].elevation = (signed char) sv[3];
+        st->sv_list[n].azimuth = (int16_t) u2(sv + 4);
+        n++;
+
+        /* the mask only has room for GPS */
+        if ((u4(sv + 8) & UBX_SAT_USED) && svid <= 32)
+            used |= 1u << (svid - 1);
+    }
+
+    st->num_svs = n;
+    st->used_in_fix_mask = used;
+    r->sv_status_changed = 1;
+    r->binary = 1;
+}
+
+static int ubx_decode(NmeaReader * r, const unsigned char *frame, int len)
+{
+    const unsigned char *payload = frame + UBX_HEADER_LEN;
+    int plen = len - UBX_OVERHEAD;
+    unsigned char ck[2];
+
+    ubx_checksum(frame + 2, len - 4, ck);
+    if (ck[0] != frame[len - 2] || ck[1] != frame[len - 1]) {
+        OTRACE("ubx_bad_checksum", frame[2] << 8 | frame[3], plen, 0);
+        return -1;
+    }
+
+    OTRACE("ubx_frame", frame[2] << 8 | frame[3], plen, 0);
+    switch (frame[2] << 8 | frame[3]) {
+    case UBX_CLASS_NAV << 8 | UBX_NAV_PVT:
+        if (plen >= UBX_NAV_PVT_LEN)
+            ubx_nav_pvt(r, payload);
+        break;
+    case UBX_CLASS_NAV << 8 | UBX_NAV_SAT:
+        if (plen >= UBX_NAV_SAT_HDR)
+            ubx_nav_sat(r, payload, plen);
+        break;
+    case UBX_CLASS_ACK << 8 | UBX_ACK_NAK:
+        if (plen >= 2)
+            ALOGW("receiver rejected UBX %02x-%02x", payload[0], payload[1]);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+static int ubx_send(int fd, int cls, int id, const unsigned char *payload,
+                    int len)
+{
+    unsigned char frame[UBX_OVERHEAD + 20];
+    int ret;
+
+    frame[0] = UBX_SYNC1;
+    frame[1] = UBX_SYNC2;
+    frame[2] = cls;
+    frame[3] = id;
+    frame[4] = len;
+    frame[5] = 0;
+    memcpy(frame + UBX_HEADER_LEN, payload, len);
+    ubx_checksum(frame + 2, len + 4, frame + UBX_HEADER_LEN + len);
+
+    do {
+        ret = write(fd, frame, len + UBX_OVERHEAD);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != len + UBX_OVERHEAD) {
+        ALOGE("cannot send UBX %02x-%02x: %s", cls, id, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* message rate on the port the command arrives on */
+static int ubx_set_rate(int fd, int cls, int id, int rate)
+{
+    unsigned char msg[3];
+
+    msg[0] = cls;
+    msg[1] = id;
+    msg[2] = rate;
+    return ubx_send(fd, UBX_CLASS_CFG, UBX_CFG_MSG, msg, sizeof(msg));
+}
+
+/* NMEA sentences the binary messages make redundant; RMC and GGA stay
+ * for the framework's NMEA listeners
+ */
+static const unsigned char ubx_quiet_nmea[] = {
+    0x01,                       /* GLL */
+    0x02,                       /* GSA */
+    0x03,                       /* GSV */
+    0x05,                       /* VTG */
+};
+
+static int ubx_configure(int fd, int interval_ms)
+{
+    unsigned char rate[6];
+    unsigned i;
+    int ret = 0;
+
+    /* no more fixes than asked for, up to what the u2 field holds */
+    if (interval_ms < 100)
+        interval_ms = 100;
+    if (interval_ms > 65535)
+        interval_ms = 65535;
+
+    /* measurement period in ms, one solution per measurement, GPS time */
+    rate[0] = interval_ms & 0xff;
+    rate[1] = interval_ms >> 8;
+    rate[2] = 1;
+    rate[3] = 0;
+    rate[4] = 1;
+    rate[5] = 0;
+    ret |= ubx_send(fd, UBX_CLASS_CFG, UBX_CFG_RATE, rate, sizeof(rate));
+
+    ret |= ubx_set_rate(fd, UBX_CLASS_NAV, UBX_NAV_PVT, 1);
+    ret |= ubx_set_rate(fd, UBX_CLASS_NAV, UBX_NAV_SAT, 1);
+    for (i = 0; i < sizeof(ubx_quiet_nmea); i++)
+        ret |= ubx_set_rate(fd, UBX_CLASS_NMEA, ubx_quiet_nmea[i], 0);
+
+    ALOGD("UBX configured for %d ms", interval_ms);
+    return ret ? -1 : 0;
+}
+
+static void put_u4(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* CFG-PRT for UART1: 8N1, UBX and NMEA in and out.  The receiver
+ * switches as soon as it has taken the command, so no ACK is waited for.
+ */
+static int ubx_set_baud(int fd, int baud)
+{
+    unsigned char prt[20];
+
+    memset(prt, 0, sizeof(prt));
+    prt[0] = 1;                 /* UART1 */
+    put_u4(prt + 4, 0x000008d0);        /* 8 bits, no parity, 1 stop bit */
+    put_u4(prt + 8, baud);
+    prt[12] = 0x03;             /* in: UBX + NMEA */
+    prt[14] = 0x03;             /* out: UBX + NMEA */
+    return ubx_send(fd, UBX_CLASS_CFG, UBX_CFG_PRT, prt, sizeof(prt));
+}
+
+const GpsProtocol ubx_protocol = {
+    "ubx",
+    { UBX_SYNC1, UBX_SYNC2 },
+    UBX_HEADER_LEN,
+    ubx_frame_len,
+    ubx_decode,
+    ubx_configure,
+    ubx_set_baud,
+};
@@ -0,0 +1,31 @@
+# Binary event trace shared by the odroid HALs.
+
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	odroid_trace.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)
+
+LOCAL_CFLAGS += -Wall -Wextra
+
+LOCAL_MODULE := libodroid_trace
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_STATIC_LIBRARY)
+
+# for the host tools of libodroid-gps
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	odroid_trace.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)
+
+LOCAL_CFLAGS += -Wall -Wextra
+
+LOCAL_MODULE := libodroid_trace
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_STATIC_LIBRARY)
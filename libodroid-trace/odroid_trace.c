@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "odroid-trace"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "odroid_trace.h"
+
+#ifndef HAVE_ANDROID_OS
+/* host build for the GPS tools; glibc has no gettid() */
+#include <sys/syscall.h>
+#define gettid() ((pid_t) syscall(SYS_gettid))
+#endif
+
+struct otrace_record {
+    uint64_t        ts;
+    const char      *tag;
+    int32_t         tid;
+    int32_t         arg[3];
+};
+
+struct otrace_ring {
+    volatile int32_t    owner;      /* tid of the writing thread, 0 if free */
+    volatile uint32_t   head;       /* total events written */
+    struct otrace_record *events;
+};
+
+static struct otrace_ring rings[OTRACE_MAX_RINGS];
+static volatile uint32_t lost;      /* events dropped for want of a ring */
+static int enabled;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static void ring_release(void *arg)
+{
+    struct otrace_ring *ring = arg;
+
+    /* the events stay readable until another thread takes the slot */
+    __sync_synchronize();
+    ring->owner = 0;
+}
+
+static void ring_init(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get("debug.odroid.trace", value, "1");
+    enabled = atoi(value) != 0;
+    if (pthread_key_create(&ring_key, ring_release) != 0) {
+        ALOGE("no thread key for trace rings, tracing disabled");
+        enabled = 0;
+    }
+}
+
+static struct otrace_ring *ring_claim(void)
+{
+    int32_t tid = gettid();
+    int i;
+
+    for (i = 0; i < OTRACE_MAX_RINGS; i++) {
+        struct otrace_ring *ring = &rings[i];
+
+        if (!__sync_bool_compare_and_swap(&ring->owner, 0, tid))
+            continue;
+        if (ring->events == NULL) {
+            ring->events = calloc(OTRACE_RING_EVENTS, sizeof(*ring->events));
+            if (ring->events == NULL) {
+                ring->owner = 0;
+                return NULL;
+            }
+        }
+        pthread_setspecific(ring_key, ring);
+        return ring;
+    }
+
+    return NULL;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void otrace_event(const char *tag, int32_t a0, int32_t a1, int32_t a2)
+{
+    struct otrace_ring *ring;
+    struct otrace_record *ev;
+    uint32_t head;
+
+    pthread_once(&ring_once, ring_init);
+    if (!enabled)
+        return;
+
+    ring = pthread_getspecific(ring_key);
+    if (ring == NULL) {
+        ring = ring_claim();
+        if (ring == NULL) {
+            /* threads that never exit keep their ring: say so once */
+            if (__sync_fetch_and_add(&lost, 1) == 0)
+                ALOGW("all %d trace rings are taken, events of thread %d "
+                      "and later ones are dropped", OTRACE_MAX_RINGS, gettid());
+            return;
+        }
+    }
+
+    /* single writer per ring: fill the slot, then publish the new head */
+    head = ring->head;
+    ev = &ring->events[head & (OTRACE_RING_EVENTS - 1)];
+    ev->ts = now_ns();
+    ev->tag = tag;
+    ev->tid = ring->owner;
+    ev->arg[0] = a0;
+    ev->arg[1] = a1;
+    ev->arg[2] = a2;
+    __sync_synchronize();
+    ring->head = head + 1;
+}
+
+static int record_cmp(const void *a, const void *b)
+{
+    const struct otrace_record *ra = a;
+    const struct otrace_record *rb = b;
+
+    if (ra->ts != rb->ts)
+        return ra->ts < rb->ts ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Copy each ring out, keeping only slots the writer cannot have reused
+ * while we were copying, then merge everything by timestamp.
+ */
+void otrace_dump(int fd)
+{
+    struct otrace_record *all;
+    size_t count = 0;
+    char line[160];
+    int i, len;
+
+    pthread_once(&ring_once, ring_init);
+
+    all = malloc(sizeof(*all) * OTRACE_RING_EVENTS * OTRACE_MAX_RINGS);
+    if (all == NULL)
+        return;
+
+    for (i = 0; i < OTRACE_MAX_RINGS; i++) {
+        struct otrace_ring *ring = &rings[i];
+        uint32_t start, end, after, n;
+
+        if (ring->events == NULL)
+            continue;
+
+        end = ring->head;
+        __sync_synchronize();
+        start = end > OTRACE_RING_EVENTS ? end - OTRACE_RING_EVENTS : 0;
+        for (n = start; n < end; n++)
+            all[count + n - start] = ring->events[n & (OTRACE_RING_EVENTS - 1)];
+        __sync_synchronize();
+        after = ring->head;
+
+        /* anything the writer lapped during the copy is torn */
+        if (after > OTRACE_RING_EVENTS && after - OTRACE_RING_EVENTS > start) {
+            uint32_t skip = after - OTRACE_RING_EVENTS - start;
+
+            if (skip >= end - start)
+                continue;
+            memmove(&all[count], &all[count + skip],
+                    sizeof(*all) * (end - start - skip));
+            start += skip;
+        }
+        count += end - start;
+    }
+
+    qsort(all, count, sizeof(*all), record_cmp);
+
+    len = snprintf(line, sizeof(line), "trace: %u events, %u lost\n",
+                   (unsigned) count, (unsigned) lost);
+    write(fd, line, len);
+    for (i = 0; i < (int) count; i++) {
+        len = snprintf(line, sizeof(line), "%llu.%09llu %5d %-28s %d %d %d\n",
+                       (unsigned long long) (all[i].ts / 1000000000ULL),
+                       (unsigned long long) (all[i].ts % 1000000000ULL),
+                       all[i].tid, all[i].tag ? all[i].tag : "?",
+                       all[i].arg[0], all[i].arg[1], all[i].arg[2]);
+        if (len > (int) sizeof(line) - 1)
+            len = sizeof(line) - 1;
+        write(fd, line, len);
+    }
+
+    free(all);
+}
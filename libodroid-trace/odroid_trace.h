@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ODROID_TRACE_H
+#define ODROID_TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary event trace shared by the odroid HALs.
+ *
+ * Every thread that records an event gets its own ring, claimed from a
+ * fixed pool on first use, so recording never takes a lock and never
+ * formats text.  An event is a tag, a CLOCK_MONOTONIC timestamp in
+ * nanoseconds and three integer arguments.  Tags must be string literals
+ * (or other storage that outlives the process); only the pointer is kept
+ * and it is resolved when the rings are decoded by otrace_dump().
+ *
+ * A ring is given back when its thread exits.  Threads that live as
+ * long as the process (binder threads) keep theirs, so once the pool is
+ * used up later threads are not traced; this is logged once and the
+ * dropped events are counted in the dump header.
+ *
+ * Recording is on by default and can be switched off with
+ * "setprop debug.odroid.trace 0" before the HAL is loaded.
+ */
+
+#define OTRACE_RING_EVENTS      512     /* per thread, power of two */
+#define OTRACE_MAX_RINGS        16
+
+void otrace_event(const char *tag, int32_t a0, int32_t a1, int32_t a2);
+
+/* Decode all rings, oldest event first, as text to fd. */
+void otrace_dump(int fd);
+
+#define OTRACE(tag, a0, a1, a2)     otrace_event((tag), (a0), (a1), (a2))
+#define OTRACE_FUNC()               otrace_event(__FUNCTION__, __LINE__, 0, 0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ODROID_TRACE_H */